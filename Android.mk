@@ -10,6 +10,9 @@ SERVALD_SRC_FILES = \
 	serval-dna/overlay_payload.c       \
 	serval-dna/overlay_route.c         \
 	serval-dna/overlay_mdp.c	\
+	serval-dna/overlay_nack.c	\
+	serval-dna/overlay_capture.c	\
+	serval-dna/overlay_netlink.c	\
         serval-dna/batman.c        \
         serval-dna/ciphers.c       \
 	serval-dna/cli.c	\
@@ -40,11 +43,14 @@ SERVALD_SRC_FILES = \
 	serval-dna/rhizome_http.c \
 	serval-dna/rhizome_packetformats.c \
         serval-dna/responses.c     \
+	serval-dna/selftest.c \
 	serval-dna/serval_packetvisualise.c \
         serval-dna/server.c        \
 	serval-dna/sha2.c          \
 	serval-dna/simulate.c      \
         serval-dna/srandomdev.c    \
+	serval-dna/stats.c \
+	serval-dna/mem_pool.c \
 	serval-dna/str.c	\
 	serval-dna/keyring.c       \
 	serval-dna/vomp.c \
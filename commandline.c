@@ -38,6 +38,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rhizome.h"
 #include "strbuf.h"
 #include "mdp_client.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
 #include "cli.h"
 
 extern struct command_line_option command_line_options[];
@@ -1429,6 +1431,57 @@ int app_id_self(int argc, const char *const *argv, struct command_line_option *o
   return 0;
 }
 
+/* Print "key=value" lines as "key:value" command output */
+void cli_keyvalues(char *text)
+{
+  char *p=text;
+  while(*p){
+    char *eol=strchr(p,'\n');
+    if (eol) *eol=0;
+    char *value=strchr(p,'=');
+    if (value){
+      *value++=0;
+      cli_puts(p); cli_delim(":");
+      cli_puts(value); cli_delim("\n");
+    }
+    if (!eol)
+      break;
+    p=eol+1;
+  }
+}
+
+int app_stats(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  overlay_mdp_frame mdp;
+  unsigned int line=0;
+  unsigned int total_lines=1;
+  
+  /* The server sends as many lines as fit in each reply, so keep asking until we have them all */
+  while(line<total_lines){
+    bzero(&mdp, sizeof(overlay_mdp_frame));
+    mdp.packetTypeAndFlags=MDP_STATS;
+    mdp.stats.first_line=line;
+    if (overlay_mdp_send(&mdp,MDP_AWAITREPLY,5000)) {
+      if (mdp.packetTypeAndFlags==MDP_ERROR)
+	WHYF("  MDP Server error #%d: '%s'",mdp.error.error,mdp.error.message);
+      return WHY("Could not get server stats");
+    }
+    if ((mdp.packetTypeAndFlags&MDP_TYPE_MASK)!=MDP_STATS)
+      return WHY("MDP Server returned something other than stats");
+    if (mdp.stats.line_count==0 || mdp.stats.text_length>sizeof(mdp.stats.text))
+      break;
+    
+    char text[sizeof(mdp.stats.text)+1];
+    bcopy(mdp.stats.text, text, mdp.stats.text_length);
+    text[mdp.stats.text_length]=0;
+    cli_keyvalues(text);
+    line+=mdp.stats.line_count;
+    total_lines=mdp.stats.total_lines;
+  }
+  return 0;
+}
+
 int app_test_rfs(int argc, const char *const *argv, struct command_line_option *o, void *context)
 {
   if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
@@ -1472,6 +1525,509 @@ int app_crypt_test(int argc, const char *const *argv, struct command_line_option
   return 0;
 }
 
+static void scheduler_test_alarm(struct sched_ent *alarm)
+{
+}
+
+int app_scheduler_test(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *count;
+  if (cli_arg(argc, argv, o, "count", &count, NULL, "100000") == -1)
+    return -1;
+  int icount=atoi(count);
+  if (icount<1)
+    return WHY("Count must be at least 1");
+  
+  struct sched_ent *alarms = calloc(icount, sizeof(struct sched_ent));
+  if (!alarms)
+    return WHY("calloc() failed");
+  
+  int i;
+  time_ms_t base = gettime_ms() + 3600000;
+  
+  time_ms_t start = gettime_ms();
+  for (i=0;i<icount;i++){
+    alarms[i].function = scheduler_test_alarm;
+    alarms[i].alarm = base + (random()%60000);
+    alarms[i].deadline = alarms[i].alarm + 1000;
+    schedule(&alarms[i]);
+  }
+  time_ms_t end = gettime_ms();
+  printf("%d alarms - schedule took %lldms - mean time = %.3fus\n",
+	 icount, (long long) end - start, (end - start) * 1000.0 / icount);
+  
+  start = gettime_ms();
+  for (i=0;i<icount;i++){
+    alarms[i].alarm = base + (random()%60000);
+    alarms[i].deadline = alarms[i].alarm + 1000;
+    schedule(&alarms[i]);
+  }
+  end = gettime_ms();
+  printf("%d alarms - reschedule took %lldms - mean time = %.3fus\n",
+	 icount, (long long) end - start, (end - start) * 1000.0 / icount);
+  
+  start = gettime_ms();
+  for (i=0;i<icount;i++)
+    unschedule(&alarms[i]);
+  end = gettime_ms();
+  printf("%d alarms - unschedule took %lldms - mean time = %.3fus\n",
+	 icount, (long long) end - start, (end - start) * 1000.0 / icount);
+  
+  free(alarms);
+  return 0;
+}
+
+struct fdpoll_test{
+  struct sched_ent alarm;
+  int received;
+};
+
+static void fdpoll_test_read(struct sched_ent *alarm)
+{
+  struct fdpoll_test *test = (struct fdpoll_test *)alarm;
+  unsigned char buffers[RECV_BATCH_MAX][256];
+  struct received_packet packets[RECV_BATCH_MAX];
+  int i;
+  if (!(alarm->poll.revents & POLLIN))
+    return;
+  for (i=0;i<RECV_BATCH_MAX;i++){
+    packets[i].buffer=buffers[i];
+    packets[i].bufferlen=sizeof buffers[i];
+  }
+  int r = recvwithttl_batch(alarm->poll.fd, packets, RECV_BATCH_MAX);
+  if (r>0)
+    test->received+=r;
+}
+
+// send a burst of identical packets, with one system call if we can
+static int fdpoll_test_send(int fd, unsigned char *packet, size_t len, int count)
+{
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[RECV_BATCH_MAX];
+  struct iovec iov;
+  int i;
+  if (count > RECV_BATCH_MAX)
+    count = RECV_BATCH_MAX;
+  iov.iov_base=packet;
+  iov.iov_len=len;
+  bzero(msgs, sizeof(struct mmsghdr)*count);
+  for (i=0;i<count;i++){
+    msgs[i].msg_hdr.msg_iov=&iov;
+    msgs[i].msg_hdr.msg_iovlen=1;
+  }
+  int r = sendmmsg(fd, msgs, count, 0);
+  syscall_counters.sends++;
+  if (r!=-1 || errno!=ENOSYS)
+    return r;
+#endif
+  if (send(fd, packet, len, 0) == -1)
+    return -1;
+  syscall_counters.sends++;
+  return 1;
+}
+
+int app_fdpoll_test(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *count, *backend;
+  if (cli_arg(argc, argv, o, "count", &count, NULL, "100000") == -1
+    || cli_arg(argc, argv, o, "backend", &backend, NULL, "") == -1)
+    return -1;
+  int icount=atoi(count);
+  if (icount<1)
+    return WHY("Count must be at least 1");
+  if (*backend && fd_poll_backend(backend))
+    return -1;
+  
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1)
+    return WHY_perror("socketpair");
+  
+  struct fdpoll_test test;
+  bzero(&test, sizeof test);
+  test.alarm.function = fdpoll_test_read;
+  test.alarm.poll.fd = sv[1];
+  test.alarm.poll.events = POLLIN;
+  test.alarm._poll_index = -1;
+  watch(&test.alarm);
+  
+  unsigned char packet[64];
+  bzero(packet, sizeof packet);
+  int sent=0;
+  bzero(&syscall_counters, sizeof syscall_counters);
+  
+  time_ms_t start = gettime_ms();
+  while (test.received < icount){
+    // send a burst of packets, then wait for them all to be read
+    if (sent < icount && sent == test.received){
+      int r = fdpoll_test_send(sv[0], packet, sizeof packet, icount - sent);
+      if (r == -1){
+	WHY_perror("send");
+	break;
+      }
+      sent+=r;
+    }
+    if (sent == test.received)
+      break;
+    fd_poll();
+  }
+  time_ms_t end = gettime_ms();
+  
+  unwatch(&test.alarm);
+  close(sv[0]);
+  close(sv[1]);
+  
+  printf("%d packets - took %lldms - mean time = %.3fus per packet\n",
+	 test.received, (long long) end - start, (end - start) * 1000.0 / icount);
+  printf("system calls per packet: %.3f poll, %.3f receive, %.3f send, %.3f fcntl\n",
+	 syscall_counters.polls * 1.0 / icount,
+	 syscall_counters.receives * 1.0 / icount,
+	 syscall_counters.sends * 1.0 / icount,
+	 syscall_counters.fcntls * 1.0 / icount);
+  return 0;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+  FILE *in = fopen(from, "r");
+  if (!in)
+    return WHYF_perror("fopen(%s)", from);
+  FILE *out = fopen(to, "w");
+  if (!out){
+    WHYF_perror("fopen(%s)", to);
+    fclose(in);
+    return -1;
+  }
+  char buf[8192];
+  size_t n;
+  int ret=0;
+  while ((n = fread(buf, 1, sizeof buf, in)) > 0){
+    if (fwrite(buf, 1, n, out) != n){
+      ret = WHYF_perror("fwrite(%s)", to);
+      break;
+    }
+  }
+  if (ferror(in))
+    ret = WHYF_perror("fread(%s)", from);
+  fclose(in);
+  if (fclose(out) && !ret)
+    ret = WHYF_perror("fclose(%s)", to);
+  return ret;
+}
+
+int app_capture_dump(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *file;
+  if (cli_arg(argc, argv, o, "file", &file, NULL, "") == -1)
+    return -1;
+  
+  overlay_mdp_frame mdp;
+  bzero(&mdp, sizeof(overlay_mdp_frame));
+  mdp.packetTypeAndFlags=MDP_CAPTURE;
+  
+  /* The server always writes capture.pcap in the instance directory, we copy it from there */
+  char path[1024];
+  if (!FORM_SERVAL_INSTANCE_PATH(path, "capture.pcap"))
+    return -1;
+  
+  if (overlay_mdp_send(&mdp,MDP_AWAITREPLY,5000)){
+    if (mdp.packetTypeAndFlags==MDP_ERROR)
+      WHYF("  MDP Server error #%d: '%s'",mdp.error.error,mdp.error.message);
+    return WHY("Could not dump packet capture");
+  }
+  if (*file){
+    if (copy_file(path, file))
+      return -1;
+    path[0]=0;
+    if (file[0]!='/' && !getcwd(path, sizeof path - 1))
+      return WHY_perror("getcwd");
+    if (path[0])
+      strcat(path, "/");
+    if (strlen(path) + strlen(file) >= sizeof path)
+      return WHY("Capture file path is too long");
+    strcat(path, file);
+  }
+  cli_puts("path"); cli_delim(":");
+  cli_puts(path); cli_delim("\n");
+  cli_puts("packets"); cli_delim(":");
+  cli_puts(mdp.error.message); cli_delim("\n");
+  return 0;
+}
+
+/* Read every packet from a capture in the format written by overlay_broadcast_ensemble() to a dummy
+   interface file, as 2048 byte records with the packet length at offset 110 and the packet at 128.
+   A dummy interface ring has the same records after its header, which is skipped along with any
+   record that has not been written.
+ */
+static int read_overlay_capture(const char *path, unsigned char (**packets)[2048], int **lengths)
+{
+  *packets=NULL;
+  *lengths=NULL;
+  FILE *f=fopen(path, "r");
+  if (!f)
+    return WHYF_perror("fopen(%s)", path);
+  
+  int count=0, size=0;
+  unsigned char record[2048];
+  while (fread(record, sizeof record, 1, f) == 1){
+    int plen = record[110] + (record[111] << 8);
+    if (plen < HEADERFIELDS_LEN || plen > 2048 - 128)
+      continue;
+    if (count>=size){
+      size = size ? size*2 : 1024;
+      unsigned char (*p)[2048] = realloc(*packets, size * 2048);
+      int *l = realloc(*lengths, size * sizeof(int));
+      if (p) *packets = p;
+      if (l) *lengths = l;
+      if (!p || !l){
+	fclose(f);
+	return WHY("realloc() failed");
+      }
+    }
+    bcopy(&record[128], (*packets)[count], plen);
+    (*lengths)[count++] = plen;
+  }
+  fclose(f);
+  return count;
+}
+
+/* Feed captured packets through packetOk() as fast as possible, as if they arrived on a dummy
+   interface, to measure the cost of decoding them. With "decode", MDP and Rhizome advert frames are
+   parsed but not handed to their handlers.
+ */
+int app_bench_overlay_replay(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *path, *count, *handlers;
+  if (cli_arg(argc, argv, o, "capture", &path, NULL, "") == -1
+    || cli_arg(argc, argv, o, "count", &count, NULL, "100") == -1
+    || cli_arg(argc, argv, o, "handlers", &handlers, NULL, "all") == -1)
+    return -1;
+  int icount=atoi(count);
+  if (icount<1)
+    return WHY("Count must be at least 1");
+  if (strcmp(handlers, "all") && strcmp(handlers, "decode"))
+    return WHYF("Unknown handlers %s, expected all or decode", handlers);
+  
+  unsigned char (*packets)[2048];
+  int *lengths;
+  int packet_count=read_overlay_capture(path, &packets, &lengths);
+  if (packet_count<=0){
+    free(packets);
+    free(lengths);
+    return packet_count ? -1 : WHYF("No packets found in %s", path);
+  }
+  
+  /* Decode as if the packets arrived on a dummy interface */
+  int i;
+  if (overlay_interface_table_init()){
+    free(packets);
+    free(lengths);
+    return -1;
+  }
+  overlay_interface *interface = &overlay_interfaces[0];
+  bzero(interface, sizeof(overlay_interface));
+  strncpy(interface->name, ">replay", sizeof(interface->name));
+  interface->fileP = 1;
+  interface->state = INTERFACE_STATE_UP;
+  interface->mtu = 1200;
+  overlay_process_data_frames = !strcmp(handlers, "all");
+  
+  // payloads that would be forwarded or acknowledged are queued, but never sent
+  for (i=0;i<OQ_MAX;i++)
+    overlay_tx[i].maxLength=INT_MAX;
+  
+  unsigned char transaction_id[8];
+  struct sockaddr src_addr;
+  bzero(transaction_id, sizeof transaction_id);
+  bzero(&src_addr, sizeof src_addr);
+  
+  // packetOk() decodes in place, so work on a copy of each packet
+  unsigned char packet[2048];
+  int j;
+  long long bytes=0;
+  fd_clearstats();
+  time_ns_t start = gettime_ns();
+  for (i=0;i<icount;i++){
+    for (j=0;j<packet_count;j++){
+      bcopy(packets[j], packet, lengths[j]);
+      packetOk(interface, packet, lengths[j], transaction_id, -1, &src_addr, sizeof src_addr, 1);
+      bytes+=lengths[j];
+    }
+  }
+  time_ns_t elapsed = gettime_ns() - start;
+  if (elapsed<1)
+    elapsed=1;
+  overlay_process_data_frames=1;
+  free(packets);
+  free(lengths);
+  
+  long long total=(long long)packet_count * icount;
+  cli_printf("packets:%d\n", packet_count);
+  cli_printf("repeats:%d\n", icount);
+  cli_printf("bytes:%lld\n", bytes);
+  cli_printf("frames:%u\n", interface->rx_frames);
+  cli_printf("real_ns:%lld\n", (long long)elapsed);
+  cli_printf("packets_per_second:%.0f\n", total * 1e9 / elapsed);
+  cli_printf("frames_per_second:%.0f\n", interface->rx_frames * 1e9 / elapsed);
+  cli_printf("ns_per_packet:%.0f\n", (double)elapsed / total);
+  
+  struct mallocbuf mb = STRUCT_MALLOCBUF_NULL;
+  op_pool_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  ob_pool_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  fd_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  overlay_broadcast_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  if (mb.buffer){
+    cli_keyvalues(mb.buffer);
+    free(mb.buffer);
+  }
+  return 0;
+}
+
+struct bench_enum_state{
+  const unsigned char *last;
+  int count;
+  int out_of_order;
+};
+
+static int bench_enum_subscriber(struct subscriber *subscriber, void *context)
+{
+  struct bench_enum_state *state=context;
+  if (state->last && memcmp(state->last, subscriber->sid, SID_SIZE)>=0)
+    state->out_of_order++;
+  state->last=subscriber->sid;
+  state->count++;
+  return 0;
+}
+
+/* Fill the subscriber table with random sids, and time how long it takes to add them, find them
+   again by their whole sid and by their shortest unique abbreviation, list them in order, and
+   evict half of them.
+ */
+int app_bench_subscribers(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *count, *seed;
+  if (cli_arg(argc, argv, o, "count", &count, NULL, "100000") == -1
+    || cli_arg(argc, argv, o, "seed", &seed, NULL, "1") == -1)
+    return -1;
+  int icount=atoi(count);
+  if (icount<1)
+    return WHY("Count must be at least 1");
+  srandom(atoi(seed));
+  
+  unsigned char (*sids)[SID_SIZE] = malloc(icount * SID_SIZE);
+  struct subscriber **subscribers = malloc(icount * sizeof(struct subscriber *));
+  if (!sids || !subscribers){
+    free(sids);
+    free(subscribers);
+    return WHY("malloc() failed");
+  }
+  int i, j;
+  for (i=0;i<icount;i++)
+    for (j=0;j<SID_SIZE;j++)
+      sids[i][j]=random();
+  
+  time_ns_t start = gettime_ns();
+  for (i=0;i<icount;i++)
+    if (!(subscribers[i] = find_subscriber(sids[i], SID_SIZE, 1)))
+      break;
+  time_ns_t insert_ns = gettime_ns() - start;
+  if (i<icount){
+    free(sids);
+    free(subscribers);
+    return WHY("Could not add subscriber");
+  }
+  
+  int misses=0;
+  start = gettime_ns();
+  for (i=0;i<icount;i++)
+    if (find_subscriber(sids[i], SID_SIZE, 0)!=subscribers[i])
+      misses++;
+  time_ns_t lookup_ns = gettime_ns() - start;
+  
+  int prefix_misses=0, matches;
+  start = gettime_ns();
+  for (i=0;i<icount;i++)
+    if (find_subscriber_prefix(sids[i], subscribers[i]->abbreviate_len, &matches)!=subscribers[i])
+      prefix_misses++;
+  time_ns_t prefix_ns = gettime_ns() - start;
+  
+  // one nibble less than the unique abbreviation should always be ambiguous
+  int ambiguous=0;
+  for (i=0;i<icount;i++)
+    if (!find_subscriber_prefix(sids[i], subscribers[i]->abbreviate_len -1, &matches) && matches>1)
+      ambiguous++;
+  
+  struct bench_enum_state state={NULL, 0, 0};
+  start = gettime_ns();
+  enum_subscribers(NULL, bench_enum_subscriber, &state);
+  time_ns_t enum_ns = gettime_ns() - start;
+  
+  /* Start a new generation, look up every other sid in it, then evict the rest, which are two
+     generations old. Survivors must still be found by their new, possibly shorter, abbreviation */
+  overlay_address_evict(ULLONG_MAX, 0);
+  for (i=0;i<icount;i+=2)
+    find_subscriber(sids[i], SID_SIZE, 0);
+  start = gettime_ns();
+  int evicted = overlay_address_evict(0, 2);
+  time_ns_t evict_ns = gettime_ns() - start;
+  int evict_misses=0;
+  for (i=0;i<icount;i++){
+    struct subscriber *s = find_subscriber(sids[i], SID_SIZE, 0);
+    if ((i&1) ? s!=NULL : (!s || find_subscriber_prefix(sids[i], s->abbreviate_len, &matches)!=s))
+      evict_misses++;
+  }
+  struct bench_enum_state survivors={NULL, 0, 0};
+  enum_subscribers(NULL, bench_enum_subscriber, &survivors);
+  free(sids);
+  free(subscribers);
+  
+  cli_printf("subscribers:%d\n", icount);
+  cli_printf("insert_ns_per_sid:%.0f\n", (double)insert_ns / icount);
+  cli_printf("lookup_ns_per_sid:%.0f\n", (double)lookup_ns / icount);
+  cli_printf("prefix_ns_per_sid:%.0f\n", (double)prefix_ns / icount);
+  cli_printf("enum_ns_per_sid:%.0f\n", (double)enum_ns / icount);
+  cli_printf("misses:%d\n", misses);
+  cli_printf("prefix_misses:%d\n", prefix_misses);
+  cli_printf("ambiguous_shorter_prefixes:%d\n", ambiguous);
+  cli_printf("enumerated:%d\n", state.count);
+  cli_printf("out_of_order:%d\n", state.out_of_order);
+  cli_printf("evicted:%d\n", evicted);
+  cli_printf("evict_ns_per_sid:%.0f\n", evicted?(double)evict_ns / evicted:0.0);
+  cli_printf("evict_misses:%d\n", evict_misses);
+  cli_printf("survivors:%d\n", survivors.count);
+  cli_printf("survivors_out_of_order:%d\n", survivors.out_of_order);
+  
+  struct mallocbuf mb = STRUCT_MALLOCBUF_NULL;
+  overlay_subscriber_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  if (mb.buffer){
+    cli_keyvalues(mb.buffer);
+    free(mb.buffer);
+  }
+  return 0;
+}
+
+int app_simulate(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *nodes, *seconds, *topology, *seed;
+  if (cli_arg(argc, argv, o, "nodes", &nodes, NULL, "") == -1
+    || cli_arg(argc, argv, o, "seconds", &seconds, NULL, "60") == -1
+    || cli_arg(argc, argv, o, "topology", &topology, NULL, "grid") == -1
+    || cli_arg(argc, argv, o, "seed", &seed, NULL, "1") == -1)
+    return -1;
+  int inodes=atoi(nodes);
+  if (inodes<1)
+    return WHY("Nodes must be at least 1");
+  int iseconds=atoi(seconds);
+  if (iseconds<1)
+    return WHY("Seconds must be at least 1");
+  return simulate_mesh(inodes, iseconds * 1000LL, topology, strtoul(seed, NULL, 10));
+}
+
 int app_node_info(int argc, const char *const *argv, struct command_line_option *o, void *context)
 {
   if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
@@ -1486,17 +2042,15 @@ int app_node_info(int argc, const char *const *argv, struct command_line_option
   if (argc>3) resolveDid=1;
   mdp.nodeinfo.resolve_did=1; // Request resolution of DID and Name by local server if it can.
 
-  /* get SID or SID prefix 
-     XXX - Doesn't correctly handle odd-lengthed SID prefixes (ignores last digit).
-     The matching code in overlay_route.c also has a similar problem with the last
-     digit of an odd-length prefix being ignored. */
+  /* get SID or SID prefix, in hex digits */
   int i;
-  mdp.nodeinfo.sid_prefix_length=0;
-  for(i = 0; (i != SID_SIZE)&&sid[i<<1]&&sid[(i<<1)+1]; i++) {
-    mdp.nodeinfo.sid[mdp.nodeinfo.sid_prefix_length] = hexvalue(sid[i<<1]) << 4;
-    mdp.nodeinfo.sid[mdp.nodeinfo.sid_prefix_length++] |= hexvalue(sid[(i<<1)+1]);
+  for(i = 0; (i != SID_SIZE*2)&&sid[i]; i++) {
+    if (i&1)
+      mdp.nodeinfo.sid[i>>1] |= hexvalue(sid[i]);
+    else
+      mdp.nodeinfo.sid[i>>1] = hexvalue(sid[i]) << 4;
   }
-  mdp.nodeinfo.sid_prefix_length*=2;
+  mdp.nodeinfo.sid_prefix_length=i;
 
   int result=overlay_mdp_send(&mdp,MDP_AWAITREPLY,5000);
   if (result) {
@@ -1689,12 +2243,28 @@ struct command_line_option command_line_options[]={
    "Return identity of all known peers as URIs"},
   {app_node_info,{"node","info","<sid>","[getdid]",NULL},0,
    "Return information about SID, and optionally ask for DID resolution via network"},
+  {app_stats,{"stats",NULL},0,
+   "Display the running server's performance counters"},
+  {app_capture_dump,{"capture","dump","[<file>]",NULL},0,
+   "Write the running server's recent packets to a pcap file, capture.pcap in the instance directory by default"},
   {app_test_rfs,{"test","rfs",NULL},0,
    "Test RFS field calculation"},
   {app_monitor_cli,{"monitor",NULL},0,
    "Interactive servald monitor interface."},
   {app_crypt_test,{"crypt","test",NULL},0,
    "Run cryptography speed test"},
+  {app_scheduler_test,{"test","scheduler","[<count>]",NULL},0,
+   "Run alarm scheduler speed test"},
+  {app_fdpoll_test,{"test","fdpoll","[<count>]","[<backend>]",NULL},0,
+   "Run file handle polling speed test. <backend> is epoll, poll, or poll-fcntl to switch each handle to non-blocking mode around its callback, as servald used to"},
+  {app_bench_overlay_replay,{"bench","overlay-replay","<capture>","[<count>]","[<handlers>]",NULL},0,
+   "Replay packets captured in a dummy interface file through the overlay decoder as fast as possible, and report its speed. <handlers> is all or decode"},
+  {app_bench_subscribers,{"bench","subscribers","[<count>]","[<seed>]",NULL},0,
+   "Add <count> random sids to the subscriber table, and report how fast they can be found and how much memory they use"},
+  {app_selftest,{"test","self","<name>","[<arg>]","[<seed>]",NULL},0,
+   "Run a self test of servald's internals and report what happened. <name> is sid-index, packing [<interfaces>], fairness [<seconds>] or netlink"},
+  {app_simulate,{"test","simulate","<nodes>","[<seconds>]","[<topology>]","[<seed>]",NULL},0,
+   "Simulate a mesh of nodes, each in its own process, on a shared virtual clock, and report how long routing took to converge"},
 #ifdef HAVE_VOIPTEST
   {app_pa_phone,{"phone",NULL},0,
    "Run phone test application"},
@@ -110,7 +110,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define ACTION_PAD 0xfe
 #define ACTION_EOT 0xff
 
+/* Room for this many interfaces, unless "interface.max" says otherwise.
+   Interface numbers are sent in a single byte, so there can't be more than OVERLAY_INTERFACE_LIMIT */
 #define OVERLAY_MAX_INTERFACES 16
+#define OVERLAY_INTERFACE_LIMIT 256
 
 #define CRYPT_CIPHERED 1
 #define CRYPT_SIGNED 2
@@ -162,6 +165,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define OVERLAY_MAX_LOCAL_IDENTITIES 256
 
+/* Overlay packet envelope versions.
+   Version 1 packets are a bare sequence of frames.
+   Version 2 packets start with a flags byte, the sender's (abbreviated) address and, unless the packet was
+   sent unicast, a 16 bit per-interface sequence number.
+   The first version byte of the header is the highest version the sender understands, so a node only
+   sends version 2 packets on an interface once it has heard from no version 1 peers there for a while. */
+#define OVERLAY_ENVELOPE_LEGACY 1
+#define OVERLAY_ENVELOPE_VERSION 2
+#define OVERLAY_ENVELOPE_FLAG_UNICAST 0x01
+/* A jump in sequence numbers larger than this is treated as a restart, not as packet loss */
+#define OVERLAY_MAX_SEQUENCE_GAP 1024
+/* Each interface remembers the frames it sent in this many recent version 2 packets,
+   so a neighbour can NACK a gap in the sequence and have just the lost frames sent again */
+#define OVERLAY_RETRANSMIT_PACKETS 16
+#define OVERLAY_RETRANSMIT_FRAMES 16
+/* Each interface can tag up to this many subscribers with a one byte index, see overlay_address.c.
+   An index is only used on its own once it has been sent in this many broadcast packets. */
+#define OVERLAY_SID_INDEX_SIZE 256
+#define OVERLAY_SID_INDEX_ANNOUNCE 3
+
 /* Overlay mesh packet codes */
 #define OF_TYPE_BITS 0xf0
 #define OF_TYPE_SELFANNOUNCE 0x10 /* BATMAN style announcement frames */
@@ -177,7 +200,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define OF_TYPE_PLEASEEXPLAIN 0x60 /* Request for resolution of an abbreviated address */
 #define OF_TYPE_NODEANNOUNCE 0x70
 #define OF_TYPE_IDENTITYENQUIRY 0x80
-#define OF_TYPE_RESERVED_09 0x90
+#define OF_TYPE_NACK 0x90 /* Request retransmission of frames from lost packets, see overlay_nack.c */
 #define OF_TYPE_RESERVED_0a 0xa0
 #define OF_TYPE_RESERVED_0b 0xb0
 #define OF_TYPE_RESERVED_0c 0xc0
@@ -279,6 +302,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define MAX_AUDIO_BYTES 1024
 #define MDP_NODEINFO 8
 #define MDP_GOODBYE 9
+#define MDP_STATS 10
+#define MDP_CAPTURE 11
 #define MDP_AWAITREPLY 9999
 
 /* max number of recent samples to cram into a VoMP frame as well as the current
@@ -21,60 +21,164 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 #include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
-#define MAX_WATCHED_FDS 128
-struct pollfd fds[MAX_WATCHED_FDS];
-int fdcount=0;
-struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
-struct sched_ent *next_alarm=NULL;
-struct sched_ent *next_deadline=NULL;
+/* Every watched file handle has an entry in fds[] and fd_callbacks[], which grow as required.
+ With the poll() backend, fds[] is passed straight to poll().
+ With the epoll backend, the kernel remembers the set of watched handles between calls,
+ so fds[] is only used for book keeping.
+ Watched handles are switched to non-blocking mode once, when they are first watched, and stay that
+ way. fd_poll() used to switch each handle to non-blocking mode around its callback, and back again
+ afterwards, which cost four fcntl() calls per callback. So a write to a watched handle from anywhere
+ else, such as an MDP frame passed to a client while handling a packet from an interface, used to
+ block until it could complete, and now fails with EAGAIN instead. Those writers drop what they
+ couldn't send, rather than stall the server on a client that isn't reading.
+ */
+static struct pollfd *fds=NULL;
+static struct sched_ent **fd_callbacks=NULL;
+static int fdcount=0;
+static int fdsize=0;
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0};
+struct syscall_counters syscall_counters;
+// switch handles to non-blocking mode around each callback, the way fd_poll() used to
+static int fd_toggle_blocking=0;
+
+#ifdef HAVE_SYS_EPOLL_H
+#define MAX_EPOLL_EVENTS 64
+// -1 = not yet initialised, -2 = use poll()
+static int epoll_fd=-1;
+static struct epoll_event epoll_events[MAX_EPOLL_EVENTS];
+// the range of epoll_events[] that are still waiting to be called back
+static int epoll_event_next=0;
+static int epoll_event_count=0;
+#endif
+
+/* Scheduled alarms are kept in two binary heaps, so that scheduling or cancelling an alarm costs
+ O(log n) no matter how many other alarms are pending.
+ Alarms wait in the alarm heap, ordered by .alarm, until that time has elapsed.
+ They are then moved to the deadline heap, ordered by .deadline, until they can be called.
+ */
+struct sched_heap{
+  struct sched_ent **entries;
+  int count;
+  int size;
+  // non-zero if alarm a should come out of the heap before alarm b
+  int (*before)(const struct sched_ent *a, const struct sched_ent *b);
+};
+
+static int alarm_before(const struct sched_ent *a, const struct sched_ent *b){
+  return a->alarm < b->alarm;
+}
+
+static int deadline_before(const struct sched_ent *a, const struct sched_ent *b){
+  if (a->deadline == b->deadline)
+    return a->alarm < b->alarm;
+  return a->deadline < b->deadline;
+}
+
+static struct sched_heap alarm_heap={NULL, 0, 0, alarm_before};
+static struct sched_heap deadline_heap={NULL, 0, 0, deadline_before};
+
+static void heap_set(struct sched_heap *heap, int index, struct sched_ent *alarm){
+  heap->entries[index]=alarm;
+  alarm->_heap_index=index;
+}
+
+static void heap_sift_up(struct sched_heap *heap, int index){
+  struct sched_ent *alarm = heap->entries[index];
+  while(index>0){
+    int parent = (index-1)/2;
+    if (!heap->before(alarm, heap->entries[parent]))
+      break;
+    heap_set(heap, index, heap->entries[parent]);
+    index = parent;
+  }
+  heap_set(heap, index, alarm);
+}
+
+static void heap_sift_down(struct sched_heap *heap, int index){
+  struct sched_ent *alarm = heap->entries[index];
+  while(1){
+    int child = index*2+1;
+    if (child >= heap->count)
+      break;
+    if (child+1 < heap->count && heap->before(heap->entries[child+1], heap->entries[child]))
+      child++;
+    if (!heap->before(heap->entries[child], alarm))
+      break;
+    heap_set(heap, index, heap->entries[child]);
+    index = child;
+  }
+  heap_set(heap, index, alarm);
+}
+
+static int heap_insert(struct sched_heap *heap, struct sched_ent *alarm){
+  if (heap->count >= heap->size){
+    int new_size = heap->size?heap->size*2:64;
+    struct sched_ent **new_entries = realloc(heap->entries, new_size * sizeof(struct sched_ent *));
+    if (!new_entries)
+      return WHY("realloc() failed");
+    heap->entries = new_entries;
+    heap->size = new_size;
+  }
+  alarm->_heap = heap;
+  heap_set(heap, heap->count++, alarm);
+  heap_sift_up(heap, alarm->_heap_index);
+  return 0;
+}
+
+static void heap_remove(struct sched_heap *heap, struct sched_ent *alarm){
+  int index = alarm->_heap_index;
+  heap->count--;
+  if (index != heap->count){
+    // fill the hole with the last entry, which may need to move either up or down from there
+    struct sched_ent *last = heap->entries[heap->count];
+    heap_set(heap, index, last);
+    heap_sift_up(heap, index);
+    if (last->_heap_index == index)
+      heap_sift_down(heap, index);
+  }
+  heap->entries[heap->count]=NULL;
+  alarm->_heap = NULL;
+  alarm->_heap_index = -1;
+}
+
+static struct sched_ent *heap_peek(struct sched_heap *heap){
+  return heap->count?heap->entries[0]:NULL;
+}
 
 void list_alarms() {
   DEBUG("Alarms;");
   time_ms_t now = gettime_ms();
-  struct sched_ent *alarm;
-  for (alarm = next_alarm; alarm; alarm = alarm->_next)
-    DEBUGF("%s in %lldms", (alarm->stats ? alarm->stats->name : "Unnamed"), alarm->alarm - now);
-  DEBUG("File handles;");
   int i;
+  for (i = 0; i < deadline_heap.count; ++i)
+    DEBUGF("%s overdue by %lldms", (deadline_heap.entries[i]->stats ? deadline_heap.entries[i]->stats->name : "Unnamed"), now - deadline_heap.entries[i]->alarm);
+  for (i = 0; i < alarm_heap.count; ++i)
+    DEBUGF("%s in %lldms", (alarm_heap.entries[i]->stats ? alarm_heap.entries[i]->stats->name : "Unnamed"), alarm_heap.entries[i]->alarm - now);
+  DEBUG("File handles;");
   for (i = 0; i < fdcount; ++i)
     DEBUGF("%s watching #%d", (fd_callbacks[i]->stats ? fd_callbacks[i]->stats->name : "Unnamed"), fds[i].fd);
 }
 
-int deadline(struct sched_ent *alarm){
-  struct sched_ent *node = next_deadline, *last = NULL;
+static int deadline(struct sched_ent *alarm){
   if (alarm->deadline < alarm->alarm)
     alarm->deadline = alarm->alarm;
-  
-  while(node!=NULL){
-    if (node->alarm > alarm->alarm)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_deadline = alarm;
-  }else{
-    last->_next=alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  return 0;
+  return heap_insert(&deadline_heap, alarm);
 }
 
-
 // add an alarm to the list of scheduled function calls.
 // simply populate .alarm with the absolute time, and .function with the method to call.
 // on calling .poll.revents will be zero.
+// rescheduling an alarm that is already scheduled will move it to the new time.
 int schedule(struct sched_ent *alarm){
-  struct sched_ent *node = next_alarm, *last = NULL;
-  
   if (!alarm->function)
     return WHY("Can't schedule if you haven't set the function pointer");
   
+  if (alarm->_heap)
+    unschedule(alarm);
+  
   if (alarm->deadline < alarm->alarm)
     alarm->deadline = alarm->alarm;
   
@@ -82,60 +186,106 @@ int schedule(struct sched_ent *alarm){
   if (alarm->alarm <= gettime_ms())
     return deadline(alarm);
   
-  while(node!=NULL){
-    if (node->alarm > alarm->alarm)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_alarm = alarm;
-  }else{
-    last->_next=alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  
-  return 0;
+  return heap_insert(&alarm_heap, alarm);
 }
 
 // remove a function from the schedule before it has fired
 // safe to unschedule twice...
 int unschedule(struct sched_ent *alarm){
-  struct sched_ent *prev = alarm->_prev;
-  struct sched_ent *next = alarm->_next;
-  
-  if (prev)
-    prev->_next = next;
-  else if(next_alarm==alarm)
-    next_alarm = next;
-  else if(next_deadline==alarm)
-    next_deadline = next;
-  
-  if (next)
-    next->_prev = prev;
-  
-  alarm->_prev = NULL;
-  alarm->_next = NULL;
+  if (alarm->_heap)
+    heap_remove(alarm->_heap, alarm);
+  return 0;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int fd_use_epoll(){
+  if (epoll_fd==-1){
+    if (!confValueGetBoolean("server.epoll", 1)){
+      epoll_fd=-2;
+    }else if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+      WHY_perror("epoll_create1");
+      INFO("Falling back to poll()");
+      epoll_fd=-2;
+    }
+  }
+  return epoll_fd>=0;
+}
+
+static uint32_t epoll_events_from_poll(short events){
+  uint32_t ret=0;
+  if (events & POLLIN) ret|=EPOLLIN;
+  if (events & POLLPRI) ret|=EPOLLPRI;
+  if (events & POLLOUT) ret|=EPOLLOUT;
+  return ret;
+}
+
+static short poll_events_from_epoll(uint32_t events){
+  short ret=0;
+  if (events & EPOLLIN) ret|=POLLIN;
+  if (events & EPOLLPRI) ret|=POLLPRI;
+  if (events & EPOLLOUT) ret|=POLLOUT;
+  if (events & EPOLLERR) ret|=POLLERR;
+  if (events & EPOLLHUP) ret|=POLLHUP;
+  return ret;
+}
+
+static int fd_epoll_ctl(int op, int fd, struct sched_ent *alarm){
+  struct epoll_event ev;
+  bzero(&ev, sizeof ev);
+  ev.events = epoll_events_from_poll(alarm->poll.events);
+  ev.data.ptr = alarm;
+  if (epoll_ctl(epoll_fd, op, fd, &ev) == -1)
+    return WHYF_perror("epoll_ctl(%d, %d)", op, fd);
   return 0;
 }
+#endif
 
 // start watching a file handle, call this function again if you wish to change the event mask
 int watch(struct sched_ent *alarm){
   if (!alarm->function)
     return WHY("Can't watch if you haven't set the function pointer");
   
-  if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
+  if (alarm->_poll_index>=0 && alarm->_poll_index<fdcount && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     if (debug & DEBUG_IO)
       DEBUGF("Updating watch %s, #%d for %d", (alarm->stats?alarm->stats->name:"Unnamed"), alarm->poll.fd, alarm->poll.events);
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd_use_epoll()){
+      int old_fd = fds[alarm->_poll_index].fd;
+      if (old_fd != alarm->poll.fd){
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, old_fd, NULL);
+	set_nonblock(alarm->poll.fd);
+	if (fd_epoll_ctl(EPOLL_CTL_ADD, alarm->poll.fd, alarm))
+	  return -1;
+      }else if (fds[alarm->_poll_index].events != alarm->poll.events){
+	if (fd_epoll_ctl(EPOLL_CTL_MOD, alarm->poll.fd, alarm))
+	  return -1;
+      }
+    }else
+#endif
+    if (fds[alarm->_poll_index].fd != alarm->poll.fd && !fd_toggle_blocking)
+      set_nonblock(alarm->poll.fd);
   }else{
     if (debug & DEBUG_IO)
       DEBUGF("Adding watch %s, #%d for %d", (alarm->stats?alarm->stats->name:"Unnamed"), alarm->poll.fd, alarm->poll.events);
-    if (fdcount>=MAX_WATCHED_FDS)
-      return WHY("Too many file handles to watch");
+    if (fdcount>=fdsize){
+      int new_size = fdsize?fdsize*2:32;
+      struct pollfd *new_fds = realloc(fds, new_size * sizeof(struct pollfd));
+      if (!new_fds)
+	return WHY("realloc() failed");
+      fds = new_fds;
+      struct sched_ent **new_callbacks = realloc(fd_callbacks, new_size * sizeof(struct sched_ent *));
+      if (!new_callbacks)
+	return WHY("realloc() failed");
+      fd_callbacks = new_callbacks;
+      fdsize = new_size;
+    }
+    if (!fd_toggle_blocking)
+      set_nonblock(alarm->poll.fd);
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd_use_epoll() && fd_epoll_ctl(EPOLL_CTL_ADD, alarm->poll.fd, alarm))
+      return -1;
+#endif
     fd_callbacks[fdcount]=alarm;
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
@@ -148,9 +298,21 @@ int watch(struct sched_ent *alarm){
 // stop watching a file handle
 int unwatch(struct sched_ent *alarm){
   int index = alarm->_poll_index;
-  if (index <0 || fds[index].fd!=alarm->poll.fd)
+  if (index <0 || index>=fdcount || fd_callbacks[index]!=alarm || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef HAVE_SYS_EPOLL_H
+  if (fd_use_epoll()){
+    // the handle may have already been closed, which removes it from the epoll set anyway
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, alarm->poll.fd, NULL);
+    // make sure we don't call this alarm for events that were returned before it was unwatched
+    int i;
+    for (i=epoll_event_next;i<epoll_event_count;i++)
+      if (epoll_events[i].data.ptr == alarm)
+	epoll_events[i].data.ptr = NULL;
+  }
+#endif
+  
   fdcount--;
   if (index!=fdcount){
     // squash fds
@@ -180,24 +342,49 @@ void call_alarm(struct sched_ent *alarm, int revents){
     fd_func_exit(&call_stats);
 }
 
+/* move alarms that have elapsed to the deadline queue */
+static void move_elapsed_alarms(time_ms_t now){
+  struct sched_ent *alarm;
+  while ((alarm = heap_peek(&alarm_heap))!=NULL && alarm->alarm <=now){
+    heap_remove(&alarm_heap, alarm);
+    deadline(alarm);
+  }
+}
+
+// call an alarm from the deadline queue, and keep track of how late it was
+static void call_elapsed_alarm(struct sched_ent *alarm, time_ms_t now){
+  time_ms_t lateness = now - alarm->alarm;
+  // the alarm function may free the alarm
+  struct profile_total *stats = alarm->stats;
+  unschedule(alarm);
+  call_alarm(alarm, 0);
+
+  if (stats){
+    stats->alarm_calls++;
+    stats->total_lateness+=lateness;
+    if (lateness > stats->max_lateness)
+      stats->max_lateness=lateness;
+  }
+}
+
 int fd_poll()
 {
   int i, r;
   int ms=60000;
   time_ms_t now = gettime_ms();
-  
-  /* move alarms that have elapsed to the deadline queue */
-  while (next_alarm!=NULL&&next_alarm->alarm <=now){
-    struct sched_ent *alarm = next_alarm;
-    unschedule(alarm);
-    deadline(alarm);
-  }
-  
+  struct sched_ent *alarm;
+  static int alarm_budget_ms = -1;
+
+  if (alarm_budget_ms == -1)
+    alarm_budget_ms = confValueGetInt64Range("server.alarm_budget_ms", 20LL, 0LL, 10000LL);
+
+  move_elapsed_alarms(now);
+
   /* work out how long we can block in poll */
-  if (next_deadline)
+  if (deadline_heap.count)
     ms = 0;
-  else if (next_alarm){
-    ms = next_alarm->alarm - now;
+  else if ((alarm = heap_peek(&alarm_heap))!=NULL){
+    ms = alarm->alarm - now;
   }
   
   /* Make sure we don't have any silly timeouts that will make us wait forever. */
@@ -208,44 +395,136 @@ int fd_poll()
     struct call_stats call_stats;
     call_stats.totals=&poll_stats;
     fd_func_enter(&call_stats);
-    r = poll(fds, fdcount, ms);
-    if (debug & DEBUG_IO) {
-      strbuf b = strbuf_alloca(1024);
-      int i;
-      for (i = 0; i < fdcount; ++i) {
-	if (i)
-	  strbuf_puts(b, ", ");
-	strbuf_sprintf(b, "%d:", fds[i].fd);
-	strbuf_append_poll_events(b, fds[i].events);
-	strbuf_putc(b, ':');
-	strbuf_append_poll_events(b, fds[i].revents);
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd_use_epoll()){
+      r = epoll_wait(epoll_fd, epoll_events, MAX_EPOLL_EVENTS, ms);
+      syscall_counters.polls++;
+      if (r == -1 && errno != EINTR)
+	WHY_perror("epoll_wait");
+      epoll_event_next=0;
+      epoll_event_count=r>0?r:0;
+      if (debug & DEBUG_IO)
+	DEBUGF("epoll_wait(fdcount=%d, ms=%d) = %d", fdcount, ms, r);
+    }else
+#endif
+    {
+      r = poll(fds, fdcount, ms);
+      syscall_counters.polls++;
+      if (debug & DEBUG_IO) {
+	strbuf b = strbuf_alloca(1024);
+	int i;
+	for (i = 0; i < fdcount; ++i) {
+	  if (i)
+	    strbuf_puts(b, ", ");
+	  strbuf_sprintf(b, "%d:", fds[i].fd);
+	  strbuf_append_poll_events(b, fds[i].events);
+	  strbuf_putc(b, ':');
+	  strbuf_append_poll_events(b, fds[i].revents);
+	}
+	DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) = %d", strbuf_str(b), fdcount, ms, r);
       }
-      DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) = %d", strbuf_str(b), fdcount, ms, r);
     }
     fd_func_exit(&call_stats);
     now=gettime_ms();
   }
   
-  /* call one alarm function, but only if its deadline time has elapsed OR there is no file activity */
-  if (next_deadline && (next_deadline->deadline <=now || (r==0))){
-    struct sched_ent *alarm = next_deadline;
-    unschedule(alarm);
-    call_alarm(alarm, 0);
-    now=gettime_ms();
+  /* call alarm functions in deadline order, but only if their deadline time has elapsed OR there is no file activity.
+   Stop when we have used up our time budget, so that file handles that are ready don't have to wait too long.
+   At least one alarm is always called, so a slow alarm can't starve the others. */
+  {
+    time_ms_t budget_end = now + alarm_budget_ms;
+    while ((alarm = heap_peek(&deadline_heap))!=NULL && (alarm->deadline <=now || (r==0))){
+      call_elapsed_alarm(alarm, now);
+      now=gettime_ms();
+      if (now >= budget_end)
+	break;
+      move_elapsed_alarms(now);
+    }
   }
   
-  /* If file descriptors are ready, then call the appropriate functions */
+  /* If file descriptors are ready, then call the appropriate functions.
+   Watched handles are always in non-blocking mode. */
   if (r>0) {
-    for(i=0;i<fdcount;i++)
-      if (fds[i].revents) {
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd_use_epoll()){
+      while (epoll_event_next < epoll_event_count){
+	struct epoll_event *ev = &epoll_events[epoll_event_next++];
+	// the alarm may have been unwatched by an earlier callback
+	if (ev->data.ptr)
+	  call_alarm((struct sched_ent *)ev->data.ptr, poll_events_from_epoll(ev->events));
+      }
+      epoll_event_next=epoll_event_count=0;
+    }else
+#endif
+    for(i=0;i<fdcount;i++){
+      if (!fds[i].revents)
+	continue;
+      if (fd_toggle_blocking){
 	int fd = fds[i].fd;
-	/* Call the alarm callback with the socket in non-blocking mode */
 	set_nonblock(fd);
 	call_alarm(fd_callbacks[i], fds[i].revents);
-	/* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
+	// the alarm may have closed and unwatched the handle
 	if (i<fdcount && fds[i].fd == fd)
-	  set_block(fds[i].fd);
-      }
+	  set_block(fd);
+      }else
+	call_alarm(fd_callbacks[i], fds[i].revents);
+    }
+  }
+  return 0;
+}
+
+/* Choose how fd_poll() waits for file handles, so that "test fdpoll" can compare them:
+   "epoll", "poll", or "poll-fcntl", which is poll() with each handle switched to non-blocking mode
+   around its callback, as fd_poll() used to work. Only possible before anything is watched. */
+int fd_poll_backend(const char *name)
+{
+  if (fdcount)
+    return WHY("Can't change how file handles are polled while they are being watched");
+  if (strcmp(name, "epoll")==0){
+#ifdef HAVE_SYS_EPOLL_H
+    if (fd_use_epoll()){
+      fd_toggle_blocking=0;
+      return 0;
+    }
+#endif
+    return WHY("epoll is not available");
   }
+  if (strcmp(name, "poll")!=0 && strcmp(name, "poll-fcntl")!=0)
+    return WHYF("Unknown way to poll file handles '%s'", name);
+#ifdef HAVE_SYS_EPOLL_H
+  if (epoll_fd>=0)
+    close(epoll_fd);
+  epoll_fd=-2;
+#endif
+  fd_toggle_blocking = strcmp(name, "poll-fcntl")==0;
   return 0;
 }
+
+/* The simulator runs each node's alarms itself, as time only moves when it says so.
+   Returns the time the next alarm is due, or -1 if nothing is scheduled */
+time_ms_t fd_next_alarm()
+{
+  struct sched_ent *alarm;
+  if (deadline_heap.count)
+    return gettime_ms();
+  if ((alarm = heap_peek(&alarm_heap))!=NULL)
+    return alarm->alarm;
+  return -1;
+}
+
+/* Call every alarm that is due, in deadline order, without waiting on any file handles.
+   Gives up after max_calls, in case an alarm keeps scheduling itself for right now.
+   Returns the number of alarms called. */
+int fd_run_alarms(int max_calls)
+{
+  time_ms_t now = gettime_ms();
+  struct sched_ent *alarm;
+  int calls=0;
+  move_elapsed_alarms(now);
+  while (calls<max_calls && (alarm = heap_peek(&deadline_heap))!=NULL){
+    call_elapsed_alarm(alarm, now);
+    calls++;
+    move_elapsed_alarms(now);
+  }
+  return calls;
+}
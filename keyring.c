@@ -1247,6 +1247,10 @@ int keyring_send_sas_request(struct subscriber *subscriber){
   if (subscriber->sas_valid)
     return 0;
   
+  // nodes in the simulator don't have a keyring to sign or check anything with
+  if (!keyring)
+    return 0;
+  
   time_ms_t now = gettime_ms();
   
   if (now < subscriber->sas_last_request + 100){
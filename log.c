@@ -42,6 +42,8 @@ unsigned int debug = 0;
 static FILE *logfile = NULL;
 static int flag_show_pid = -1;
 static int flag_show_time = -1;
+// messages less severe than this are not logged at all
+static int log_level_min = LOG_LEVEL_DEBUG;
 
 /* The logbuf is used to accumulate log messages before the log file is open and ready for
    writing.
@@ -131,7 +133,7 @@ static const char *_trimbuildpath(const char *path)
 
 static int _log_prepare(int level, struct __sourceloc where)
 {
-  if (level == LOG_LEVEL_SILENT)
+  if (level == LOG_LEVEL_SILENT || level < log_level_min)
     return 0;
   if (strbuf_is_empty(&logbuf))
     strbuf_init(&logbuf, _log_buf, sizeof _log_buf);
@@ -211,6 +213,11 @@ void set_log_implementation(void (*log_function)(int level, struct strbuf *buf))
   _log_implementation=log_function;
 }
 
+void set_log_level(int level)
+{
+  log_level_min=level;
+}
+
 void logArgv(int level, struct __sourceloc where, const char *label, int argc, const char *const *argv)
 {
   if (_log_prepare(level, where)) {
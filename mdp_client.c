@@ -273,7 +273,8 @@ int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp)
   switch(mdp->packetTypeAndFlags&MDP_TYPE_MASK)
   {
     case MDP_GOODBYE:
-      /* no arguments for saying goodbye */
+    case MDP_CAPTURE:
+      /* no arguments for saying goodbye, or asking for the packet capture */
       len=&mdp->raw[0]-(char *)mdp;
       break;
     case MDP_ADDRLIST: 
@@ -297,6 +298,9 @@ int overlay_mdp_relevant_bytes(overlay_mdp_frame *mdp)
     case MDP_NODEINFO:
       len=(&mdp->raw[0] - (char *)mdp) + sizeof(overlay_mdp_nodeinfo);
       break;
+    case MDP_STATS:
+      len=(&mdp->stats.text[0] - (char *)mdp) + mdp->stats.text_length;
+      break;
     default:
       return WHY("Illegal MDP frame type.");
   }
@@ -0,0 +1,111 @@
+/*
+ Serval Daemon
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "serval.h"
+#include "mem_pool.h"
+
+// free objects are chained through their first word
+struct free_object {
+  struct free_object *next;
+};
+
+static size_t pool_stride(struct mem_pool *pool)
+{
+  size_t size = pool->object_size;
+  if (size < sizeof(struct free_object))
+    size = sizeof(struct free_object);
+  // keep every object in the slab suitably aligned for any type
+  size = (size + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+  return size;
+}
+
+static int pool_grow(struct mem_pool *pool)
+{
+  size_t stride = pool_stride(pool);
+  int count = pool->objects_per_slab;
+  if (count<1) count=1;
+
+  unsigned char *slab = malloc(stride * count);
+  if (!slab)
+    return WHYF("malloc() failed growing %s pool", pool->name);
+
+  // thread the new objects onto the free list, lowest address first
+  int i;
+  for (i=count -1;i>=0;i--){
+    struct free_object *o = (struct free_object *)(slab + i*stride);
+    o->next = pool->free_list;
+    pool->free_list = o;
+  }
+  pool->slabs++;
+  return 0;
+}
+
+/* For pools whose object size isn't known at compile time.
+   Objects already handed out would be the wrong size, so this can only be done before the first one */
+int pool_set_object_size(struct mem_pool *pool, size_t size)
+{
+  if (pool->object_size == size)
+    return 0;
+  if (pool->slabs)
+    return WHYF("Cannot resize %s pool from %u to %u bytes, it is already in use",
+		pool->name, (unsigned)pool->object_size, (unsigned)size);
+  pool->object_size = size;
+  return 0;
+}
+
+void *pool_alloc(struct mem_pool *pool)
+{
+  if (!pool->free_list && pool_grow(pool))
+    return NULL;
+
+  struct free_object *o = pool->free_list;
+  pool->free_list = o->next;
+
+  pool->live++;
+  pool->allocs++;
+  if (pool->live > pool->high_water)
+    pool->high_water = pool->live;
+  return o;
+}
+
+void *pool_calloc(struct mem_pool *pool)
+{
+  void *ret = pool_alloc(pool);
+  if (ret)
+    bzero(ret, pool->object_size);
+  return ret;
+}
+
+void pool_free(struct mem_pool *pool, void *object)
+{
+  if (!object)
+    return;
+  struct free_object *o = object;
+  o->next = pool->free_list;
+  pool->free_list = o;
+  pool->live--;
+}
+
+void pool_stats_keyvalues(struct mem_pool *pool, XPRINTF xpf)
+{
+  xprintf(xpf, "pool.%s.live=%u\n", pool->name, pool->live);
+  xprintf(xpf, "pool.%s.high_water=%u\n", pool->name, pool->high_water);
+  xprintf(xpf, "pool.%s.slabs=%u\n", pool->name, pool->slabs);
+  xprintf(xpf, "pool.%s.allocs=%u\n", pool->name, pool->allocs);
+}
@@ -0,0 +1,50 @@
+/*
+ Serval Daemon
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _SERVALD_MEM_POOL_H
+#define _SERVALD_MEM_POOL_H
+
+#include "xprintf.h"
+
+/* A pool of fixed size objects, carved out of slabs that are never returned to the heap.
+   Freed objects go onto a free list and are handed out again before a new slab is allocated,
+   so the heap only grows to the high water mark and doesn't fragment under churn.
+ */
+struct mem_pool {
+  const char *name;
+  size_t object_size;
+  int objects_per_slab;
+
+  void *free_list;
+
+  unsigned int live;
+  unsigned int high_water;
+  unsigned int allocs;
+  unsigned int slabs;
+};
+
+#define MEM_POOL(NAME, SIZE, PER_SLAB) {.name=(NAME), .object_size=(SIZE), .objects_per_slab=(PER_SLAB)}
+
+int pool_set_object_size(struct mem_pool *pool, size_t size);
+void *pool_alloc(struct mem_pool *pool);
+void *pool_calloc(struct mem_pool *pool);
+void pool_free(struct mem_pool *pool, void *object);
+void pool_stats_keyvalues(struct mem_pool *pool, XPRINTF xpf);
+
+#endif
@@ -547,10 +547,7 @@ int monitor_announce_bundle(rhizome_manifest *m)
 	   m->dataFileName?m->dataFileName:"");
   for(i=monitor_socket_count -1;i>=0;i--) {
     if (monitor_sockets[i].flags & MONITOR_RHIZOME) {
-      if ( set_nonblock(monitor_sockets[i].alarm.poll.fd) == -1
-	|| write_str_nonblock(monitor_sockets[i].alarm.poll.fd, msg) == -1
-	|| set_block(monitor_sockets[i].alarm.poll.fd) == -1
-      ) {
+      if (write_str_nonblock(monitor_sockets[i].alarm.poll.fd, msg) == -1) {
 	INFO("Tearing down monitor client");
 	monitor_close(&monitor_sockets[i]);
       }
@@ -586,10 +583,7 @@ int monitor_tell_clients(char *msg, int msglen, int mask)
   for(i=monitor_socket_count -1;i>=0;i--) {
     if (monitor_sockets[i].flags & mask) {
       // DEBUG("Writing AUDIOPACKET to client");
-      if ( set_nonblock(monitor_sockets[i].alarm.poll.fd) == -1
-	|| write_all_nonblock(monitor_sockets[i].alarm.poll.fd, msg, msglen) == -1
-	|| set_block(monitor_sockets[i].alarm.poll.fd) == -1
-      ) {
+      if (write_all_nonblock(monitor_sockets[i].alarm.poll.fd, msg, msglen) == -1) {
 	INFOF("Tearing down monitor client #%d", i);
 	monitor_close(&monitor_sockets[i]);
       }
@@ -29,10 +29,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 int _set_nonblock(int fd, struct __sourceloc where)
 {
   int flags;
+  syscall_counters.fcntls++;
   if ((flags = fcntl(fd, F_GETFL, NULL)) == -1) {
     logMessage_perror(LOG_LEVEL_ERROR, where, "set_nonblock: fcntl(%d,F_GETFL,NULL)", fd);
     return -1;
   }
+  syscall_counters.fcntls++;
   if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
     logMessage_perror(LOG_LEVEL_ERROR, where, "set_nonblock: fcntl(%d,F_SETFL,0x%x|O_NONBLOCK)", fd, flags);
     return -1;
@@ -43,10 +45,12 @@ int _set_nonblock(int fd, struct __sourceloc where)
 int _set_block(int fd, struct __sourceloc where)
 {
   int flags;
+  syscall_counters.fcntls++;
   if ((flags = fcntl(fd, F_GETFL, NULL)) == -1) {
     logMessage_perror(LOG_LEVEL_ERROR, where, "set_block: fcntl(%d,F_GETFL,NULL)", fd);
     return -1;
   }
+  syscall_counters.fcntls++;
   if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
     logMessage_perror(LOG_LEVEL_ERROR, where, "set_block: fcntl(%d,F_SETFL,0x%x&~O_NONBLOCK)", fd, flags);
     return -1;
@@ -129,6 +133,33 @@ ssize_t _write_str_nonblock(int fd, const char *str, struct __sourceloc where)
   return _write_all_nonblock(fd, str, strlen(str), where);
 }
 
+/* Pick the TTL of a received packet out of its ancillary data, if present.
+ */
+static void ttl_from_cmsg(struct msghdr *msg, int *ttl)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); 
+       cmsg != NULL; 
+       cmsg = CMSG_NXTHDR(msg,cmsg)) {
+    
+    if ((cmsg->cmsg_level == IPPROTO_IP) && 
+	((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
+	&&(cmsg->cmsg_len) ){
+      if (debug&DEBUG_PACKETRX)
+	DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
+      if (CMSG_DATA(cmsg)) {
+	*ttl = *(unsigned char *) CMSG_DATA(cmsg);
+	if (debug&DEBUG_PACKETRX)
+	  DEBUGF("  TTL of packet is %d", *ttl);
+      } 
+    } else {
+      if (debug&DEBUG_PACKETRX)
+	DEBUGF("I didn't expect to see level=%02x, type=%02x",
+	       cmsg->cmsg_level,cmsg->cmsg_type);
+    }	 
+  }
+}
+
 ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
 		    struct sockaddr *recvaddr, socklen_t *recvaddrlen)
 {
@@ -152,6 +183,7 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
   msg.msg_flags = 0;
   
   ssize_t len = recvmsg(sock,&msg,0);
+  syscall_counters.receives++;
   if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
     return WHY_perror("recvmsg");
   
@@ -160,35 +192,75 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl,
     dump("received data", buffer, len);
   }
   
-  struct cmsghdr *cmsg;
   if (len>0)
-  {
-    for (cmsg = CMSG_FIRSTHDR(&msg); 
-	 cmsg != NULL; 
-	 cmsg = CMSG_NXTHDR(&msg,cmsg)) {
-      
-      if ((cmsg->cmsg_level == IPPROTO_IP) && 
-	  ((cmsg->cmsg_type == IP_RECVTTL) ||(cmsg->cmsg_type == IP_TTL))
-	  &&(cmsg->cmsg_len) ){
-	if (debug&DEBUG_PACKETRX)
-	  DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
-	if (CMSG_DATA(cmsg)) {
-	  *ttl = *(unsigned char *) CMSG_DATA(cmsg);
-	  if (debug&DEBUG_PACKETRX)
-	    DEBUGF("  TTL of packet is %d", *ttl);
-	} 
-      } else {
-	if (debug&DEBUG_PACKETRX)
-	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
-		 cmsg->cmsg_level,cmsg->cmsg_type);
-      }	 
-    }
-  }
+    ttl_from_cmsg(&msg, ttl);
   *recvaddrlen=msg.msg_namelen;
   
   return len;
 }
 
+/* Read up to count datagrams from a non-blocking socket with as few system calls as
+   possible.  Each packet's buffer and bufferlen must be supplied by the caller, the
+   remaining fields are filled in for every packet read.  Returns the number of packets
+   read, which is zero if nothing was waiting, or -1 on error.
+ */
+int recvwithttl_batch(int sock, struct received_packet *packets, int count)
+{
+  if (count > RECV_BATCH_MAX)
+    count = RECV_BATCH_MAX;
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[RECV_BATCH_MAX];
+  struct iovec iov[RECV_BATCH_MAX];
+  struct cmsghdr cmsgcmsg[RECV_BATCH_MAX][16];
+  int i;
+  
+  bzero(msgs, sizeof(struct mmsghdr)*count);
+  for (i=0;i<count;i++){
+    iov[i].iov_base=packets[i].buffer;
+    iov[i].iov_len=packets[i].bufferlen;
+    msgs[i].msg_hdr.msg_name = &packets[i].recvaddr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(packets[i].recvaddr);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = &cmsgcmsg[i][0];
+    msgs[i].msg_hdr.msg_controllen = sizeof(cmsgcmsg[i]);
+  }
+  
+  int r = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+  syscall_counters.receives++;
+  if (r == -1){
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    if (errno != ENOSYS)
+      return WHY_perror("recvmmsg");
+    // built against a C library with recvmmsg() but running on an older kernel
+  }else{
+    for (i=0;i<r;i++){
+      packets[i].len = msgs[i].msg_len;
+      packets[i].ttl = 1;
+      packets[i].recvaddrlen = msgs[i].msg_hdr.msg_namelen;
+      if (packets[i].len>0)
+	ttl_from_cmsg(&msgs[i].msg_hdr, &packets[i].ttl);
+    }
+    return r;
+  }
+#endif
+  int n;
+  for (n=0;n<count;n++){
+    packets[n].ttl = 1;
+    packets[n].recvaddrlen = sizeof(packets[n].recvaddr);
+    packets[n].len = recvwithttl(sock, packets[n].buffer, packets[n].bufferlen, &packets[n].ttl, 
+				 &packets[n].recvaddr, &packets[n].recvaddrlen);
+    if (packets[n].len == -1){
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      // report the packets we have, the error will recur on the next read
+      return n>0?n:-1;
+    }
+  }
+  return n;
+}
+
 int urandombytes(unsigned char *x, unsigned long long xlen)
 {
   static int urandomfd = -1;
@@ -223,8 +295,13 @@ int urandombytes(unsigned char *x, unsigned long long xlen)
   return 0;
 }
 
+/* While the simulator is running, the time of the simulated mesh, see simulate.c */
+time_ms_t *simulated_clock=NULL;
+
 time_ms_t gettime_ms()
 {
+  if (simulated_clock)
+    return *simulated_clock;
   struct timeval nowtv;
   // If gettimeofday() fails or returns an invalid value, all else is lost!
   if (gettimeofday(&nowtv, NULL) == -1)
@@ -234,6 +311,21 @@ time_ms_t gettime_ms()
   return nowtv.tv_sec * 1000LL + nowtv.tv_usec / 1000;
 }
 
+time_ns_t gettime_ns()
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+    FATAL_perror("clock_gettime");
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+#else
+  struct timeval nowtv;
+  if (gettimeofday(&nowtv, NULL) == -1)
+    FATAL_perror("gettimeofday");
+  return nowtv.tv_sec * 1000000000LL + nowtv.tv_usec * 1000LL;
+#endif
+}
+
 // Returns sleep time remaining.
 time_ms_t sleep_ms(time_ms_t milliseconds)
 {
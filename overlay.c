@@ -76,8 +76,51 @@ int overlayMode=0;
 
 overlay_txqueue overlay_tx[OQ_MAX];
 
+const char *overlay_queue_names[OQ_MAX]={
+  [OQ_ISOCHRONOUS_VOICE]="voice",
+  [OQ_MESH_MANAGEMENT]="mesh_management",
+  [OQ_ISOCHRONOUS_VIDEO]="video",
+  [OQ_ORDINARY]="ordinary",
+  [OQ_OPPORTUNISTIC]="opportunistic",
+};
+
 keyring_file *keyring=NULL;
 
+/* Set default congestion levels for queues */
+void overlay_queue_init()
+{
+  int i;
+  for(i=0;i<OQ_MAX;i++) {
+    overlay_tx[i].maxLength=100;
+    overlay_tx[i].latencyTarget=1000; /* Keep packets in queue for 1 second by default */
+    overlay_tx[i].transmit_delay=10; /* Hold onto packets for 10ms before trying to send a full packet */
+    overlay_tx[i].grace_period=100; /* Delay sending a packet for up to 100ms if servald has other processing to do */
+  }
+  /* expire voice/video call packets much sooner, as they just aren't any use if late */
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].latencyTarget=500;
+  overlay_tx[OQ_ISOCHRONOUS_VIDEO].latencyTarget=500;
+
+  /* try to send voice packets without any delay, and before other background processing */
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].transmit_delay=0;
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].grace_period=0;
+
+  /* opportunistic traffic can be significantly delayed */
+  overlay_tx[OQ_OPPORTUNISTIC].transmit_delay=200;
+  overlay_tx[OQ_OPPORTUNISTIC].grace_period=500;
+
+  /* share of the link each class gets while they are all busy, voice always goes first */
+  overlay_tx[OQ_ISOCHRONOUS_VOICE].weight=1;
+  overlay_tx[OQ_MESH_MANAGEMENT].weight=4;
+  overlay_tx[OQ_ISOCHRONOUS_VIDEO].weight=4;
+  overlay_tx[OQ_ORDINARY].weight=2;
+  overlay_tx[OQ_OPPORTUNISTIC].weight=1;
+  for(i=0;i<OQ_MAX;i++) {
+    char buf[80];
+    snprintf(buf, sizeof buf, "mdp.queue.%s.weight", overlay_queue_names[i]);
+    overlay_tx[i].weight=confValueGetInt64Range(buf, overlay_tx[i].weight, 1LL, 1000LL);
+  }
+}
+
 int overlayServerMode()
 {
   /* In overlay mode we need to listen to all of our sockets, and also to
@@ -98,25 +141,12 @@ int overlayServerMode()
   /* put initial identity in if we don't have any visible */
   keyring_seed(keyring);
 
-  /* Set default congestion levels for queues */
-  int i;
-  for(i=0;i<OQ_MAX;i++) {
-    overlay_tx[i].maxLength=100;
-    overlay_tx[i].latencyTarget=1000; /* Keep packets in queue for 1 second by default */
-    overlay_tx[i].transmit_delay=10; /* Hold onto packets for 10ms before trying to send a full packet */
-    overlay_tx[i].grace_period=100; /* Delay sending a packet for up to 100ms if servald has other processing to do */
-  }
-  /* expire voice/video call packets much sooner, as they just aren't any use if late */
-  overlay_tx[OQ_ISOCHRONOUS_VOICE].latencyTarget=500;
-  overlay_tx[OQ_ISOCHRONOUS_VIDEO].latencyTarget=500;
-
-  /* try to send voice packets without any delay, and before other background processing */
-  overlay_tx[OQ_ISOCHRONOUS_VOICE].transmit_delay=0;
-  overlay_tx[OQ_ISOCHRONOUS_VOICE].grace_period=0;
-
-  /* opportunistic traffic can be significantly delayed */
-  overlay_tx[OQ_OPPORTUNISTIC].transmit_delay=200;
-  overlay_tx[OQ_OPPORTUNISTIC].grace_period=500;
+  /* The interface table has to be the same size for the life of the server,
+     and frames can't be queued until it is */
+  if (overlay_interface_table_init())
+    return WHY("Could not allocate the interface table");
+  overlay_queue_init();
+  overlay_capture_init();
   
   /* Get the set of socket file descriptors we need to monitor.
      Note that end-of-file will trigger select(), so we cannot run select() if we 
@@ -166,6 +196,9 @@ schedule(&_sched_##X); }
 
   /* Periodically update route table. */
   SCHEDULE(overlay_route_tick, 100, 100);
+  
+  /* Periodically free subscribers we haven't heard of for a while */
+  SCHEDULE(overlay_address_sweep, 10000, 1000);
 
   /* Show CPU usage stats periodically */
   if (debug&DEBUG_TIMING){
@@ -30,28 +30,141 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
-#define MAX_BPIS 1024
-#define BPI_MASK 0x3ff
-static struct broadcast bpilist[MAX_BPIS];
+/* Broadcast ids we have seen recently, in an open addressed hash table with linear probing.
+   Each id is remembered for BPI_WINDOW_MS, and the table is resized from the number of ids
+   seen in that window, so it grows with the broadcast rate of the mesh up to BPI_MAX_SIZE */
+#define BPI_WINDOW_MS 30000
+#define BPI_MIN_SIZE 1024
+#define BPI_MAX_SIZE 65536
 
-// each node has 16 slots based on the next 4 bits of a subscriber id
-// each slot either points to another tree node or a struct subscriber.
+struct bpi_entry{
+  struct broadcast broadcast;
+  // 0 if the slot has never been used
+  time_ms_t seen;
+};
+
+static struct bpi_entry *bpi_table=NULL;
+static unsigned int bpi_size=0;
+// slots in use, including ids older than the window, since the table was last rebuilt
+static unsigned int bpi_used=0;
+
+static struct {
+  unsigned int checked;
+  unsigned int duplicates;
+  // ids seen again after they had fallen out of the window, so the frame was forwarded again
+  unsigned int reforwarded;
+  // ids dropped before the end of their window because the table was full
+  unsigned int evicted;
+} bpi_counters;
+
+/* Subscribers are kept in a 16 way trie, indexed by the next 4 bits of their sid at each level.
+ Most slots are empty once we are a couple of levels below the root, so a node only stores the slots
+ that are in use, in nibble order. The populated bitmap says which nibbles have a slot, and a slot's
+ position is the number of populated nibbles below it. A node is reallocated when a slot is added.
+ Each subscriber sits in the first slot where its sid differs from every other known sid, so its
+ depth is the shortest abbreviation that is unique, and every tree node has at least two
+ subscribers below it.
+ */
 struct tree_node{
-  // bit flags for the type of object each element points to
-  int is_tree;
-  
-  union{
-    struct tree_node *tree_nodes[16];
-    struct subscriber *subscribers[16];
-  };
+  // bit flags for the nibbles that have a slot
+  uint16_t populated;
+  // bit flags for the slots that point to another tree node, rather than a subscriber
+  uint16_t is_tree;
+  union tree_slot{
+    struct tree_node *tree_node;
+    struct subscriber *subscriber;
+  } slots[];
 };
 
-static struct tree_node root;
+static struct tree_node *root=NULL;
+
+static struct {
+  unsigned int subscribers;
+  unsigned int tree_nodes;
+  unsigned long long tree_bytes;
+} tree_counters;
+
+/* Subscribers are never freed as soon as they are unused, since pointers to them are kept all over
+ the place. Instead, every SUBSCRIBER_SWEEP_MS we start a new generation, and each subscriber
+ remembers the generation it was last looked up in. If the subscriber table is using more than
+ "mdp.subscribers.memory_limit" bytes, unreachable subscribers that haven't been looked up for
+ "mdp.subscribers.idle_ms" are freed, longest idle first, until it fits.
+ Before that, every module that keeps subscriber pointers marks them with subscriber_mark(), and
+ marked subscribers are never freed. Indexes that refer to a freed subscriber are forgotten.
+ */
+#define SUBSCRIBER_SWEEP_MS 10000
+// marked_generation of a subscriber that is about to be freed
+#define SUBSCRIBER_EVICTING 0xFFFFFFFFu
+
+static unsigned int subscriber_generation=1;
+
+static struct {
+  unsigned int sweeps;
+  unsigned int evicted;
+  // idle unreachable subscribers we kept, because something still points to them
+  unsigned int pinned;
+  unsigned long long bytes;
+  unsigned long long limit;
+} sweep_counters;
 
 static struct subscriber *previous=NULL;
 static struct subscriber *sender=NULL;
 static struct broadcast *previous_broadcast=NULL;
 struct subscriber *my_subscriber=NULL;
+// bumped whenever set_reachable() changes a subscriber, so we can tell when routes may have changed
+unsigned int reachable_changes=0;
+
+/* Per-link subscriber indexes.
+ Within a version 2 packet, where receivers know who the sender is, an abbreviated address can be
+ tagged with a one byte index and a one byte generation using the OA_CODE_*_INDEX1 codes. Receivers
+ remember which subscriber each index means for that sender on that interface. Once a subscriber has
+ been tagged in OVERLAY_SID_INDEX_ANNOUNCE broadcast packets, which every neighbour should have heard,
+ the sender refers to it with OA_CODE_INDEX, the index and generation alone.
+ The generation changes whenever an index is given to another subscriber, so a receiver that missed
+ every tag since then doesn't mistake the new subscriber for the old one.
+ A receiver that doesn't know an index asks for it in a please explain, and the sender tags it again.
+ */
+struct sid_index_entry{
+  struct subscriber *subscriber;
+  time_ms_t last_used;
+  // how many broadcast packets has this index been tagged in, and the sequence number of the last one
+  int announced;
+  int announced_sequence;
+  unsigned char generation;
+};
+
+struct overlay_sid_index{
+  struct sid_index_entry entries[OVERLAY_SID_INDEX_SIZE];
+};
+
+struct overlay_index_table{
+  struct overlay_index_table *next;
+  overlay_interface *interface;
+  struct subscriber *subscribers[OVERLAY_SID_INDEX_SIZE];
+  unsigned char generations[OVERLAY_SID_INDEX_SIZE];
+};
+
+// an index is looked for in this many slots from a starting point chosen by the sid
+#define SID_INDEX_PROBE 8
+
+// the interface and sequence number of the packet we are building
+static overlay_interface *link_interface=NULL;
+static int link_sequence=-1;
+
+/* What writing an address tells us about the neighbours, held back while a frame is being built,
+ since the frame may not fit in the packet after all */
+struct written_address{
+  struct subscriber *subscriber;
+  struct sid_index_entry *entry;
+  int bytes_saved;
+  // written with its index tag, or the whole sid
+  char tagged;
+  char full;
+};
+// a frame has at most three addresses; -1 when no frame is being built
+static struct written_address written[3];
+static int written_count=-1;
+static struct subscriber *checkpoint_previous=NULL;
 
 static unsigned char get_nibble(const unsigned char *sid, int pos){
   unsigned char byte = sid[pos>>1];
@@ -60,75 +173,218 @@ static unsigned char get_nibble(const unsigned char *sid, int pos){
   return byte&0xF;
 }
 
+static int tree_slot_index(const struct tree_node *node, int nibble){
+  return __builtin_popcount(node->populated & ((1<<nibble) -1));
+}
+
+static size_t tree_node_size(int slots){
+  return sizeof(struct tree_node) + slots * sizeof(union tree_slot);
+}
+
+// a new tree node, holding a single subscriber
+static struct tree_node *tree_node_new(int nibble, struct subscriber *subscriber){
+  struct tree_node *node=(struct tree_node *)malloc(tree_node_size(1));
+  if (!node){
+    WHY_perror("malloc");
+    return NULL;
+  }
+  node->populated=1<<nibble;
+  node->is_tree=0;
+  node->slots[0].subscriber=subscriber;
+  tree_counters.tree_nodes++;
+  tree_counters.tree_bytes+=tree_node_size(1);
+  return node;
+}
+
+// add an empty slot for this nibble, moving the node if it has to grow
+static union tree_slot *tree_slot_add(struct tree_node **nodep, int nibble){
+  struct tree_node *node=*nodep;
+  int count=__builtin_popcount(node->populated);
+  node=(struct tree_node *)realloc(node, tree_node_size(count+1));
+  if (!node){
+    WHY_perror("realloc");
+    return NULL;
+  }
+  int i=tree_slot_index(node, nibble);
+  memmove(&node->slots[i+1], &node->slots[i], (count - i) * sizeof(union tree_slot));
+  node->populated|=1<<nibble;
+  tree_counters.tree_bytes+=sizeof(union tree_slot);
+  *nodep=node;
+  return &node->slots[i];
+}
+
+// does this sid start with the first nibbles of prefix?
+static int sid_has_prefix(const unsigned char *sid, const unsigned char *prefix, int nibbles){
+  if (memcmp(sid, prefix, nibbles>>1))
+    return 0;
+  return !(nibbles&1) || get_nibble(sid, nibbles-1)==get_nibble(prefix, nibbles-1);
+}
+
+/* Find the subscriber whose sid starts with this many nibbles of prefix.
+ If there is only one, it is returned and *matches is set to 1.
+ Otherwise NULL is returned, and *matches is 0 if no subscriber matches, or 2 if the prefix is
+ too short to tell more than one apart.
+ */
+struct subscriber *find_subscriber_prefix(const unsigned char *prefix, int nibbles, int *matches){
+  struct tree_node *node=root;
+  int pos=0;
+  *matches=0;
+  if (nibbles > SID_SIZE*2)
+    nibbles = SID_SIZE*2;
+  
+  while(node && pos < nibbles){
+    int nibble=get_nibble(prefix, pos++);
+    if (!(node->populated & (1<<nibble)))
+      return NULL;
+    union tree_slot *slot=&node->slots[tree_slot_index(node, nibble)];
+    if (!(node->is_tree & (1<<nibble))){
+      if (!sid_has_prefix(slot->subscriber->sid, prefix, nibbles))
+	return NULL;
+      *matches=1;
+      slot->subscriber->used_generation=subscriber_generation;
+      return slot->subscriber;
+    }
+    node=slot->tree_node;
+  }
+  
+  // we ran out of prefix part way down the tree
+  if (node)
+    *matches=2;
+  return NULL;
+}
+
 // find a subscriber struct from a whole or abbreviated subscriber id
-// TODO find abreviated sid's
 struct subscriber *find_subscriber(const unsigned char *sid, int len, int create){
-  struct tree_node *ptr = &root;
   int pos=0;
   if (len!=SID_SIZE)
     create =0;
   
+  if (!create){
+    int matches;
+    return find_subscriber_prefix(sid, len*2, &matches);
+  }
+  
+  struct tree_node **nodep=&root;
+  if (!root){
+    root=(struct tree_node *)calloc(1, tree_node_size(0));
+    if (!root){
+      WHY_perror("calloc");
+      return NULL;
+    }
+    tree_counters.tree_nodes++;
+    tree_counters.tree_bytes+=tree_node_size(0);
+  }
+  
   do{
-    unsigned char nibble = get_nibble(sid, pos++);
+    struct tree_node *node=*nodep;
+    int nibble = get_nibble(sid, pos++);
     
-    if (ptr->is_tree & (1<<nibble)){
-      ptr = ptr->tree_nodes[nibble];
-      
-    }else if(!ptr->subscribers[nibble]){
+    if (!(node->populated & (1<<nibble))){
       // subscriber is not yet known
-      
-      if (create){
-	struct subscriber *ret=(struct subscriber *)malloc(sizeof(struct subscriber));
-	memset(ret,0,sizeof(struct subscriber));
-	ptr->subscribers[nibble]=ret;
-	bcopy(sid, ret->sid, SID_SIZE);
-	ret->abbreviate_len=pos;
-	// always send the full sid on first use
-	ret->send_full=1;
-	
-	// always send my full sid when we hear about someone new
-	if (my_subscriber)
-	  my_subscriber->send_full = 1;
-      }
-      return ptr->subscribers[nibble];
-      
-    }else{
-      // there's a subscriber in this slot, does it match the rest of the sid we've been given?
-      struct subscriber *ret = ptr->subscribers[nibble];
-      if (memcmp(ret->sid,sid,len)==0){
-	return ret;
+      struct subscriber *ret=(struct subscriber *)malloc(sizeof(struct subscriber));
+      if (!ret){
+	WHY_perror("malloc");
+	return NULL;
       }
-      
-      // if we need to insert this subscriber, we have to make a new tree node first
-      if (!create)
+      union tree_slot *slot=tree_slot_add(nodep, nibble);
+      if (!slot){
+	free(ret);
 	return NULL;
+      }
+      memset(ret,0,sizeof(struct subscriber));
+      slot->subscriber=ret;
+      bcopy(sid, ret->sid, SID_SIZE);
+      ret->abbreviate_len=pos;
+      ret->used_generation=subscriber_generation;
+      // always send the full sid on first use
+      ret->send_full=1;
+      tree_counters.subscribers++;
       
-      // create a new tree node and move the existing subscriber into it
-      struct tree_node *new=(struct tree_node *)malloc(sizeof(struct tree_node));
-      memset(new,0,sizeof(struct tree_node));
-      ptr->tree_nodes[nibble]=new;
-      ptr->is_tree |= (1<<nibble);
-      
-      ptr=new;
-      nibble=get_nibble(ret->sid,pos);
-      ptr->subscribers[nibble]=ret;
-      ret->abbreviate_len=pos+1;
-      // then go around the loop again to compare the next nibble against the sid until we find an empty slot.
+      // always send my full sid when we hear about someone new
+      if (my_subscriber)
+	my_subscriber->send_full = 1;
+      return ret;
+    }
+    
+    union tree_slot *slot=&node->slots[tree_slot_index(node, nibble)];
+    if (node->is_tree & (1<<nibble)){
+      nodep=&slot->tree_node;
+      continue;
+    }
+    
+    // there's a subscriber in this slot, is it the one we were given?
+    struct subscriber *ret = slot->subscriber;
+    if (memcmp(ret->sid,sid,len)==0){
+      ret->used_generation=subscriber_generation;
+      return ret;
     }
+    
+    // move the existing subscriber down into a new tree node
+    struct tree_node *new=tree_node_new(get_nibble(ret->sid,pos), ret);
+    if (!new)
+      return NULL;
+    ret->abbreviate_len=pos+1;
+    slot->tree_node=new;
+    node->is_tree |= (1<<nibble);
+    nodep=&slot->tree_node;
+    // then go around the loop again to compare the next nibble against the sid until we find an empty slot.
   }while(pos < len*2);
   
-  // abbreviation is not unique
+  // can't happen, two different sids must differ somewhere
   return NULL;
 }
 
+/* Take a subscriber out of the tree below *nodep, which is pos nibbles deep.
+ A tree node left with a single subscriber isn't needed any more, so that subscriber moves up
+ to the parent's slot, and its abbreviation gets shorter.
+ */
+static int tree_remove(struct tree_node **nodep, int pos, struct subscriber *subscriber){
+  struct tree_node *node=*nodep;
+  int nibble=get_nibble(subscriber->sid, pos);
+  if (!(node->populated & (1<<nibble)))
+    return WHY("Subscriber is not in the tree");
+  int i=tree_slot_index(node, nibble);
+  
+  if (node->is_tree & (1<<nibble)){
+    if (tree_remove(&node->slots[i].tree_node, pos+1, subscriber))
+      return -1;
+    struct tree_node *child=node->slots[i].tree_node;
+    if (child->is_tree || (child->populated & (child->populated -1)))
+      return 0;
+    struct subscriber *last=child->slots[0].subscriber;
+    node->slots[i].subscriber=last;
+    node->is_tree&=~(1<<nibble);
+    last->abbreviate_len=pos+1;
+    free(child);
+    tree_counters.tree_nodes--;
+    tree_counters.tree_bytes-=tree_node_size(1);
+    return 0;
+  }
+  
+  if (node->slots[i].subscriber!=subscriber)
+    return WHY("Subscriber is not in the tree");
+  int count=__builtin_popcount(node->populated);
+  memmove(&node->slots[i], &node->slots[i+1], (count - i -1) * sizeof(union tree_slot));
+  node->populated&=~(1<<nibble);
+  tree_counters.tree_bytes-=sizeof(union tree_slot);
+  tree_counters.subscribers--;
+  // if we can't shrink the node, it's still usable as it is
+  node=(struct tree_node *)realloc(node, tree_node_size(count -1));
+  if (node)
+    *nodep=node;
+  return 0;
+}
+
 /* 
- Walk the subscriber tree, calling the callback function for each subscriber.
- if start is a valid pointer, the first entry returned will be after this subscriber
+ Walk the subscriber tree in sid order, calling the callback function for each subscriber.
+ If start is a valid pointer, subscribers that sort before the first start_len bytes of start are
+ skipped. If start is a whole sid, that subscriber is skipped too.
+ If end is a valid pointer, the walk stops after the last subscriber that begins with end_len bytes of end.
  if the callback returns non-zero, the process will stop.
  */
 static int walk_tree(struct tree_node *node, int pos, 
-	      unsigned char *start, int start_len, 
-	      unsigned char *end, int end_len,
+	      const unsigned char *start, int start_len, 
+	      const unsigned char *end, int end_len,
 	      int(*callback)(struct subscriber *, void *), void *context){
   int i=0, e=16;
   
@@ -140,26 +396,56 @@ static int walk_tree(struct tree_node *node, int pos,
     e=get_nibble(end,pos) +1;
   }
   
+  int first=i;
+  int slot=tree_slot_index(node, i);
   for (;i<e;i++){
+    if (!(node->populated & (1<<i)))
+      continue;
+    
+    // start and end only limit the first and last branches we look at
+    const unsigned char *s = i==first?start:NULL;
+    const unsigned char *n = i==e-1?end:NULL;
+    
     if (node->is_tree & (1<<i)){
-      if (walk_tree(node->tree_nodes[i], pos+1, start, start_len, end, end_len, callback, context))
+      if (walk_tree(node->slots[slot].tree_node, pos+1, s, start_len, n, end_len, callback, context))
+	return 1;
+    }else{
+      struct subscriber *subscriber=node->slots[slot].subscriber;
+      int c = s?memcmp(subscriber->sid, s, start_len):1;
+      if ((c>0 || (c==0 && start_len<SID_SIZE))
+	  && (!n || memcmp(subscriber->sid, n, end_len)<=0)
+	  && callback(subscriber, context))
 	return 1;
-    }else if(node->subscribers[i]){
-      if ((!start) || start_len<SID_SIZE || memcmp(node->subscribers[i]->sid, start, start_len)!=0)
-	if (callback(node->subscribers[i], context))
-	  return 1;
     }
-    // stop comparing the start sid after looking at the first branch of the tree
-    start=NULL;
+    slot++;
   }
   return 0;
 }
 
 /*
- walk the tree, starting at start, calling the supplied callback function
+ walk the tree, starting after start, calling the supplied callback function
  */
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context){
-  walk_tree(&root, 0, start->sid, SID_SIZE, NULL, 0, callback, context);
+  if (root)
+    walk_tree(root, 0, start?start->sid:NULL, SID_SIZE, NULL, 0, callback, context);
+}
+
+// how much memory does the subscriber tree use
+void overlay_subscriber_stats_keyvalues(XPRINTF xpf)
+{
+  unsigned long long bytes = tree_counters.tree_bytes + (unsigned long long)tree_counters.subscribers * sizeof(struct subscriber);
+  xprintf(xpf, "subscribers.count=%u\n", tree_counters.subscribers);
+  xprintf(xpf, "subscribers.tree_nodes=%u\n", tree_counters.tree_nodes);
+  xprintf(xpf, "subscribers.tree_bytes=%llu\n", tree_counters.tree_bytes);
+  xprintf(xpf, "subscribers.bytes=%llu\n", bytes);
+  xprintf(xpf, "subscribers.bytes_per_subscriber=%.1f\n",
+	  tree_counters.subscribers?(double)bytes / tree_counters.subscribers:0.0);
+  xprintf(xpf, "subscribers.generation=%u\n", subscriber_generation);
+  xprintf(xpf, "subscribers.sweeps=%u\n", sweep_counters.sweeps);
+  xprintf(xpf, "subscribers.swept_bytes=%llu\n", sweep_counters.bytes);
+  xprintf(xpf, "subscribers.memory_limit=%llu\n", sweep_counters.limit);
+  xprintf(xpf, "subscribers.evicted=%u\n", sweep_counters.evicted);
+  xprintf(xpf, "subscribers.pinned=%u\n", sweep_counters.pinned);
 }
 
 // quick test to make sure the specified route is valid.
@@ -207,6 +493,7 @@ int set_reachable(struct subscriber *subscriber, int reachable){
   int old_value=subscriber->reachable;
   
   subscriber->reachable=reachable;
+  reachable_changes++;
   
   // these log messages may be used in tests
   switch(reachable){
@@ -302,33 +589,110 @@ int overlay_broadcast_generate_address(struct broadcast *addr)
   return 0;
 }
 
+static unsigned int bpi_hash(const struct broadcast *addr)
+{
+  // broadcast ids are random, so any 4 bytes will do
+  return (addr->id[0]<<24 | addr->id[1]<<16 | addr->id[2]<<8 | addr->id[3]);
+}
+
+static void bpi_insert(struct bpi_entry *table, unsigned int size, const struct bpi_entry *entry)
+{
+  unsigned int i = bpi_hash(&entry->broadcast) & (size -1);
+  while(table[i].seen)
+    i = (i+1) & (size -1);
+  table[i] = *entry;
+}
+
+/* Rebuild the table without ids that have fallen out of the window, sized so that the ids
+   that are left fill no more than a quarter of it. If the table is already as large as we
+   allow, forget the oldest ids early. */
+static int bpi_rebuild(time_ms_t now)
+{
+  time_ms_t cutoff = now - BPI_WINDOW_MS;
+  unsigned int i, live=0, keep;
+  for (i=0;i<bpi_size;i++)
+    if (bpi_table[i].seen && bpi_table[i].seen >= cutoff)
+      live++;
+  
+  unsigned int size = BPI_MIN_SIZE;
+  while (size < BPI_MAX_SIZE && size < live*4)
+    size<<=1;
+  
+  keep = live;
+  time_ms_t age = BPI_WINDOW_MS;
+  while (keep*2 > size && age > 1){
+    age>>=1;
+    cutoff = now - age;
+    keep=0;
+    for (i=0;i<bpi_size;i++)
+      if (bpi_table[i].seen && bpi_table[i].seen >= cutoff)
+	keep++;
+  }
+  
+  struct bpi_entry *table = calloc(size, sizeof(struct bpi_entry));
+  if (!table)
+    return WHY("calloc() failed rebuilding broadcast id table");
+  for (i=0;i<bpi_size;i++)
+    if (bpi_table[i].seen && bpi_table[i].seen >= cutoff)
+      bpi_insert(table, size, &bpi_table[i]);
+  
+  if (debug&DEBUG_BROADCASTS)
+    DEBUGF("Rebuilt broadcast id table, %u -> %u slots, %u ids, %u evicted", bpi_size, size, keep, live - keep);
+  
+  bpi_counters.evicted += live - keep;
+  if (bpi_table)
+    free(bpi_table);
+  bpi_table = table;
+  bpi_size = size;
+  bpi_used = keep;
+  return 0;
+}
+
 // test if the broadcast address has been seen
 int overlay_broadcast_drop_check(struct broadcast *addr)
 {
-  /* Hash the BPI and see if we have seen it recently.
-     If so, drop the frame.
-     The occassional failure to supress a broadcast frame is not
-     something we are going to worry about just yet.  For byzantine
-     robustness it is however required. */
-  int bpi_index=0;
-  int i;
-  for(i=0;i<BROADCAST_LEN;i++)
-    {
-      bpi_index=((bpi_index<<3)&0xfff8)+((bpi_index>>13)&0x7);
-      bpi_index^=addr->id[i];
-    }
-  bpi_index&=BPI_MASK;
+  /* Look for the BPI in the table of recently seen BPIs.
+     If we saw it within the window, drop the frame. */
+  time_ms_t now = gettime_ms();
+  bpi_counters.checked++;
   
-  if (memcmp(bpilist[bpi_index].id, addr->id, BROADCAST_LEN)){
-    if (debug&DEBUG_BROADCASTS)
-      DEBUGF("BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
-    bcopy(addr->id, bpilist[bpi_index].id, BROADCAST_LEN);
-    return 0; /* don't drop */
-  }else{
-    if (debug&DEBUG_BROADCASTS)
-      DEBUGF("BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
-    return 1; /* drop frame because we have seen this BPI recently */
+  if (bpi_used*4 >= bpi_size*3 && bpi_rebuild(now))
+    return 0;
+  
+  unsigned int i = bpi_hash(addr) & (bpi_size -1);
+  while(bpi_table[i].seen){
+    if (memcmp(bpi_table[i].broadcast.id, addr->id, BROADCAST_LEN)==0){
+      if (bpi_table[i].seen >= now - BPI_WINDOW_MS){
+	bpi_counters.duplicates++;
+	if (debug&DEBUG_BROADCASTS)
+	  DEBUGF("BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
+	return 1; /* drop frame because we have seen this BPI recently */
+      }
+      bpi_counters.reforwarded++;
+      if (debug&DEBUG_BROADCASTS)
+	DEBUGF("BPI %s was last seen %lldms ago", alloca_tohex(addr->id, BROADCAST_LEN), now - bpi_table[i].seen);
+      bpi_table[i].seen = now;
+      return 0;
+    }
+    i = (i+1) & (bpi_size -1);
   }
+  
+  if (debug&DEBUG_BROADCASTS)
+    DEBUGF("BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
+  bcopy(addr->id, bpi_table[i].broadcast.id, BROADCAST_LEN);
+  bpi_table[i].seen = now;
+  bpi_used++;
+  return 0; /* don't drop */
+}
+
+void overlay_broadcast_stats_keyvalues(XPRINTF xpf)
+{
+  xprintf(xpf, "broadcast.checked=%u\n", bpi_counters.checked);
+  xprintf(xpf, "broadcast.duplicates=%u\n", bpi_counters.duplicates);
+  xprintf(xpf, "broadcast.reforwarded=%u\n", bpi_counters.reforwarded);
+  xprintf(xpf, "broadcast.evicted=%u\n", bpi_counters.evicted);
+  xprintf(xpf, "broadcast.table_size=%u\n", bpi_size);
+  xprintf(xpf, "broadcast.table_used=%u\n", bpi_used);
 }
 
 int overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadcast)
@@ -339,24 +703,151 @@ int overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadca
   return 0;
 }
 
+// find or allocate the index for this subscriber on this interface, replacing the least recently used
+static int sid_index_find(overlay_interface *interface, struct subscriber *subscriber, time_ms_t now)
+{
+  if (!interface->sid_index){
+    interface->sid_index=calloc(1, sizeof(struct overlay_sid_index));
+    if (!interface->sid_index)
+      return WHY("calloc() failed allocating subscriber index");
+  }
+  struct sid_index_entry *entries=interface->sid_index->entries;
+  int start=subscriber->sid[SID_SIZE -1];
+  int i, oldest=-1;
+  for (i=0;i<SID_INDEX_PROBE;i++){
+    int index=(start+i) & (OVERLAY_SID_INDEX_SIZE -1);
+    if (entries[index].subscriber==subscriber){
+      entries[index].last_used=now;
+      return index;
+    }
+    if (oldest==-1 || entries[index].last_used < entries[oldest].last_used)
+      oldest=index;
+  }
+  entries[oldest].subscriber=subscriber;
+  entries[oldest].last_used=now;
+  entries[oldest].announced=0;
+  entries[oldest].announced_sequence=-1;
+  entries[oldest].generation++;
+  return oldest;
+}
+
+static void written_address_apply(struct written_address *w)
+{
+  if (link_interface)
+    link_interface->address_bytes_saved += w->bytes_saved;
+  // a unicast packet has no sequence number, and only one neighbour will hear it
+  if (w->entry && w->entry->subscriber==w->subscriber && w->tagged
+    && link_sequence>=0 && w->entry->announced_sequence != link_sequence){
+    w->entry->announced_sequence = link_sequence;
+    w->entry->announced++;
+  }
+  if (w->full)
+    w->subscriber->send_full=0;
+}
+
+static void address_written(struct subscriber *subscriber, struct sid_index_entry *entry, int bytes_saved,
+			    int tagged, int full)
+{
+  struct written_address w={
+    .subscriber=subscriber,
+    .entry=entry,
+    .bytes_saved=bytes_saved,
+    .tagged=tagged,
+    .full=full,
+  };
+  if (written_count>=0 && written_count < sizeof written / sizeof written[0])
+    written[written_count++]=w;
+  else
+    written_address_apply(&w);
+}
+
+/* Hold back what the addresses of the next frame tell us, until it is committed to the packet */
+void overlay_address_checkpoint(void)
+{
+  written_count=0;
+  checkpoint_previous=previous;
+}
+
+/* The frame is in the packet */
+void overlay_address_commit(void)
+{
+  int i;
+  for (i=0;i<written_count;i++)
+    written_address_apply(&written[i]);
+  written_count=-1;
+}
+
+/* The frame was taken out of the packet again, forget its addresses */
+void overlay_address_rewind(void)
+{
+  if (written_count<0)
+    return;
+  written_count=-1;
+  previous=checkpoint_previous;
+}
+
+// append an indexed address, returns 1 if we can't use an index here
+static int overlay_address_append_index(struct overlay_buffer *b, struct subscriber *subscriber, int len)
+{
+  if (!link_interface)
+    return 1;
+  int index=sid_index_find(link_interface, subscriber, gettime_ms());
+  if (index<0)
+    return 1;
+  struct sid_index_entry *entry=&link_interface->sid_index->entries[index];
+  int abbreviation_len = (len==SID_SIZE)?SID_SIZE:len+1;
+  
+  if (entry->announced >= OVERLAY_SID_INDEX_ANNOUNCE && !subscriber->send_full){
+    ob_append_byte(b, OA_CODE_INDEX);
+    ob_append_byte(b, index);
+    ob_append_byte(b, entry->generation);
+    address_written(subscriber, entry, abbreviation_len - 3, 0, 0);
+    return 0;
+  }
+  
+  switch(len){
+    case 3: ob_append_byte(b, OA_CODE_PREFIX3_INDEX1); break;
+    case 7: ob_append_byte(b, OA_CODE_PREFIX7_INDEX1); break;
+    case 11: ob_append_byte(b, OA_CODE_PREFIX11_INDEX1); break;
+    default: ob_append_byte(b, OA_CODE_FULL_INDEX1); break;
+  }
+  ob_append_byte(b, index);
+  ob_append_byte(b, entry->generation);
+  ob_append_bytes(b, subscriber->sid, len);
+  address_written(subscriber, entry, abbreviation_len - 3 - len, 1, len==SID_SIZE);
+  return 0;
+}
+
 // append an appropriate abbreviation into the address
 int overlay_address_append(struct overlay_buffer *b, struct subscriber *subscriber)
 {
+  int len;
+  if (subscriber->send_full || subscriber->abbreviate_len >= 20)
+    len=SID_SIZE;
+  else if (subscriber->abbreviate_len <= 4)
+    len=3;
+  else if (subscriber->abbreviate_len <= 12)
+    len=7;
+  else
+    len=11;
+  
   if (subscriber==sender){
     ob_append_byte(b, OA_CODE_SELF);
     
   }else if(subscriber==previous){
     ob_append_byte(b, OA_CODE_PREVIOUS);
     
-  }else if(subscriber->send_full || subscriber->abbreviate_len >= 20){
-    subscriber->send_full=0;
+  }else if(overlay_address_append_index(b, subscriber, len)==0){
+    
+  }else if(len==SID_SIZE){
+    address_written(subscriber, NULL, 0, 0, 1);
     ob_append_bytes(b, subscriber->sid, SID_SIZE);
     
-  }else if(subscriber->abbreviate_len <= 4){
+  }else if(len==3){
     ob_append_byte(b, OA_CODE_PREFIX3);
     ob_append_bytes(b, subscriber->sid, 3);
     
-  }else if(subscriber->abbreviate_len <= 12){
+  }else if(len==7){
     ob_append_byte(b, OA_CODE_PREFIX7);
     ob_append_bytes(b, subscriber->sid, 7);
     
@@ -393,7 +884,7 @@ int overlay_address_append_self(overlay_interface *interface, struct overlay_buf
 static int add_explain_response(struct subscriber *subscriber, void *context){
   struct decode_context *response = context;
   if (!response->please_explain){
-    response->please_explain = calloc(sizeof(struct overlay_frame),1);
+    response->please_explain = op_new();
     response->please_explain->payload=ob_new();
     ob_limitsize(response->please_explain->payload, 1024);
   }
@@ -404,12 +895,41 @@ static int add_explain_response(struct subscriber *subscriber, void *context){
     subscriber->send_full = 1;
   
   // add the whole subscriber id to the payload, stop if we run out of space
+  struct overlay_buffer *payload = response->please_explain->payload;
+  if (payload->sizeLimit - payload->position < SID_SIZE)
+    return 1;
   DEBUGF("Adding full sid by way of explanation %s", alloca_tohex_sid(subscriber->sid));
-  if (ob_append_bytes(response->please_explain->payload, subscriber->sid, SID_SIZE))
+  if (ob_append_bytes(payload, subscriber->sid, SID_SIZE))
     return 1;
   return 0;
 }
 
+// generate a please explain in the passed in context, asking about an abbreviation we don't know
+int overlay_address_explain(struct decode_context *context, int code, const unsigned char *id, int len){
+  // add the abbreviation you told me about
+  if (!context->please_explain){
+    context->please_explain = op_new();
+    context->please_explain->payload=ob_new();
+    ob_limitsize(context->please_explain->payload, 1024);
+  }
+  
+  // And I'll tell you about any subscribers I know that match this abbreviation, 
+  // so you don't try to use an abbreviation that's too short in future.
+  if (root)
+    walk_tree(root, 0, id, len, id, len, add_explain_response, context);
+  
+  // a route advertisement can mention more unknown subscribers than we have room to ask about,
+  // the rest will be asked about when it is next advertised
+  struct overlay_buffer *payload = context->please_explain->payload;
+  if (payload->sizeLimit - payload->position < (code>=0?1:0) + len)
+    return 0;
+  INFOF("Asking for explanation of %s", alloca_tohex(id, len));
+  if (code>=0)
+    ob_append_byte(payload, code);
+  ob_append_bytes(payload, (unsigned char *)id, len);
+  return 0;
+}
+
 int find_subscr_buffer(struct decode_context *context, struct overlay_buffer *b, int code, int len, int create, struct subscriber **subscriber){
   unsigned char *id = ob_get_bytes_ptr(b, len);
   if (!id)
@@ -425,29 +945,98 @@ int find_subscr_buffer(struct decode_context *context, struct overlay_buffer *b,
   
   if (!*subscriber){
     context->invalid_addresses=1;
-    
-    // generate a please explain in the passed in context
-    
-    // add the abbreviation you told me about
+    overlay_address_explain(context, code, id, len);
+  }else{
+    previous=*subscriber;
+    previous_broadcast=NULL;
+  }
+  return 0;
+}
+
+static struct overlay_index_table *index_table(struct subscriber *neighbour, overlay_interface *interface, int create)
+{
+  struct overlay_index_table *table=neighbour->index_tables;
+  while(table && table->interface!=interface)
+    table=table->next;
+  if (!table && create){
+    table=calloc(1, sizeof(struct overlay_index_table));
+    if (!table)
+      return WHYNULL("calloc() failed allocating index table");
+    table->interface=interface;
+    table->next=neighbour->index_tables;
+    neighbour->index_tables=table;
+  }
+  return table;
+}
+
+// forget the indexes a neighbour has told us about, eg when it restarts
+void overlay_address_index_reset(struct subscriber *subscriber, overlay_interface *interface)
+{
+  struct overlay_index_table *table=index_table(subscriber, interface, 0);
+  if (table)
+    bzero(table->subscribers, sizeof(table->subscribers));
+}
+
+// parse an abbreviated address tagged with an index, and remember the index for this sender
+static int find_subscr_tagged(struct decode_context *context, struct overlay_buffer *b, int code, int len, int create, struct subscriber **subscriber)
+{
+  int index=ob_get(b);
+  int generation=ob_get(b);
+  if (index<0 || generation<0)
+    return WHY("Not enough space in buffer to parse address index");
+  int ret=find_subscr_buffer(context, b, code, len, create, subscriber);
+  if (ret || !subscriber || !*subscriber)
+    return ret;
+  if (sender && context->interface){
+    struct overlay_index_table *table=index_table(sender, context->interface, 1);
+    if (table){
+      table->subscribers[index]=*subscriber;
+      table->generations[index]=generation;
+    }
+  }
+  return 0;
+}
+
+static int find_subscr_index(struct decode_context *context, struct overlay_buffer *b, struct subscriber **subscriber)
+{
+  int index=ob_get(b);
+  int generation=ob_get(b);
+  if (index<0 || generation<0)
+    return WHY("Not enough space in buffer to parse address index");
+  
+  struct subscriber *found=NULL;
+  if (sender && context->interface){
+    struct overlay_index_table *table=index_table(sender, context->interface, 0);
+    // an older generation of this index meant someone else
+    if (table && table->generations[index]==generation)
+      found=table->subscribers[index];
+  }
+  if (subscriber)
+    *subscriber=found;
+  
+  if (!found){
+    context->invalid_addresses=1;
+    if (!sender)
+      return 0;
+    // ask the sender to tag this index again
     if (!context->please_explain){
-      context->please_explain = calloc(sizeof(struct overlay_frame),1);
+      context->please_explain = op_new();
       context->please_explain->payload=ob_new();
       ob_limitsize(context->please_explain->payload, 1024);
     }
-    
-    // And I'll tell you about any subscribers I know that match this abbreviation, 
-    // so you don't try to use an abbreviation that's too short in future.
-    walk_tree(&root, 0, id, len, id, len, add_explain_response, context);
-    
-    INFOF("Asking for explanation of %s", alloca_tohex(id, len));
-    if (code>=0)
-      ob_append_byte(context->please_explain->payload, code);
-    ob_append_bytes(context->please_explain->payload, id, len);
-    
-  }else{
-    previous=*subscriber;
-    previous_broadcast=NULL;
+    INFOF("Asking for explanation of index %d", index);
+    ob_append_byte(context->please_explain->payload, OA_CODE_INDEX);
+    ob_append_byte(context->please_explain->payload, index);
+    return 0;
+  }
+  
+  if (!subscriber){
+    WARN("Could not resolve address, no buffer supplied");
+    context->invalid_addresses=1;
+    return 0;
   }
+  previous=found;
+  previous_broadcast=NULL;
   return 0;
 }
 
@@ -520,6 +1109,26 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
     case OA_CODE_PREFIX11:
       b->position++;
       return find_subscr_buffer(context, b, code, 11,0,subscriber);
+      
+    case OA_CODE_INDEX:
+      b->position++;
+      return find_subscr_index(context, b, subscriber);
+      
+    case OA_CODE_PREFIX3_INDEX1:
+      b->position++;
+      return find_subscr_tagged(context, b, OA_CODE_PREFIX3, 3,0,subscriber);
+      
+    case OA_CODE_PREFIX7_INDEX1:
+      b->position++;
+      return find_subscr_tagged(context, b, OA_CODE_PREFIX7, 7,0,subscriber);
+      
+    case OA_CODE_PREFIX11_INDEX1:
+      b->position++;
+      return find_subscr_tagged(context, b, OA_CODE_PREFIX11, 11,0,subscriber);
+      
+    case OA_CODE_FULL_INDEX1:
+      b->position++;
+      return find_subscr_tagged(context, b, -1, SID_SIZE,1,subscriber);
   }
   
   // we must assume that we wont be able to understand the rest of the packet
@@ -542,6 +1151,14 @@ int send_please_explain(struct decode_context *context, struct subscriber *sourc
     context->please_explain->source = my_subscriber;
   
   if (destination){
+    /* We heard from them, but don't have a route back yet, eg their self announcement was lost.
+       The queue would refuse the frame. They will tell us about themselves or ask us again. */
+    if (subscriber_is_reachable(destination)==REACHABLE_NONE){
+      INFOF("Not sending please explain to %s, it is unreachable", alloca_tohex_sid(destination->sid));
+      op_free(context->please_explain);
+      context->please_explain=NULL;
+      return 0;
+    }
     context->please_explain->destination = destination;
     context->please_explain->ttl=64;
   }else{
@@ -556,6 +1173,21 @@ int send_please_explain(struct decode_context *context, struct subscriber *sourc
   return 0;
 }
 
+static void overlay_address_index_resend(int index)
+{
+  if (index<0)
+    return;
+  int i;
+  // we don't know which interface the request was about, but an extra tag doesn't hurt
+  for (i=0;i<overlay_interface_count;i++){
+    struct overlay_sid_index *sid_index=overlay_interfaces[i].sid_index;
+    if (sid_index && sid_index->entries[index].subscriber){
+      sid_index->entries[index].announced=0;
+      overlay_interfaces[i].index_resyncs++;
+    }
+  }
+}
+
 // process an incoming request for explanation of subscriber abbreviations
 int process_explain(struct overlay_frame *frame){
   struct overlay_buffer *b=frame->payload;
@@ -581,12 +1213,19 @@ int process_explain(struct overlay_frame *frame){
 	len=11;
 	b->position++;
 	break;
+      case OA_CODE_INDEX:
+	// a neighbour missed the packets where we tagged this index, so tag it again
+	b->position++;
+	overlay_address_index_resend(ob_get(b));
+	continue;
     }
     
     if (len==SID_SIZE && code<=0x0f)
       return WHYF("Unsupported abbreviation code %d", code);
     
     unsigned char *sid = ob_get_bytes_ptr(b, len);
+    if (!sid)
+      return WHY("Explain message is truncated");
     
     if (len==SID_SIZE){
       // This message is also used to inform people of previously unknown subscribers
@@ -596,7 +1235,8 @@ int process_explain(struct overlay_frame *frame){
     }else{
       // reply to the sender with all subscribers that match this abbreviation
       INFOF("Sending responses for %s", alloca_tohex(sid, len));
-      walk_tree(&root, 0, sid, len, sid, len, add_explain_response, &context);
+      if (root)
+	walk_tree(root, 0, sid, len, sid, len, add_explain_response, &context);
     }
   }
   
@@ -607,9 +1247,196 @@ int process_explain(struct overlay_frame *frame){
 void overlay_address_clear(void){
   sender=NULL;
   previous=NULL;
+  written_count=-1;
   previous_broadcast=NULL;
+  link_interface=NULL;
+  link_sequence=-1;
+}
+
+// we are building a version 2 packet for this interface, so we can use indexed addresses
+void overlay_address_set_link(overlay_interface *interface, int sequence){
+  link_interface = interface;
+  link_sequence = sequence;
 }
 
 void overlay_address_set_sender(struct subscriber *subscriber){
   sender = subscriber;
 }
+
+void subscriber_mark(struct subscriber *subscriber){
+  if (subscriber)
+    subscriber->marked_generation=subscriber_generation;
+}
+
+struct sweep_state{
+  // memory used by subscribers, apart from the tree itself
+  unsigned long long bytes;
+  unsigned int idle_generations;
+  struct subscriber **victims;
+  int count;
+  int size;
+};
+
+// what does this subscriber cost us, apart from its slot in the tree
+static unsigned long long subscriber_bytes(struct subscriber *subscriber){
+  unsigned long long bytes=sizeof(struct subscriber);
+  struct overlay_index_table *table;
+  if (subscriber->node)
+    bytes+=sizeof(overlay_node);
+  for (table=subscriber->index_tables;table;table=table->next)
+    bytes+=sizeof(struct overlay_index_table);
+  return bytes;
+}
+
+// mark whatever this subscriber's routing information points to
+static int sweep_mark(struct subscriber *subscriber, void *context){
+  struct sweep_state *state=context;
+  state->bytes+=subscriber_bytes(subscriber);
+  
+  if (subscriber->reachable!=REACHABLE_NONE)
+    subscriber_mark(subscriber);
+  if (subscriber->reachable==REACHABLE_INDIRECT)
+    subscriber_mark(subscriber->next_hop);
+  if (subscriber->node){
+    int i;
+    for (i=0;i<OVERLAY_MAX_OBSERVATIONS;i++)
+      if (subscriber->node->observations[i].observed_score)
+	subscriber_mark(subscriber->node->observations[i].sender);
+  }
+  return 0;
+}
+
+static int sweep_find_victims(struct subscriber *subscriber, void *context){
+  struct sweep_state *state=context;
+  if (subscriber_generation - subscriber->used_generation < state->idle_generations)
+    return 0;
+  if (subscriber->marked_generation==subscriber_generation){
+    if (subscriber->reachable==REACHABLE_NONE)
+      sweep_counters.pinned++;
+    return 0;
+  }
+  if (state->count>=state->size){
+    int size=state->size?state->size*2:64;
+    struct subscriber **victims=realloc(state->victims, size * sizeof(struct subscriber *));
+    if (!victims){
+      WHY_perror("realloc");
+      return 1;
+    }
+    state->victims=victims;
+    state->size=size;
+  }
+  state->victims[state->count++]=subscriber;
+  return 0;
+}
+
+static int compare_idle(const void *a, const void *b){
+  const struct subscriber *s1=*(const struct subscriber **)a;
+  const struct subscriber *s2=*(const struct subscriber **)b;
+  // the oldest generation is the longest idle, allowing for the counter wrapping around
+  int d = (int)(s1->used_generation - s2->used_generation);
+  return d<0?-1:d>0?1:0;
+}
+
+// forget any indexes that refer to subscribers we are about to free
+static int sweep_forget_indexes(struct subscriber *subscriber, void *context){
+  struct overlay_index_table *table;
+  int i;
+  for (table=subscriber->index_tables;table;table=table->next)
+    for (i=0;i<OVERLAY_SID_INDEX_SIZE;i++)
+      if (table->subscribers[i] && table->subscribers[i]->marked_generation==SUBSCRIBER_EVICTING)
+	table->subscribers[i]=NULL;
+  return 0;
+}
+
+static void subscriber_free(struct subscriber *subscriber){
+  while(subscriber->index_tables){
+    struct overlay_index_table *table=subscriber->index_tables;
+    subscriber->index_tables=table->next;
+    free(table);
+  }
+  if (subscriber->node)
+    free(subscriber->node);
+  free(subscriber);
+}
+
+/* Free unreachable subscribers that haven't been looked up in the last idle_generations
+ generations, and that nothing points to, until the subscriber table uses no more than limit bytes.
+ Returns the number of subscribers freed.
+ */
+int overlay_address_evict(unsigned long long limit, unsigned int idle_generations){
+  struct sweep_state state;
+  bzero(&state, sizeof state);
+  state.idle_generations=idle_generations;
+  
+  // a new generation, so every mark from last time is stale
+  if (++subscriber_generation==SUBSCRIBER_EVICTING)
+    subscriber_generation=1;
+  sweep_counters.sweeps++;
+  sweep_counters.pinned=0;
+  sweep_counters.limit=limit;
+  
+  subscriber_mark(my_subscriber);
+  subscriber_mark(directory_service);
+  subscriber_mark(sender);
+  subscriber_mark(previous);
+  op_mark_subscribers();
+  overlay_nack_mark_subscribers();
+  overlay_mdp_mark_subscribers();
+  overlay_route_mark_subscribers();
+  overlay_advertise_mark_subscribers();
+  enum_subscribers(NULL, sweep_mark, &state);
+  sweep_counters.bytes=tree_counters.tree_bytes + state.bytes;
+  
+  if (sweep_counters.bytes <= limit)
+    return 0;
+  
+  enum_subscribers(NULL, sweep_find_victims, &state);
+  qsort(state.victims, state.count, sizeof(struct subscriber *), compare_idle);
+  
+  int i, n;
+  for (n=0;n<state.count && tree_counters.tree_bytes + state.bytes > limit;n++){
+    state.bytes-=subscriber_bytes(state.victims[n]);
+    state.victims[n]->marked_generation=SUBSCRIBER_EVICTING;
+    // the tree shrinks as we go, so we know when we've done enough
+    if (tree_remove(&root, 0, state.victims[n])){
+      state.victims[n]->marked_generation=0;
+      break;
+    }
+  }
+  
+  if (n){
+    for (i=0;i<overlay_interface_count;i++){
+      struct overlay_sid_index *sid_index=overlay_interfaces[i].sid_index;
+      int j;
+      if (!sid_index)
+	continue;
+      for (j=0;j<OVERLAY_SID_INDEX_SIZE;j++)
+	if (sid_index->entries[j].subscriber
+	    && sid_index->entries[j].subscriber->marked_generation==SUBSCRIBER_EVICTING){
+	  // keep the generation, neighbours may still remember this index
+	  sid_index->entries[j].subscriber=NULL;
+	  sid_index->entries[j].last_used=0;
+	  sid_index->entries[j].announced=0;
+	}
+    }
+    enum_subscribers(NULL, sweep_forget_indexes, NULL);
+    for (i=0;i<n;i++)
+      subscriber_free(state.victims[i]);
+    sweep_counters.evicted+=n;
+    sweep_counters.bytes=tree_counters.tree_bytes + state.bytes;
+    INFOF("Freed %d idle subscribers, %llu bytes in use", n, sweep_counters.bytes);
+  }
+  free(state.victims);
+  return n;
+}
+
+void overlay_address_sweep(struct sched_ent *alarm)
+{
+  long long idle_ms = confValueGetInt64Range("mdp.subscribers.idle_ms", 600000LL, 0LL, 86400000LL);
+  long long limit = confValueGetInt64Range("mdp.subscribers.memory_limit", 4194304LL, 0LL, 0x7FFFFFFFFFFFLL);
+  overlay_address_evict(limit, idle_ms / SUBSCRIBER_SWEEP_MS);
+  
+  alarm->alarm = gettime_ms() + SUBSCRIBER_SWEEP_MS;
+  alarm->deadline = alarm->alarm + 1000;
+  schedule(alarm);
+}
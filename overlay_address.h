@@ -99,6 +99,12 @@ struct subscriber{
   time_ms_t sas_last_request;
   unsigned char sas_valid;
   
+  // indexes this subscriber has given to other subscribers, if it is a neighbour
+  struct overlay_index_table *index_tables;
+  
+  // the generation this subscriber was last looked up in, and last marked as in use
+  unsigned int used_generation;
+  unsigned int marked_generation;
 };
 
 struct broadcast{
@@ -106,14 +112,18 @@ struct broadcast{
 };
 
 struct decode_context{
+  // the interface the packet arrived on, needed to look up indexed addresses
+  struct overlay_interface *interface;
   int invalid_addresses;
   struct overlay_frame *please_explain;
 };
 
 extern struct subscriber *my_subscriber;
 extern struct subscriber *directory_service;
+extern unsigned int reachable_changes;
 
 struct subscriber *find_subscriber(const unsigned char *sid, int len, int create);
+struct subscriber *find_subscriber_prefix(const unsigned char *prefix, int nibbles, int *matches);
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context);
 int subscriber_is_reachable(struct subscriber *subscriber);
 int set_reachable(struct subscriber *subscriber, int reachable);
@@ -123,16 +133,26 @@ int load_subscriber_address(struct subscriber *subscriber);
 int process_explain(struct overlay_frame *frame);
 int overlay_broadcast_drop_check(struct broadcast *addr);
 int overlay_broadcast_generate_address(struct broadcast *addr);
+void overlay_broadcast_stats_keyvalues(XPRINTF xpf);
+void overlay_subscriber_stats_keyvalues(XPRINTF xpf);
+void subscriber_mark(struct subscriber *subscriber);
+int overlay_address_evict(unsigned long long limit, unsigned int idle_generations);
 
 int overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadcast);
 int overlay_address_append(struct overlay_buffer *b, struct subscriber *subscriber);
 int overlay_address_append_self(overlay_interface *interface, struct overlay_buffer *b);
 
 int overlay_address_parse(struct decode_context *context, struct overlay_buffer *b, struct broadcast *broadcast, struct subscriber **subscriber);
+int overlay_address_explain(struct decode_context *context, int code, const unsigned char *id, int len);
 int send_please_explain(struct decode_context *context, struct subscriber *source, struct subscriber *destination);
 
 void overlay_address_clear(void);
 void overlay_address_set_sender(struct subscriber *subscriber);
+void overlay_address_set_link(overlay_interface *interface, int sequence);
+void overlay_address_checkpoint(void);
+void overlay_address_commit(void);
+void overlay_address_rewind(void);
+void overlay_address_index_reset(struct subscriber *subscriber, overlay_interface *interface);
 
 
 #endif
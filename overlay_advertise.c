@@ -60,6 +60,15 @@ int overlay_route_please_advertise(overlay_node *n)
 
 struct subscriber *last_advertised=NULL;
 
+// keep the subscribers we will advertise next
+void overlay_advertise_mark_subscribers()
+{
+  int i;
+  for (i=0;i<oad_request_count;i++)
+    subscriber_mark(oad_requests[i]->subscriber);
+  subscriber_mark(last_advertised);
+}
+
 int add_advertisement(struct subscriber *subscriber, void *context){
   struct overlay_buffer *e=context;
   
@@ -98,9 +107,8 @@ int overlay_route_add_advertisements(overlay_interface *interface, struct overla
      collisions, including by birthday paradox (good for networks upto about
      20million nodes), and one byte each for score gateways_en_route.
 
-     XXX - We need to send full addresses sometimes so that receiver can
-     resolve them. Either that or we need to start supporting the PLEASEEXPLAIN
-     packets, which is probably a better solution.
+     A receiver that doesn't recognise a prefix sends us a PLEASEEXPLAIN,
+     and we reply with every full address that starts with it.
 
      The receiver will discount the score based on their measured reliability
      for packets to arrive from us; we just repeat what discounted score
@@ -183,6 +191,11 @@ int overlay_route_add_advertisements(overlay_interface *interface, struct overla
 int overlay_route_saw_advertisements(int i, struct overlay_frame *f, long long now)
 {
   IN();
+  struct decode_context context={
+    .interface=&overlay_interfaces[i],
+    .please_explain=NULL,
+  };
+  
   while(f->payload->position < f->payload->sizeLimit)
     {
       struct subscriber *subscriber;
@@ -194,10 +207,18 @@ int overlay_route_saw_advertisements(int i, struct overlay_frame *f, long long n
       if (!sid || score<0 || gateways_en_route<0)
 	continue;
       
-      subscriber = find_subscriber(sid, 6, 0);
+      int matches;
+      subscriber = find_subscriber_prefix(sid, 12, &matches);
       
       if (!subscriber){
-	WARN("Dispatch PLEASEEXPLAIN not implemented");
+	if (matches)
+	  WARNF("Advertised prefix %s matches more than one subscriber", alloca_tohex(sid, 6));
+	else
+	  /* Without the full address we can't record a route, and a node that isn't our neighbour
+	     is only ever mentioned to us here. Ask the advertiser for every subscriber it knows
+	     that starts with the same 3 bytes, the shortest abbreviation process_explain()
+	     understands. */
+	  overlay_address_explain(&context, OA_CODE_PREFIX3, sid, 3);
 	continue;
       }
       
@@ -218,5 +239,6 @@ int overlay_route_saw_advertisements(int i, struct overlay_frame *f, long long n
       
     }
   
+  send_please_explain(&context, NULL, f->source);
   RETURN(0);;
 }
@@ -19,6 +19,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "serval.h"
 #include "overlay_buffer.h"
+#include "mem_pool.h"
 
 /*
  When writing to a buffer, sizeLimit may place an upper bound on the amount of space to use
@@ -30,9 +31,70 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 
 
+static struct mem_pool buffer_pool = MEM_POOL("overlay_buffer", sizeof(struct overlay_buffer), 64);
+
+/*
+ Buffer storage is allocated in power of two size classes from OB_MIN_CLASS up to OB_MAX_CLASS bytes,
+ each served from its own pool. Anything larger falls back to malloc().
+ */
+#define OB_MIN_CLASS 64
+#define OB_CLASSES 9
+#define OB_MAX_CLASS (OB_MIN_CLASS<<(OB_CLASSES-1))
+
+static struct mem_pool bytes_pools[OB_CLASSES]={
+  MEM_POOL("ob_bytes_64", 64, 256),
+  MEM_POOL("ob_bytes_128", 128, 128),
+  MEM_POOL("ob_bytes_256", 256, 64),
+  MEM_POOL("ob_bytes_512", 512, 32),
+  MEM_POOL("ob_bytes_1024", 1024, 16),
+  MEM_POOL("ob_bytes_2048", 2048, 8),
+  MEM_POOL("ob_bytes_4096", 4096, 4),
+  MEM_POOL("ob_bytes_8192", 8192, 2),
+  MEM_POOL("ob_bytes_16384", 16384, 1),
+};
+
+static int ob_size_class(int size)
+{
+  int class=0;
+  while(class<OB_CLASSES && (OB_MIN_CLASS<<class) < size)
+    class++;
+  return class;
+}
+
+// allocate storage of at least *size bytes, updating *size to the amount actually available
+static unsigned char *ob_bytes_alloc(int *size)
+{
+  int class = ob_size_class(*size);
+  if (class>=OB_CLASSES)
+    return malloc(*size);
+  *size = OB_MIN_CLASS<<class;
+  return pool_alloc(&bytes_pools[class]);
+}
+
+static void ob_bytes_free(unsigned char *bytes, int size)
+{
+#ifdef MALLOC_PARANOIA
+  free(bytes);
+#else
+  int class = ob_size_class(size);
+  if (class<OB_CLASSES && (OB_MIN_CLASS<<class)==size)
+    pool_free(&bytes_pools[class], bytes);
+  else
+    free(bytes);
+#endif
+}
+
+void ob_pool_stats_keyvalues(XPRINTF xpf)
+{
+  int i;
+  pool_stats_keyvalues(&buffer_pool, xpf);
+  for (i=0;i<OB_CLASSES;i++)
+    pool_stats_keyvalues(&bytes_pools[i], xpf);
+}
+
 struct overlay_buffer *ob_new(void)
 {
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_calloc(&buffer_pool);
   if (!ret) return NULL;
   
   ob_unlimitsize(ret);
@@ -40,19 +102,33 @@ struct overlay_buffer *ob_new(void)
   return ret;
 }
 
+// initialise a caller supplied buffer, usually on the stack, to index an existing static buffer.
+// Nothing is allocated, so the buffer must not be passed to ob_free().
+void ob_init_static(struct overlay_buffer *b, unsigned char *bytes, int size){
+  bzero(b, sizeof(struct overlay_buffer));
+  b->bytes = bytes;
+  b->allocSize = size;
+  b->allocated = 0;
+  ob_unlimitsize(b);
+}
+
 // index an existing static buffer.
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *ob_static(unsigned char *bytes, int size){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_alloc(&buffer_pool);
   if (!ret) return NULL;
-  ret->bytes = bytes;
-  ret->allocSize = size;
-  ret->allocated = 0;
-  ob_unlimitsize(ret);
-  
+  ob_init_static(ret, bytes, size);
   return ret;
 }
 
+// initialise a caller supplied buffer to index part of another buffer, without allocating.
+int ob_init_slice(struct overlay_buffer *slice, struct overlay_buffer *b, int offset, int length){
+  if (offset+length > b->allocSize)
+    return WHY("Buffer isn't long enough to slice");
+  ob_init_static(slice, b->bytes+offset, length);
+  return 0;
+}
+
 // create a new overlay buffer from an existing piece of another buffer.
 // Both buffers will point to the same memory region.
 // It is up to the caller to ensure this buffer is not used after the parent buffer is freed.
@@ -60,44 +136,44 @@ struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length
   if (offset+length > b->allocSize)
     return WHYNULL("Buffer isn't long enough to slice");
       
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
+  struct overlay_buffer *ret=pool_alloc(&buffer_pool);
   if (!ret)
       return NULL;
-  ret->bytes = b->bytes+offset;
-  ret->allocSize = length;
-  ret->allocated = 0;
-  ob_unlimitsize(ret);
-  
+  ob_init_static(ret, b->bytes+offset, length);
   return ret;
 }
 
 struct overlay_buffer *ob_dup(struct overlay_buffer *b){
-  struct overlay_buffer *ret=calloc(sizeof(struct overlay_buffer),1);
-  ret->sizeLimit = b->sizeLimit;
-  ret->position = b->position;
-  ret->checkpointLength = b->checkpointLength;
+  struct overlay_buffer *ret=pool_calloc(&buffer_pool);
+  if (!ret) return NULL;
+  ret->sizeLimit = -1;
   
   if (b->bytes && b->allocSize){
-    // duplicate any bytes that might be relevant
-    int byteCount = b->sizeLimit;
-    if (byteCount < b->position)
-      byteCount = b->position;
+    // duplicate any bytes that might be relevant; a buffer we have written to ends at its position,
+    // while the size limit of a freshly sliced buffer marks the end of its bytes
+    int byteCount = b->position ? b->position : b->sizeLimit;
     if (byteCount > b->allocSize)
       byteCount = b->allocSize;
     
-    ob_append_bytes(ret, b->bytes, byteCount);
+    if (byteCount>0 && ob_append_bytes(ret, b->bytes, byteCount)){
+      ob_free(ret);
+      return NULL;
+    }
   }
+  // the copy is left positioned after the bytes, ready to be sent
+  ret->sizeLimit = b->sizeLimit;
+  ret->checkpointLength = b->checkpointLength;
   return ret;
 }
 
 int ob_free(struct overlay_buffer *b)
 {
   if (!b) return WHY("Asked to free NULL");
-  if (b->bytes && b->allocated) free(b->bytes);
+  if (b->bytes && b->allocated) ob_bytes_free(b->bytes, b->allocSize);
   b->bytes=NULL;
   b->allocSize=0;
   b->sizeLimit=0;
-  free(b);
+  pool_free(&buffer_pool, b);
   return 0;
 }
 
@@ -154,7 +230,7 @@ int ob_makespace(struct overlay_buffer *b,int bytes)
   int newSize=b->position+bytes;
   if (newSize<64) newSize=64;
   if (newSize&63) newSize+=64-(newSize&63);
-  if (newSize>1024) {
+  if (newSize>OB_MAX_CLASS) {
     if (newSize&1023) newSize+=1024-(newSize&1023);
   }
   if (newSize>65536) {
@@ -187,10 +263,12 @@ int ob_makespace(struct overlay_buffer *b,int bytes)
     for(i=0;i<4096;i++) new[newSize+i]=0xbd;
   }
 #else
-  unsigned char *new=malloc(newSize);
+  // grow into the next size class; newSize is rounded up to the class size
+  unsigned char *new=ob_bytes_alloc(&newSize);
+  if (!new) return WHY("ob_bytes_alloc() failed");
 #endif
   bcopy(b->bytes,new,b->position);
-  if (b->bytes) free(b->bytes);
+  if (b->bytes) ob_bytes_free(b->bytes, b->allocSize);
   b->bytes=new;
   b->allocated=1;
   b->allocSize=newSize;
@@ -20,6 +20,8 @@
 #ifndef _SERVALD_OVERLAY_BUFFER_H
 #define _SERVALD_OVERLAY_BUFFER_H
 
+#include "xprintf.h"
+
 struct overlay_buffer {
   unsigned char *bytes;
   
@@ -46,8 +48,11 @@ struct overlay_buffer {
 struct overlay_buffer *ob_new(void);
 struct overlay_buffer *ob_static(unsigned char *bytes, int size);
 struct overlay_buffer *ob_slice(struct overlay_buffer *b, int offset, int length);
+void ob_init_static(struct overlay_buffer *b, unsigned char *bytes, int size);
+int ob_init_slice(struct overlay_buffer *slice, struct overlay_buffer *b, int offset, int length);
 struct overlay_buffer *ob_dup(struct overlay_buffer *b);
 int ob_free(struct overlay_buffer *b);
+void ob_pool_stats_keyvalues(XPRINTF xpf);
 int ob_checkpoint(struct overlay_buffer *b);
 int ob_rewind(struct overlay_buffer *b);
 int ob_limitsize(struct overlay_buffer *b,int bytes);
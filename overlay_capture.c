@@ -0,0 +1,320 @@
+/*
+ Serval Daemon
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sys/time.h>
+#include "serval.h"
+
+/* Capture of raw overlay packets.
+
+ Every packet an interface sends or receives is copied into a fixed size ring in memory, so that
+ the most recent traffic can be examined after something goes wrong. Unlike DEBUG_PACKETRX and
+ DEBUG_PACKETTX, this costs one copy per packet, so it can be left running.
+
+ Each record is a struct capture_record followed by the packet bytes, padded to a multiple of 8
+ bytes. Records never wrap around the end of the ring; the space left at the end is skipped, and
+ holds a record with no bytes if it is big enough. When the ring is full, the oldest records are
+ overwritten.
+
+ The ring is written out on demand, by "servald capture dump" or SIGUSR1, as a pcap file.
+ Each packet is given a Linux "cooked" v2 header, which records the interface number and whether
+ the packet was sent or received, then IPv4 and UDP headers so that tools can show where it came from.
+ */
+
+struct capture_record{
+  // the space this record takes in the ring, including padding
+  uint32_t size;
+  uint16_t caplen;
+  uint16_t len;
+  uint32_t tv_sec;
+  uint32_t tv_usec;
+  // network byte order
+  uint32_t src_addr;
+  uint32_t dst_addr;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t interface;
+  uint8_t direction;
+  uint8_t reserved[2];
+};
+
+#define CAPTURE_MIN_BYTES 4096
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_LINUX_SLL2 276
+#define SLL2_HEADER_LEN 20
+#define SLL2_PACKET_HOST 0
+#define SLL2_PACKET_OUTGOING 4
+#define IPV4_HEADER_LEN 20
+#define UDP_HEADER_LEN 8
+
+static unsigned char *capture_ring=NULL;
+static size_t capture_size=0;
+static int capture_snaplen=0;
+// positions of the next byte to write and the oldest record, counting every byte ever written
+static unsigned long long capture_head=0;
+static unsigned long long capture_tail=0;
+
+static unsigned int capture_records=0;
+static unsigned int capture_captured=0;
+static unsigned int capture_overwritten=0;
+
+int overlay_capture_dump_requested=0;
+
+/* Allocate the ring, if "capture.bytes" is set */
+int overlay_capture_init()
+{
+  long long bytes = confValueGetInt64Range("capture.bytes", 262144LL, 0LL, 1LL<<30);
+  if (bytes==0)
+    return 0;
+  if (bytes < CAPTURE_MIN_BYTES)
+    bytes = CAPTURE_MIN_BYTES;
+  bytes &= ~7LL;
+
+  capture_ring = malloc(bytes);
+  if (!capture_ring)
+    return WHYF("malloc() failed allocating %lld byte capture ring", bytes);
+  capture_size = bytes;
+  capture_head = capture_tail = 0;
+  capture_records = 0;
+
+  // big packets mustn't push everything else out
+  capture_snaplen = confValueGetInt64Range("capture.snaplen", 2048LL, 64LL, 65535LL);
+  if (capture_snaplen > capture_size/4 - sizeof(struct capture_record))
+    capture_snaplen = capture_size/4 - sizeof(struct capture_record);
+
+  INFOF("Capturing overlay packets in a %lld byte ring", bytes);
+  return 0;
+}
+
+/* Returns the position of the record after the one at position */
+static unsigned long long capture_next(unsigned long long position)
+{
+  size_t offset = position % capture_size;
+  size_t remaining = capture_size - offset;
+  if (remaining < sizeof(struct capture_record))
+    return position + remaining;
+  return position + ((struct capture_record *)&capture_ring[offset])->size;
+}
+
+/* Copy a packet into the ring. Peer is who the packet came from, or is going to. */
+void overlay_capture_packet(overlay_interface *interface, int direction, const struct sockaddr *peer,
+			    const unsigned char *bytes, size_t len)
+{
+  // a record with no bytes is padding
+  if (!capture_ring || !len)
+    return;
+
+  size_t caplen = len > capture_snaplen ? capture_snaplen : len;
+  size_t size = (sizeof(struct capture_record) + caplen + 7) & ~7;
+  size_t offset = capture_head % capture_size;
+  size_t skip = (capture_size - offset < size) ? capture_size - offset : 0;
+
+  // make room, oldest first, without counting the padding at the end of the ring as a packet
+  while (capture_head + skip + size - capture_tail > capture_size){
+    size_t tail_offset = capture_tail % capture_size;
+    if (capture_size - tail_offset >= sizeof(struct capture_record)
+      && ((struct capture_record *)&capture_ring[tail_offset])->caplen){
+      capture_records--;
+      capture_overwritten++;
+    }
+    capture_tail = capture_next(capture_tail);
+  }
+
+  if (skip){
+    if (skip >= sizeof(struct capture_record)){
+      struct capture_record *pad = (struct capture_record *)&capture_ring[offset];
+      pad->size = skip;
+      pad->caplen = 0;
+    }
+    capture_head += skip;
+    offset = 0;
+  }
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  struct capture_record *r = (struct capture_record *)&capture_ring[offset];
+  r->size = size;
+  r->caplen = caplen;
+  r->len = len > 0xFFFF ? 0xFFFF : len;
+  r->tv_sec = tv.tv_sec;
+  r->tv_usec = tv.tv_usec;
+  r->interface = interface - overlay_interfaces;
+  r->direction = direction;
+
+  uint32_t peer_addr = 0;
+  uint16_t peer_port = 0;
+  if (peer && peer->sa_family == AF_INET){
+    peer_addr = ((struct sockaddr_in *)peer)->sin_addr.s_addr;
+    peer_port = ((struct sockaddr_in *)peer)->sin_port;
+  }
+  if (direction == CAPTURE_TX){
+    r->src_addr = interface->address.sin_addr.s_addr;
+    r->src_port = htons(interface->port);
+    r->dst_addr = peer_addr;
+    r->dst_port = peer_port ? peer_port : htons(interface->port);
+  }else{
+    r->src_addr = peer_addr;
+    r->src_port = peer_port ? peer_port : htons(interface->port);
+    r->dst_addr = interface->address.sin_addr.s_addr;
+    r->dst_port = htons(interface->port);
+  }
+  bcopy(bytes, r+1, caplen);
+
+  capture_head += size;
+  capture_records++;
+  capture_captured++;
+}
+
+static void put_ui16(unsigned char *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void put_ui32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* Fill in the link, IPv4 and UDP headers we give to each captured packet */
+static void capture_headers(struct capture_record *r, unsigned char *h)
+{
+  bzero(h, SLL2_HEADER_LEN + IPV4_HEADER_LEN + UDP_HEADER_LEN);
+
+  put_ui16(&h[0], 0x0800);
+  put_ui32(&h[4], r->interface);
+  put_ui16(&h[8], 1);
+  h[10] = r->direction == CAPTURE_TX ? SLL2_PACKET_OUTGOING : SLL2_PACKET_HOST;
+
+  unsigned char *ip = &h[SLL2_HEADER_LEN];
+  ip[0] = 0x45;
+  put_ui16(&ip[2], IPV4_HEADER_LEN + UDP_HEADER_LEN + r->len);
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  bcopy(&r->src_addr, &ip[12], 4);
+  bcopy(&r->dst_addr, &ip[16], 4);
+  uint32_t sum = 0;
+  int i;
+  for (i=0;i<IPV4_HEADER_LEN;i+=2)
+    sum += (ip[i] << 8) | ip[i+1];
+  while (sum >> 16)
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  put_ui16(&ip[10], ~sum);
+
+  unsigned char *udp = &ip[IPV4_HEADER_LEN];
+  bcopy(&r->src_port, &udp[0], 2);
+  bcopy(&r->dst_port, &udp[2], 2);
+  put_ui16(&udp[4], UDP_HEADER_LEN + r->len);
+}
+
+/* Write the packets in the ring, oldest first, to capture.pcap in the instance directory.
+   Nobody else gets to choose where we write, clients copy the file from there.
+   Returns the number of packets written, or -1 on error. */
+int overlay_capture_write_pcap()
+{
+  if (!capture_ring)
+    return WHY("Packet capture is not enabled");
+
+  char path[1024], temp[1024];
+  if (!FORM_SERVAL_INSTANCE_PATH(path, "capture.pcap")
+    || !FORM_SERVAL_INSTANCE_PATH(temp, "capture.pcap.temp"))
+    return -1;
+  FILE *f = fopen(temp, "w");
+  if (!f)
+    return WHYF_perror("fopen(%s)", temp);
+
+  struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+  } file_header = {
+    .magic = PCAP_MAGIC,
+    .version_major = 2,
+    .version_minor = 4,
+    .snaplen = SLL2_HEADER_LEN + IPV4_HEADER_LEN + UDP_HEADER_LEN + capture_snaplen,
+    .linktype = LINKTYPE_LINUX_SLL2,
+  };
+  if (fwrite(&file_header, sizeof file_header, 1, f) != 1)
+    goto error;
+
+  int count = 0;
+  unsigned long long position;
+  for (position = capture_tail; position < capture_head; position = capture_next(position)){
+    size_t offset = position % capture_size;
+    if (capture_size - offset < sizeof(struct capture_record))
+      continue;
+    struct capture_record *r = (struct capture_record *)&capture_ring[offset];
+    if (!r->caplen)
+      continue;
+
+    unsigned char headers[SLL2_HEADER_LEN + IPV4_HEADER_LEN + UDP_HEADER_LEN];
+    capture_headers(r, headers);
+    uint32_t record_header[4] = {
+      r->tv_sec,
+      r->tv_usec,
+      sizeof headers + r->caplen,
+      sizeof headers + r->len,
+    };
+    if (fwrite(record_header, sizeof record_header, 1, f) != 1
+      || fwrite(headers, sizeof headers, 1, f) != 1
+      || fwrite(r+1, r->caplen, 1, f) != 1)
+      goto error;
+    count++;
+  }
+  if (count != capture_records)
+    WARNF("Capture ring should hold %u packets, but %d were found", capture_records, count);
+
+  if (fclose(f))
+    return WHYF_perror("fclose(%s)", temp);
+  if (rename(temp, path) == -1)
+    return WHYF_perror("rename(%s, %s)", temp, path);
+  INFOF("Wrote %d captured packets to %s", count, path);
+  return count;
+
+error:
+  WHYF_perror("fwrite(%s)", temp);
+  fclose(f);
+  return -1;
+}
+
+/* Write the capture to the instance directory, in response to SIGUSR1 */
+void overlay_capture_dump_check()
+{
+  if (!overlay_capture_dump_requested)
+    return;
+  overlay_capture_dump_requested=0;
+  overlay_capture_write_pcap();
+}
+
+void overlay_capture_stats_keyvalues(XPRINTF xpf)
+{
+  xprintf(xpf, "capture.bytes=%llu\n", (unsigned long long)capture_size);
+  xprintf(xpf, "capture.used_bytes=%llu\n", capture_head - capture_tail);
+  xprintf(xpf, "capture.packets=%u\n", capture_records);
+  xprintf(xpf, "capture.captured=%u\n", capture_captured);
+  xprintf(xpf, "capture.overwritten=%u\n", capture_overwritten);
+}
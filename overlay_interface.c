@@ -19,18 +19,24 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <assert.h>
 #include <time.h>
+#include <limits.h>
 #include "serval.h"
 #include "strbuf.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
+#include "mem_pool.h"
 
 #ifdef HAVE_IFADDRS_H
 #include <ifaddrs.h>
 #endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 int overlay_ready=0;
 int overlay_interface_count=0;
-overlay_interface overlay_interfaces[OVERLAY_MAX_INTERFACES];
+overlay_interface *overlay_interfaces=NULL;
+int overlay_max_interfaces=0;
 int overlay_last_interface_number=-1;
 
 struct interface_rules {
@@ -46,29 +52,104 @@ struct interface_rules *interface_filter=NULL;
 
 struct profile_total interface_poll_stats;
 struct profile_total dummy_poll_stats;
+struct profile_total dummy_ring_poll_stats;
 
 struct sched_ent sock_any;
 struct sockaddr_in sock_any_addr;
 struct profile_total sock_any_stats;
 
+/* Read at most this many UDP packets from one socket per wakeup, so a busy interface
+   can't starve the others */
+#define OVERLAY_RX_BATCH 8
+static unsigned char rx_buffers[OVERLAY_RX_BATCH][16384];
+
 struct outgoing_packet{
   overlay_interface *interface;
   int i;
   int unicast;
+  int payloads;
+  // envelope sequence number, or -1 for a version 1 or unicast packet
+  int sequence;
+  struct sockaddr_in dest;
+  struct overlay_buffer *buffer;
+  /* Distinguishes this packet from every other, so each frame is only considered once per packet */
+  unsigned int serial;
+  /* Set once a frame didn't fit. Then the rest of the space is filled with the largest frames that will */
+  int packing;
+  /* Set during a class's turn when it had a frame that would fit, but not the credit to send it */
+  int short_of_credit;
+  /* Set during a class's turn when it had the credit to send a frame, but no room for it */
+  int overflowed;
+  /* Set once every class has had its turns, then any space left over is free for whoever can use it */
+  int leftover;
+};
+
+/* The fewest bytes any frame takes in a packet; type, ttl, length, three one byte addresses and
+   a byte of payload. Once a packet has less room than this, it is full. */
+#define OVERLAY_FRAME_MIN_LEN 7
+static unsigned int packet_serial=0;
+
+/* Bytes of credit per unit of queue weight, for each turn a class has */
+#define OVERLAY_DRR_QUANTUM 256
+/* The most turns each class has in one packet, enough for the smallest quantum to fill it */
+#define OVERLAY_DRR_ROUNDS 8
+// the class other than voice whose turn it is, and whether it has had its credit for this turn
+static int drr_next=0;
+static int drr_credited=0;
+
+struct sched_ent expire_alarm;
+struct profile_total expire_stats;
+
+/* Packets assembled during one scheduling round are held here, and sent by
+   overlay_tx_flush() with one sendmmsg() per interface */
+#define OVERLAY_TX_BATCH 16
+struct pending_datagram{
+  int interface;
   struct sockaddr_in dest;
   struct overlay_buffer *buffer;
 };
+static struct pending_datagram tx_pending[OVERLAY_TX_BATCH];
+static int tx_pending_count=0;
 
 struct sched_ent next_packet;
 struct profile_total send_packet;
+/* the earliest time that an interface we are pacing will have tokens for a deferred frame */
+static time_ms_t pacing_alarm=0;
+
+/* Dummy interface files hold fixed size records, one per packet.
+ 
+ Originally every packet was appended to the end of the file, so the file grows forever and
+ every reader has to poll it with lseek() and read() for each packet.
+ 
+ Instead the file may start with a struct dummy_ring_header, followed by record_count records that
+ are reused round and round. Every process maps the whole file into memory. A writer claims a
+ record by atomically incrementing head, copies in the packet, then stamps the record with its
+ position in the ring + 1 so readers can tell when it is complete, and whether it has been
+ overwritten while they were copying it out.
+ */
+#define DUMMY_RECORD_SIZE 2048
+#define DUMMY_RING_RECORDS 1024
+#define DUMMY_RING_MAGIC "SVRING01"
+/* bytes 112-119 of each record, reserved in the original format */
+#define DUMMY_RECORD_STAMP 112
+
+struct dummy_ring_header{
+  char magic[8];
+  uint32_t record_size;
+  uint32_t record_count;
+  uint64_t head;
+};
 
 static int overlay_tick_interface(int i, time_ms_t now);
+static void overlay_interface_spend(overlay_interface *interface, int bytes, time_ms_t now);
 static void overlay_interface_poll(struct sched_ent *alarm);
+static int overlay_dummy_ring_open(overlay_interface *interface, int fd, const char *path, int create);
+static void overlay_dummy_ring_poll(struct sched_ent *alarm);
+static void overlay_dummy_ring_close(overlay_interface *interface);
 static void		logServalPacket(int level, struct __sourceloc where, const char *message, const unsigned char *packet, size_t len);
 static long long	parse_quantity(char *q);
 
-unsigned char magic_header[]={/* Magic */ 'O',0x10,
-  /* Version */ 0x00,0x01};
+unsigned char magic_header[]={/* Magic */ 'O',0x10};
 
 
 static int overlay_interface_type(char *s)
@@ -181,6 +262,9 @@ int overlay_interface_args(const char *arg)
   return 0;     
 }
 
+static void overlay_interface_index(overlay_interface *interface);
+static void overlay_interface_unindex(overlay_interface *interface);
+
 static void
 overlay_interface_close(overlay_interface *interface){
   if (interface->fileP){
@@ -190,9 +274,23 @@ overlay_interface_close(overlay_interface *interface){
   }
   unschedule(&interface->alarm);
   unwatch(&interface->alarm);
+  if (interface->ring)
+    overlay_dummy_ring_close(interface);
   close(interface->alarm.poll.fd);
   interface->alarm.poll.fd=-1;
   interface->state=INTERFACE_STATE_DOWN;
+  interface->up_at=0;
+  overlay_interface_unindex(interface);
+}
+
+// remember when the interface came up, so we can see how long it takes to announce ourselves
+static void
+overlay_interface_mark_up(overlay_interface *interface){
+  overlay_interface_unindex(interface);
+  overlay_interface_index(interface);
+  interface->state=INTERFACE_STATE_UP;
+  interface->up_at=gettime_ms();
+  interface->up_to_announce_ms=-1;
 }
 
 // create a socket with options common to all our UDP sockets
@@ -253,31 +351,189 @@ error:
   return -1;
 }
 
+/* UP interfaces are indexed by subnet and by name, in chained hash tables with
+   a power of two buckets, at least twice as many as there are interfaces */
+static overlay_interface **subnet_index=NULL;
+static overlay_interface **name_index=NULL;
+static unsigned int index_mask=0;
+// how many indexed interfaces have each netmask, so lookups only try the prefix lengths in use
+static unsigned int prefix_users[33];
+
+/* Allocate the interface table, with room for "interface.max" interfaces */
+int overlay_interface_table_init(){
+  if (overlay_interfaces)
+    return 0;
+  
+  int max = confValueGetInt64Range("interface.max", OVERLAY_MAX_INTERFACES, 1LL, OVERLAY_INTERFACE_LIMIT);
+  unsigned int buckets=1;
+  while(buckets < 2*max)
+    buckets<<=1;
+  
+  // broadcast frames keep a byte for each interface
+  if (op_pool_init(max))
+    return -1;
+  
+  overlay_interfaces = calloc(max, sizeof(overlay_interface));
+  subnet_index = calloc(buckets, sizeof(overlay_interface *));
+  name_index = calloc(buckets, sizeof(overlay_interface *));
+  if (!overlay_interfaces || !subnet_index || !name_index){
+    free(overlay_interfaces);
+    free(subnet_index);
+    free(name_index);
+    overlay_interfaces=NULL;
+    return WHY("calloc() failed");
+  }
+  overlay_max_interfaces = max;
+  index_mask = buckets -1;
+  return 0;
+}
+
+static unsigned int subnet_hash(uint32_t network){
+  return (ntohl(network) * 2654435761u) >> 16;
+}
+
+// dummy interfaces are found by the name after the '>'
+static const char *interface_index_name(const char *name){
+  return *name=='>'?name+1:name;
+}
+
+static unsigned int name_hash(const char *name){
+  unsigned int hash=5381;
+  for (name=interface_index_name(name); *name; name++)
+    hash = hash*33 + tolower(*name);
+  return hash;
+}
+
+static int netmask_prefix_len(struct in_addr mask){
+  uint32_t m = ntohl(mask.s_addr);
+  int len=0;
+  while(m & 0x80000000){
+    len++;
+    m<<=1;
+  }
+  return len;
+}
+
+static void overlay_interface_index(overlay_interface *interface){
+  if (!interface->fileP){
+    interface->prefix_len = netmask_prefix_len(interface->netmask);
+    overlay_interface **bucket = &subnet_index[subnet_hash(interface->address.sin_addr.s_addr & interface->netmask.s_addr) & index_mask];
+    interface->next_by_subnet = *bucket;
+    *bucket = interface;
+    prefix_users[interface->prefix_len]++;
+  }
+  overlay_interface **bucket = &name_index[name_hash(interface->name) & index_mask];
+  interface->next_by_name = *bucket;
+  *bucket = interface;
+}
+
+static void overlay_interface_unindex(overlay_interface *interface){
+  overlay_interface **p;
+  if (!interface->fileP){
+    for (p = &subnet_index[subnet_hash(interface->address.sin_addr.s_addr & interface->netmask.s_addr) & index_mask]; *p; p=&(*p)->next_by_subnet){
+      if (*p==interface){
+	*p = interface->next_by_subnet;
+	prefix_users[interface->prefix_len]--;
+	break;
+      }
+    }
+  }
+  for (p = &name_index[name_hash(interface->name) & index_mask]; *p; p=&(*p)->next_by_name){
+    if (*p==interface){
+      *p = interface->next_by_name;
+      break;
+    }
+  }
+  interface->next_by_subnet=NULL;
+  interface->next_by_name=NULL;
+}
+
+/* Find the UP interface on the same subnet as this address, trying the longest netmask first */
 overlay_interface * overlay_interface_find(struct in_addr addr){
-  int i;
-  for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
-    if (overlay_interfaces[i].state!=INTERFACE_STATE_UP)
+  int len;
+  if (!subnet_index)
+    return NULL;
+  for (len=32;len>=0;len--){
+    if (!prefix_users[len])
       continue;
-    if ((overlay_interfaces[i].netmask.s_addr & addr.s_addr) == (overlay_interfaces[i].netmask.s_addr & overlay_interfaces[i].address.sin_addr.s_addr)){
-      return &overlay_interfaces[i];
+    uint32_t mask = len?htonl(0xFFFFFFFFu << (32 - len)):0;
+    overlay_interface *interface = subnet_index[subnet_hash(addr.s_addr & mask) & index_mask];
+    for (;interface;interface=interface->next_by_subnet){
+      if (interface->state==INTERFACE_STATE_UP
+	  && interface->prefix_len==len
+	  && (interface->address.sin_addr.s_addr & mask) == (addr.s_addr & mask))
+	return interface;
     }
   }
-  
   return NULL;
 }
 
 overlay_interface * overlay_interface_find_name(const char *name){
+  if (!name_index)
+    return NULL;
+  overlay_interface *interface = name_index[name_hash(name) & index_mask];
+  for (;interface;interface=interface->next_by_name){
+    if (interface->state==INTERFACE_STATE_UP
+	&& strcasecmp(interface_index_name(name), interface_index_name(interface->name))==0)
+      return interface;
+  }
+  return NULL;
+}
+
+/* Read a batch of packets from a socket, and pass each to packetOk().  If interface is
+   NULL, the interface each packet arrived on is identified by its source address.
+   Returns -1 if the socket could not be read.
+ */
+static int overlay_interface_receive(struct sched_ent *alarm, overlay_interface *interface){
+  struct received_packet packets[OVERLAY_RX_BATCH];
   int i;
-  for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
-    if (overlay_interfaces[i].state!=INTERFACE_STATE_UP)
-      continue;
-    if (strcasecmp((*name=='>'?name+1:name), 
-		   (*overlay_interfaces[i].name=='>'?overlay_interfaces[i].name+1:overlay_interfaces[i].name)
-		   )==0){
-      return &overlay_interfaces[i];
+  
+  for (i=0;i<OVERLAY_RX_BATCH;i++){
+    packets[i].buffer=rx_buffers[i];
+    packets[i].bufferlen=sizeof(rx_buffers[i]);
+  }
+  
+  int count = recvwithttl_batch(alarm->poll.fd, packets, OVERLAY_RX_BATCH);
+  if (count == -1)
+    return WHY("recvwithttl_batch(c)");
+  if (alarm->stats)
+    fd_count_packets(alarm->stats, count);
+  
+  for (i=0;i<count;i++){
+    struct received_packet *p=&packets[i];
+    struct in_addr src = ((struct sockaddr_in *)&p->recvaddr)->sin_addr;
+    overlay_interface *packet_interface = interface;
+    
+    if (!packet_interface){
+      /* Try to identify the real interface that the packet arrived on */
+      packet_interface = overlay_interface_find(src);
+      
+      /* Drop the packet if we don't find a match */
+      if (!packet_interface){
+	if (debug&DEBUG_OVERLAYINTERFACES)
+	  DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
+	continue;
+      }
+    }
+    
+    /* We have a frame from this interface */
+    packet_interface->rx_packets++;
+    packet_interface->rx_bytes+=p->len;
+    overlay_capture_packet(packet_interface, CAPTURE_RX, &p->recvaddr, p->buffer, p->len);
+    if (debug&DEBUG_PACKETRX)
+      DEBUG_packet_visualise("Read from real interface", p->buffer,p->len);
+    if (debug&DEBUG_OVERLAYINTERFACES) 
+      DEBUGF("Received %d bytes from %s on interface %s%s",(int)p->len, 
+	     inet_ntoa(src),
+	     packet_interface->name,
+	     interface?"":" (ANY)");
+    if (packetOk(packet_interface,p->buffer,p->len,NULL,p->ttl,&p->recvaddr,p->recvaddrlen,1)) {
+      WHY("Malformed packet");
+      // Do we really want to attempt to parse it again?
+      //DEBUG_packet_visualise("Malformed packet", p->buffer,p->len);
     }
   }
-  return NULL;
+  return 0;
 }
 
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
@@ -285,45 +541,11 @@ overlay_interface * overlay_interface_find_name(const char *name){
 static void
 overlay_interface_read_any(struct sched_ent *alarm){
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    int recvttl=1;
-    unsigned char packet[16384];
-    overlay_interface *interface=NULL;
-    struct sockaddr src_addr;
-    socklen_t addrlen = sizeof(src_addr);
-    
-    /* Read only one UDP packet per call to share resources more fairly, and also
-     enable stats to accurately count packets received */
-    plen = recvwithttl(alarm->poll.fd, packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-    if (plen == -1) {
-      WHY_perror("recvwithttl(c)");
+    if (overlay_interface_receive(alarm, NULL) == -1) {
       unwatch(alarm);
       close(alarm->poll.fd);
       return;
     }
-    
-    struct in_addr src = ((struct sockaddr_in *)&src_addr)->sin_addr;
-    
-    /* Try to identify the real interface that the packet arrived on */
-    interface = overlay_interface_find(src);
-    
-    /* Drop the packet if we don't find a match */
-    if (!interface){
-      if (debug&DEBUG_OVERLAYINTERFACES)
-	DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(src));
-      return;
-    }
-    
-    /* We have a frame from this interface */
-    if (debug&DEBUG_PACKETRX)
-      DEBUG_packet_visualise("Read from real interface", packet,plen);
-    if (debug&DEBUG_OVERLAYINTERFACES) 
-      DEBUGF("Received %d bytes from %s on interface %s (ANY)",plen, 
-	     inet_ntoa(((struct sockaddr_in *)&src_addr)->sin_addr),
-	     interface->name);
-    if (packetOk(interface,packet,plen,NULL,recvttl,&src_addr,addrlen,1)) {
-      WHY("Malformed packet");
-    }
   }
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
     INFO("Closing broadcast socket due to error");
@@ -413,7 +635,7 @@ overlay_interface_init_socket(int interface_index)
     schedule(&interface->alarm);
   }
   
-  interface->state=INTERFACE_STATE_UP;
+  overlay_interface_mark_up(interface);
   
   INFOF("Interface %s addr %s, is up",interface->name, inet_ntoa(interface->broadcast_address.sin_addr));
   
@@ -425,13 +647,18 @@ overlay_interface_init_socket(int interface_index)
   return 0;
 }
 
+/* Set by the simulator to take every packet we send, see simulate.c */
+int (*overlay_simulated_transmit)(overlay_interface *interface, unsigned char *bytes, int len)=NULL;
+
 static int
 overlay_interface_init(char *name, struct in_addr src_addr, struct in_addr netmask,
 		       struct in_addr broadcast,
 		       int speed_in_bits, int port, int type)
 {
   /* Too many interfaces */
-  if (overlay_interface_count>=OVERLAY_MAX_INTERFACES) return WHY("Too many interfaces -- Increase OVERLAY_MAX_INTERFACES");
+  if (!overlay_interfaces)
+    return WHY("The interface table has not been allocated");
+  if (overlay_interface_count>=overlay_max_interfaces) return WHY("Too many interfaces -- Increase interface.max");
 
   overlay_interface *const interface = &overlay_interfaces[overlay_interface_count];
 
@@ -445,6 +672,12 @@ overlay_interface_init(char *name, struct in_addr src_addr, struct in_addr netma
   interface->port=port;
   interface->type=type;
   interface->last_tick_ms= -1; // not ticked yet
+  interface->envelope_peer_heard=0;
+  interface->legacy_peer_heard=0;
+  // start somewhere random, so that neighbours can tell we have restarted
+  interface->sequence_number=random()&0xFFFF;
+  interface->tokens_updated=0;
+  interface->rate_window_start=0;
   interface->alarm.poll.fd=0;
   
   // how often do we announce ourselves on this interface?
@@ -480,7 +713,23 @@ overlay_interface_init(char *name, struct in_addr src_addr, struct in_addr netma
     INFOF("Interface %s is running tickless", name);
   }
   
-  if (name[0]=='>') {
+  if (overlay_simulated_transmit) {
+    /* No file or socket, the simulator carries our packets */
+    interface->fileP=1;
+    interface->alarm.poll.fd=-1;
+    interface->alarm.function=overlay_interface_poll;
+    interface_poll_stats.name="overlay_interface_poll";
+    interface->alarm.stats=&interface_poll_stats;
+    if (interface->tick_ms>0){
+      interface->alarm.alarm=gettime_ms();
+      interface->alarm.deadline=interface->alarm.alarm+10;
+      schedule(&interface->alarm);
+    }
+    overlay_interface_mark_up(interface);
+    if (my_subscriber)
+      my_subscriber->send_full = 1;
+    
+  } else if (name[0]=='>') {
     interface->fileP=1;
     char dummyfile[1024];
     if (name[1]=='/') {
@@ -491,24 +740,44 @@ overlay_interface_init(char *name, struct in_addr src_addr, struct in_addr netma
       snprintf(dummyfile, sizeof(dummyfile), "%s/%s", interface_folder, &name[1]);
     }
     
-    if ((interface->alarm.poll.fd = open(dummyfile,O_APPEND|O_RDWR)) < 1) {
+    int fd = open(dummyfile,O_APPEND|O_RDWR);
+    if (fd < 1) {
       return WHYF("could not open dummy interface file %s for append", dummyfile);
     }
-
-    /* Seek to end of file as initial reading point */
-    interface->recv_offset = lseek(interface->alarm.poll.fd,0,SEEK_END);
+    
+    interface->ring=NULL;
+    interface->ring_fd=-1;
+    switch (overlay_dummy_ring_open(interface, fd, dummyfile, confValueGetBoolean("interface.dummy_ring", 0))){
+    case -1:
+      close(fd);
+      return WHYF("could not map dummy interface file %s", dummyfile);
+    case 0:
+      // the ring has set up alarm.poll.fd
+      interface->alarm.function=overlay_dummy_ring_poll;
+      dummy_ring_poll_stats.name="overlay_dummy_ring_poll";
+      interface->alarm.stats=&dummy_ring_poll_stats;
+      if (interface->alarm.poll.fd!=-1){
+	interface->alarm.poll.events=POLLIN;
+	watch(&interface->alarm);
+      }
+      break;
+    default:
+      interface->alarm.poll.fd = fd;
+      /* Seek to end of file as initial reading point */
+      interface->recv_offset = lseek(interface->alarm.poll.fd,0,SEEK_END);
+      interface->alarm.function=overlay_dummy_poll;
+      dummy_poll_stats.name="overlay_dummy_poll";
+      interface->alarm.stats=&dummy_poll_stats;
+    }
     /* XXX later add pretend location information so that we can decide which "packets" to receive
        based on closeness */    
     
     // schedule an alarm for this interface
-    interface->alarm.function=overlay_dummy_poll;
     interface->alarm.alarm=gettime_ms()+10;
     interface->alarm.deadline=interface->alarm.alarm;
-    dummy_poll_stats.name="overlay_dummy_poll";
-    interface->alarm.stats=&dummy_poll_stats;
     schedule(&interface->alarm);
     
-    interface->state=INTERFACE_STATE_UP;
+    overlay_interface_mark_up(interface);
     INFOF("Dummy interface %s is up",interface->name);
     
     // mark our sid to be sent in full
@@ -537,6 +806,14 @@ overlay_interface_init(char *name, struct in_addr src_addr, struct in_addr netma
   return 0;
 }
 
+/* Bring up an interface for a node in the simulator */
+int overlay_interface_init_simulated(char *name, int speed_in_bits)
+{
+  struct in_addr any;
+  any.s_addr=INADDR_ANY;
+  return overlay_interface_init(name, any, any, any, speed_in_bits, PORT_DNA, OVERLAY_INTERFACE_WIFI);
+}
+
 static void overlay_interface_poll(struct sched_ent *alarm)
 {
   struct overlay_interface *interface = (overlay_interface *)alarm;
@@ -557,35 +834,10 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }
   
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    unsigned char packet[16384];
-
-    struct sockaddr src_addr;
-    socklen_t addrlen = sizeof(src_addr);
-
-    
-    /* Read only one UDP packet per call to share resources more fairly, and also
-       enable stats to accurately count packets received */
-    int recvttl=1;
-    plen = recvwithttl(alarm->poll.fd,packet, sizeof(packet), &recvttl, &src_addr, &addrlen);
-    if (plen == -1) {
-      WHY_perror("recvwithttl(c)");
+    if (overlay_interface_receive(alarm, interface) == -1) {
       overlay_interface_close(interface);
       return;
     }
-    
-    /* We have a frame from this interface */
-    if (debug&DEBUG_PACKETRX)
-      DEBUG_packet_visualise("Read from real interface", packet,plen);
-    if (debug&DEBUG_OVERLAYINTERFACES) 
-      DEBUGF("Received %d bytes from %s on interface %s",plen, 
-	     inet_ntoa(((struct sockaddr_in *)&src_addr)->sin_addr),
-	     interface->name);
-    if (packetOk(interface,packet,plen,NULL,recvttl,&src_addr,addrlen,1)) {
-      WHY("Malformed packet");
-      // Do we really want to attempt to parse it again?
-      //DEBUG_packet_visualise("Malformed packet", packet,plen);
-    }
   }
   
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
@@ -593,6 +845,34 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }  
 }
 
+/* Unpack one dummy interface record, see overlay_broadcast_ensemble() for the layout */
+static void overlay_dummy_receive(overlay_interface *interface, unsigned char *packet)
+{
+  struct sockaddr src_addr;
+  size_t addrlen = sizeof(src_addr);
+  unsigned char transaction_id[8];
+  int plen = packet[110] + (packet[111] << 8);
+  if (plen > DUMMY_RECORD_SIZE - 128)
+    plen = -1;
+  if (debug&DEBUG_PACKETRX)
+    DEBUG_packet_visualise("Read from dummy interface", &packet[128], plen);
+  bzero(&transaction_id[0],8);
+  bzero(&src_addr,sizeof(src_addr));
+  if (plen >= 4) {
+    interface->rx_packets++;
+    interface->rx_bytes+=plen;
+    overlay_capture_packet(interface, CAPTURE_RX, NULL, &packet[128], plen);
+    if (packet[0] == 0x01 && packet[1] == 0 && packet[2] == 0 && packet[3] == 0) {
+      if (packetOk(interface,&packet[128],plen,transaction_id, -1 /* fake TTL */, &src_addr,addrlen,1) == -1)
+	WARN("Unsupported packet from dummy interface");
+    } else {
+      WARNF("Unsupported packet version from dummy interface: %02x %02x %02x %02x", packet[0], packet[1], packet[2], packet[3]);
+    }
+  } else {
+    WARNF("Invalid packet from dummy interface: plen=%lld", (long long) plen);
+  }
+}
+
 void overlay_dummy_poll(struct sched_ent *alarm)
 {
   overlay_interface *interface = (overlay_interface *)alarm;
@@ -600,11 +880,7 @@ void overlay_dummy_poll(struct sched_ent *alarm)
   /* XXX Okay, so how are we managing out-of-process consumers?
      They need some way to register their interest in listening to a port.
   */
-  unsigned char packet[2048];
-  int plen=0;
-  struct sockaddr src_addr;
-  size_t addrlen = sizeof(src_addr);
-  unsigned char transaction_id[8];
+  unsigned char packet[DUMMY_RECORD_SIZE];
   time_ms_t now = gettime_ms();
 
   /* Read from dummy interface file */
@@ -634,23 +910,7 @@ void overlay_dummy_poll(struct sched_ent *alarm)
       else {
 	if (nread == sizeof packet) {
 	  interface->recv_offset += nread;
-	  plen = packet[110] + (packet[111] << 8);
-	  if (plen > nread - 128)
-	    plen = -1;
-	  if (debug&DEBUG_PACKETRX)
-	    DEBUG_packet_visualise("Read from dummy interface", &packet[128], plen);
-	  bzero(&transaction_id[0],8);
-	  bzero(&src_addr,sizeof(src_addr));
-	  if (plen >= 4) {
-	    if (packet[0] == 0x01 && packet[1] == 0 && packet[2] == 0 && packet[3] == 0) {
-	      if (packetOk(interface,&packet[128],plen,transaction_id, -1 /* fake TTL */, &src_addr,addrlen,1) == -1)
-		WARN("Unsupported packet from dummy interface");
-	    } else {
-	      WARNF("Unsupported packet version from dummy interface: %02x %02x %02x %02x", packet[0], packet[1], packet[2], packet[3]);
-	    }
-	  } else {
-	    WARNF("Invalid packet from dummy interface: plen=%lld", (long long) plen);
-	  }
+	  overlay_dummy_receive(interface, packet);
 	}
 	else
 	  WARNF("Read %lld bytes from dummy interface", nread);
@@ -679,6 +939,208 @@ void overlay_dummy_poll(struct sched_ent *alarm)
   return ;
 }
 
+/* Returns 0 if the dummy interface file holds a ring, creating one in an empty file if create is set.
+   Returns 1 if it is a file of appended records, or -1 on error */
+static int overlay_dummy_ring_open(overlay_interface *interface, int fd, const char *path, int create)
+{
+  // hold a lock while we look, so only one process sets up an empty file
+  struct flock lock;
+  bzero(&lock, sizeof lock);
+  lock.l_type=F_WRLCK;
+  lock.l_whence=SEEK_SET;
+  if (fcntl(fd, F_SETLKW, &lock)==-1)
+    return WHY_perror("fcntl(F_SETLKW)");
+  
+  int ret=1;
+  struct dummy_ring_header *ring=NULL;
+  struct stat st;
+  if (fstat(fd, &st)==-1){
+    ret=WHY_perror("fstat");
+    goto unlock;
+  }
+  
+  if (st.st_size==0){
+    if (!create)
+      goto unlock;
+    // pwrite() ignores the offset on an O_APPEND file, so write the header through the mapping
+    st.st_size=DUMMY_RECORD_SIZE*(DUMMY_RING_RECORDS+1);
+    if (ftruncate(fd, st.st_size)==-1){
+      ret=WHY_perror("ftruncate");
+      goto unlock;
+    }
+  }else{
+    char magic[8];
+    if (st.st_size < DUMMY_RECORD_SIZE 
+      || pread(fd, magic, sizeof magic, 0)!=sizeof magic
+      || memcmp(magic, DUMMY_RING_MAGIC, sizeof magic))
+      goto unlock;
+  }
+  
+  ring = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ring==MAP_FAILED){
+    ret=WHY_perror("mmap");
+    goto unlock;
+  }
+  
+  if (create && ring->magic[0]==0){
+    ring->record_size=DUMMY_RECORD_SIZE;
+    ring->record_count=DUMMY_RING_RECORDS;
+    ring->head=0;
+    __sync_synchronize();
+    memcpy(ring->magic, DUMMY_RING_MAGIC, sizeof ring->magic);
+    INFOF("Created dummy interface ring in %s", path);
+  }
+  
+  if (ring->record_size!=DUMMY_RECORD_SIZE || ring->record_count<1 
+    || (off_t)DUMMY_RECORD_SIZE*(ring->record_count+1) > st.st_size){
+    munmap(ring, st.st_size);
+    ret=WHYF("Dummy interface ring %s is corrupt", path);
+    goto unlock;
+  }
+  
+  interface->ring=ring;
+  interface->ring_size=st.st_size;
+  interface->ring_fd=fd;
+  // start reading from the next packet written
+  interface->ring_next=__sync_fetch_and_add(&ring->head, 0);
+  interface->alarm.poll.fd=-1;
+  
+#ifdef HAVE_SYS_INOTIFY_H
+  /* Writing through a shared mapping doesn't raise inotify events, 
+     so writers touch the file after each record to wake us up */
+  int nfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (nfd==-1)
+    WHY_perror("inotify_init1");
+  else if (inotify_add_watch(nfd, path, IN_ATTRIB|IN_MODIFY)==-1){
+    WHY_perror("inotify_add_watch");
+    close(nfd);
+  }else
+    interface->alarm.poll.fd=nfd;
+#endif
+  if (interface->alarm.poll.fd==-1)
+    INFOF("Polling dummy interface ring %s", path);
+  ret=0;
+  
+unlock:
+  lock.l_type=F_UNLCK;
+  fcntl(fd, F_SETLK, &lock);
+  return ret;
+}
+
+static void overlay_dummy_ring_close(overlay_interface *interface)
+{
+  munmap(interface->ring, interface->ring_size);
+  close(interface->ring_fd);
+  interface->ring=NULL;
+  interface->ring_fd=-1;
+}
+
+static unsigned char *overlay_dummy_ring_record(struct dummy_ring_header *ring, unsigned long long position)
+{
+  return ((unsigned char *)ring) + DUMMY_RECORD_SIZE * (1 + position % ring->record_count);
+}
+
+static int overlay_dummy_ring_write(overlay_interface *interface, unsigned char *buf)
+{
+  struct dummy_ring_header *ring = interface->ring;
+  unsigned long long position = __sync_fetch_and_add(&ring->head, 1);
+  unsigned char *record = overlay_dummy_ring_record(ring, position);
+  volatile uint64_t *stamp = (uint64_t *)&record[DUMMY_RECORD_STAMP];
+  
+  // the reserved bytes in buf are zero, so the record stays unfinished until we stamp it
+  *stamp=0;
+  __sync_synchronize();
+  bcopy(buf, record, DUMMY_RECORD_SIZE);
+  __sync_synchronize();
+  *stamp=position+1;
+  
+  if (debug&DEBUG_OVERLAYINTERFACES)
+    DEBUGF("Write to interface %s ring at position=%llu", interface->name, position);
+#ifdef HAVE_SYS_INOTIFY_H
+  // wake up anyone waiting on the file
+  if (futimens(interface->ring_fd, NULL)==-1)
+    WHY_perror("futimens");
+#endif
+  return 0;
+}
+
+/* Read every finished record written since we last looked, without any system calls */
+static void overlay_dummy_ring_read(overlay_interface *interface)
+{
+  struct dummy_ring_header *ring = interface->ring;
+  unsigned char packet[DUMMY_RECORD_SIZE];
+  unsigned long long head = __sync_fetch_and_add(&ring->head, 0);
+  
+  if (head - interface->ring_next > ring->record_count){
+    WARNF("Getting behind, lost %llu packets", head - interface->ring_next - ring->record_count);
+    interface->ring_next = head - ring->record_count;
+  }
+  
+  while (interface->ring_next < head){
+    unsigned long long position = interface->ring_next;
+    unsigned char *record = overlay_dummy_ring_record(ring, position);
+    volatile uint64_t *stamp = (uint64_t *)&record[DUMMY_RECORD_STAMP];
+    
+    if (*stamp < position+1){
+      /* Still being written, we will be woken again when it's finished.
+         Unless the writer has died, and others have moved well past it */
+      if (head - position < ring->record_count/2)
+	break;
+      WARNF("Skipping unfinished packet in dummy interface %s", interface->name);
+      interface->ring_next++;
+      continue;
+    }
+    interface->ring_next++;
+    if (*stamp > position+1)
+      continue;
+    
+    __sync_synchronize();
+    bcopy(record, packet, sizeof packet);
+    __sync_synchronize();
+    // it may have been overwritten while we were copying it
+    if (*stamp != position+1)
+      continue;
+    
+    // don't pass our private stamp on to anyone else
+    bzero(&packet[DUMMY_RECORD_STAMP], sizeof(uint64_t));
+    overlay_dummy_receive(interface, packet);
+  }
+}
+
+static void overlay_dummy_ring_poll(struct sched_ent *alarm)
+{
+  overlay_interface *interface = (overlay_interface *)alarm;
+  time_ms_t now = gettime_ms();
+  
+#ifdef HAVE_SYS_INOTIFY_H
+  if (alarm->poll.revents & POLLIN){
+    // we only need to know that something changed
+    char events[1024];
+    while (read(alarm->poll.fd, events, sizeof events)>0)
+      ;
+  }
+#endif
+  
+  overlay_dummy_ring_read(interface);
+  
+  if (interface->tick_ms>0 && 
+      (interface->last_tick_ms == -1 || now >= interface->last_tick_ms + interface->tick_ms)) {
+    // tick the interface
+    int i = (interface - overlay_interfaces);
+    overlay_tick_interface(i, now);
+  }
+  
+  if (alarm->poll.revents==0){
+    /* Without a file descriptor to watch, we must keep polling the ring, 
+       but allow all other low priority alarms to fire first */
+    alarm->alarm = (alarm->poll.fd==-1)? now + 5 : now + 1000;
+    if (interface->tick_ms>0 && interface->last_tick_ms != -1 && alarm->alarm > interface->last_tick_ms + interface->tick_ms)
+      alarm->alarm = interface->last_tick_ms + interface->tick_ms;
+    alarm->deadline = alarm->alarm + 10000;
+    schedule(alarm);
+  }
+}
+
 static int
 overlay_broadcast_ensemble(int interface_number,
 			   struct sockaddr_in *recipientaddr,
@@ -695,6 +1157,16 @@ overlay_broadcast_ensemble(int interface_number,
   if (interface->state!=INTERFACE_STATE_UP){
     return WHYF("Cannot send to interface %s as it is down", interface->name);
   }
+  
+  overlay_capture_packet(interface, CAPTURE_TX, (struct sockaddr *)recipientaddr, bytes, len);
+
+  if (overlay_simulated_transmit){
+    if (overlay_simulated_transmit(interface, bytes, len))
+      return -1;
+    interface->tx_packets++;
+    interface->tx_bytes+=len;
+    return 0;
+  }
 
   if (interface->fileP)
     {
@@ -734,6 +1206,13 @@ overlay_broadcast_ensemble(int interface_number,
 
       bzero(&buf[128+len],2048-(128+len));
       bcopy(bytes,&buf[128],len);
+      if (interface->ring){
+	if (overlay_dummy_ring_write(interface, (unsigned char *)buf))
+	  return -1;
+	interface->tx_packets++;
+	interface->tx_bytes+=len;
+	return 0;
+      }
       /* This lseek() is unneccessary because the dummy file is opened in O_APPEND mode.  It's
 	 only purpose is to find out the offset to print in the DEBUG statement.  It is vulnerable
 	 to a race condition with other processes appending to the same file. */
@@ -747,22 +1226,162 @@ overlay_broadcast_ensemble(int interface_number,
 	return WHY_perror("write");
       if (nwrite != 2048)
 	return WHYF("only wrote %lld of %lld bytes", nwrite, 2048);
+      interface->tx_packets++;
+      interface->tx_bytes+=len;
       return 0;
     }
   else
     {
       if (debug&DEBUG_OVERLAYINTERFACES) 
 	DEBUGF("Sending %d byte overlay frame on %s to %s",len,interface->name,inet_ntoa(recipientaddr->sin_addr));
-      if(sendto(interface->alarm.poll.fd, 
-		bytes, len, 0, (struct sockaddr *)recipientaddr, sizeof(struct sockaddr_in)) != len){
+      ssize_t sent = sendto(interface->alarm.poll.fd, 
+		bytes, len, 0, (struct sockaddr *)recipientaddr, sizeof(struct sockaddr_in));
+      syscall_counters.sends++;
+      if(sent != len){
+	/* The socket is non-blocking, so a full send buffer just means this packet is lost */
+	if (errno==EAGAIN || errno==EWOULDBLOCK || errno==ENOBUFS){
+	  if (debug&DEBUG_OVERLAYINTERFACES)
+	    DEBUG_perror("sendto(c)");
+	  return -1;
+	}
 	WHY_perror("sendto(c)");
 	overlay_interface_close(interface);
 	return -1;
       }
+      interface->tx_packets++;
+      interface->tx_bytes+=len;
       return 0;
     }
 }
 
+/* Send several packets via one interface, with a single system call if we can.
+   Returns the number of packets sent.
+ */
+static int
+overlay_broadcast_batch(int interface_number, struct pending_datagram **datagrams, int count)
+{
+  overlay_interface *interface = &overlay_interfaces[interface_number];
+  int sent=0;
+  int i;
+  
+#ifdef HAVE_SENDMMSG
+  if (count>1 && !interface->fileP && interface->state==INTERFACE_STATE_UP){
+    struct mmsghdr msgs[OVERLAY_TX_BATCH];
+    struct iovec iov[OVERLAY_TX_BATCH];
+    
+    bzero(msgs, sizeof(struct mmsghdr)*count);
+    for (i=0;i<count;i++){
+      struct pending_datagram *d=datagrams[i];
+      if (debug&DEBUG_PACKETTX){
+	DEBUGF("Sending this packet via interface #%d",interface_number);
+	DEBUG_packet_visualise(NULL,d->buffer->bytes,d->buffer->position);
+      }
+      if (debug&DEBUG_OVERLAYINTERFACES) 
+	DEBUGF("Sending %d byte overlay frame on %s to %s",d->buffer->position,interface->name,inet_ntoa(d->dest.sin_addr));
+      iov[i].iov_base=d->buffer->bytes;
+      iov[i].iov_len=d->buffer->position;
+      msgs[i].msg_hdr.msg_name=&d->dest;
+      msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov=&iov[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+    }
+    
+    i=0;
+    while(i<count){
+      int r = sendmmsg(interface->alarm.poll.fd, &msgs[i], count - i, 0);
+      syscall_counters.sends++;
+      if (r==-1){
+	// built against a C library with sendmmsg() but running on an older kernel
+	if (errno==ENOSYS)
+	  break;
+	/* The socket is non-blocking, so a full send buffer just means this packet is lost */
+	if (errno==EAGAIN || errno==EWOULDBLOCK || errno==ENOBUFS){
+	  if (debug&DEBUG_OVERLAYINTERFACES)
+	    DEBUG_perror("sendmmsg(c)");
+	  i++;
+	  continue;
+	}
+	WHY_perror("sendmmsg(c)");
+	overlay_interface_close(interface);
+	return sent;
+      }
+      int j;
+      for (j=i;j<i+r;j++){
+	interface->tx_bytes+=msgs[j].msg_len;
+	overlay_capture_packet(interface, CAPTURE_TX, (struct sockaddr *)&datagrams[j]->dest,
+			       datagrams[j]->buffer->bytes, datagrams[j]->buffer->position);
+      }
+      interface->tx_packets+=r;
+      i+=r;
+      sent+=r;
+    }
+    if (i>=count)
+      return sent;
+    // fall through and send the rest one at a time
+    datagrams+=i;
+    count-=i;
+  }
+#endif
+  
+  for (i=0;i<count;i++){
+    if (overlay_broadcast_ensemble(interface_number, &datagrams[i]->dest, 
+				   datagrams[i]->buffer->bytes, datagrams[i]->buffer->position)==0)
+      sent++;
+  }
+  return sent;
+}
+
+/* Send all the packets assembled since the last flush */
+static void
+overlay_tx_flush(){
+  int count = tx_pending_count;
+  int sent=0;
+  int i, j;
+  
+  if (!count)
+    return;
+  
+  IN();
+  tx_pending_count=0;
+  
+  for (i=0;i<count;i++){
+    if (!tx_pending[i].buffer)
+      continue;
+    
+    // gather every packet for this interface, keeping them in order
+    int interface_number = tx_pending[i].interface;
+    struct pending_datagram *datagrams[OVERLAY_TX_BATCH];
+    int n=0;
+    for (j=i;j<count;j++){
+      if (tx_pending[j].buffer && tx_pending[j].interface == interface_number)
+	datagrams[n++]=&tx_pending[j];
+    }
+    
+    sent+=overlay_broadcast_batch(interface_number, datagrams, n);
+    
+    for (j=0;j<n;j++){
+      ob_free(datagrams[j]->buffer);
+      datagrams[j]->buffer=NULL;
+    }
+  }
+  
+  fd_count_packets(&_aggregate_stats, sent);
+  OUT();
+}
+
+// hold an assembled packet until the end of this scheduling round
+static void
+overlay_tx_enqueue(struct outgoing_packet *packet){
+  overlay_interface_spend(packet->interface, packet->buffer->position, gettime_ms());
+  if (tx_pending_count>=OVERLAY_TX_BATCH)
+    overlay_tx_flush();
+  struct pending_datagram *d=&tx_pending[tx_pending_count++];
+  d->interface = packet->i;
+  d->dest = packet->dest;
+  d->buffer = packet->buffer;
+  packet->buffer = NULL;
+}
+
 /* This function is called to return old non-overlay requests back out the
    interface they came in. */
 int overlay_sendto(struct sockaddr_in *recipientaddr,unsigned char *bytes,int len)
@@ -856,11 +1475,36 @@ overlay_interface_register(char *name,
   return 0;
 }
   
+/* Close an interface as soon as we hear that its address has gone.
+   Without an address, close every interface on this link, including aliases like eth0:1 */
+void
+overlay_interface_unregister(char *name, struct in_addr *addr, struct in_addr *mask){
+  int i;
+  int len = strlen(name);
+  for (i = 0; i < overlay_interface_count; i++){
+    overlay_interface *interface = &overlay_interfaces[i];
+    if (interface->state!=INTERFACE_STATE_UP || interface->fileP)
+      continue;
+    if (addr){
+      if (strcasecmp(interface->name, name))
+	continue;
+      if (interface->broadcast_address.sin_addr.s_addr != (addr->s_addr | ~mask->s_addr))
+	continue;
+    }else{
+      if (strncasecmp(interface->name, name, len)
+	  || (interface->name[len] && interface->name[len]!=':'))
+	continue;
+    }
+    overlay_interface_close(interface);
+  }
+}
+  
 void overlay_interface_discover(struct sched_ent *alarm){
   int				i;
   struct interface_rules	*r;
   struct in_addr		dummyaddr;
   int detect_real_interfaces = 0;
+  int detect_dummy_interfaces = 0;
   
   /* Mark all UP interfaces as DETECTING, so we can tell which interfaces are new, and which are dead */
   for (i = 0; i < overlay_interface_count; i++)
@@ -873,6 +1517,7 @@ void overlay_interface_discover(struct sched_ent *alarm){
       detect_real_interfaces = 1;
       continue;
     }
+    detect_dummy_interfaces = 1;
     
     for (i = 0; i < overlay_interface_count; i++)
       if (!strcasecmp(overlay_interfaces[i].name,r->namespec)){
@@ -883,7 +1528,7 @@ void overlay_interface_discover(struct sched_ent *alarm){
 
     if (i >= overlay_interface_count){
       /* New interface, so register it */      
-      overlay_interface_init(r->namespec,dummyaddr,dummyaddr,dummyaddr,1000000,PORT_DNA,OVERLAY_INTERFACE_WIFI);
+      overlay_interface_init(r->namespec,dummyaddr,dummyaddr,dummyaddr,r->speed_in_bits,PORT_DNA,OVERLAY_INTERFACE_WIFI);
     }
   }
 
@@ -891,6 +1536,9 @@ void overlay_interface_discover(struct sched_ent *alarm){
   if (detect_real_interfaces){
     int no_route = 1;
     
+    // from now on, hear about changes as they happen
+    overlay_netlink_init();
+    
 #ifdef HAVE_IFADDRS_H
     if (no_route != 0)
       no_route = doifaddrs();
@@ -916,15 +1564,105 @@ void overlay_interface_discover(struct sched_ent *alarm){
     if (overlay_interfaces[i].state==INTERFACE_STATE_DETECTING)
       overlay_interface_close(&overlay_interfaces[i]);
   
-  alarm->alarm = gettime_ms()+5000;
+  /* When the kernel tells us about address changes, this scan is only a fallback.
+     Dummy interfaces aren't covered, so keep looking for them as often as before */
+  time_ms_t interval = 5000;
+  if (detect_real_interfaces && !detect_dummy_interfaces && overlay_netlink_active())
+    interval = confValueGetInt64Range("mdp.discover.fallback_ms", 60000LL, 1000LL, 3600000LL);
+  alarm->alarm = gettime_ms()+interval;
   alarm->deadline = alarm->alarm + 10000;
   schedule(alarm);
   return;
 }
 
+/* Frames waiting to go the same way; out one interface, either to its broadcast address or unicast to one peer.
+   Each traffic class keeps its own list of frames for each link, in the order they were queued,
+   so that building a packet only looks at the frames that can go in it.
+   Broadcast frames may go out any interface so they share one list,
+   as do frames for destinations we can't currently reach. */
+struct overlay_link {
+  struct overlay_link *next;
+  overlay_interface *interface;
+  int unicast;
+  struct in_addr address;
+  struct overlay_frame *first[OQ_MAX];
+  struct overlay_frame *last[OQ_MAX];
+  // frames on this link, in all classes
+  int length;
+};
+
+static struct mem_pool link_pool = MEM_POOL("overlay_link", sizeof(struct overlay_link), 16);
+static struct overlay_link *links=NULL;
+static struct overlay_link broadcast_link;
+static struct overlay_link unroutable_link;
+
+static struct overlay_link *
+overlay_link_find(overlay_interface *interface, int unicast, struct in_addr address, int create){
+  struct overlay_link *link;
+  for (link=links; link; link=link->next){
+    if (link->interface==interface && link->unicast==unicast
+	&& (!unicast || link->address.s_addr==address.s_addr))
+      return link;
+  }
+  if (!create)
+    return NULL;
+  link = pool_calloc(&link_pool);
+  if (!link)
+    return WHYNULL("Could not allocate link");
+  link->interface=interface;
+  link->unicast=unicast;
+  link->address=address;
+  link->next=links;
+  links=link;
+  return link;
+}
+
+static void
+overlay_link_remove(int q, struct overlay_frame *frame){
+  struct overlay_link *link = frame->link;
+  if (!link)
+    return;
+  if (frame->link_prev)
+    frame->link_prev->link_next = frame->link_next;
+  else
+    link->first[q] = frame->link_next;
+  if (frame->link_next)
+    frame->link_next->link_prev = frame->link_prev;
+  else
+    link->last[q] = frame->link_prev;
+  frame->link_prev=NULL;
+  frame->link_next=NULL;
+  frame->link=NULL;
+  link->length--;
+}
+
+// add a frame to a link, keeping the list in the order that frames were queued
+static void
+overlay_link_insert(struct overlay_link *link, int q, struct overlay_frame *frame){
+  struct overlay_frame *after = link->last[q];
+  while(after && after->enqueued_at > frame->enqueued_at)
+    after = after->link_prev;
+  
+  frame->link = link;
+  frame->link_prev = after;
+  if (after){
+    frame->link_next = after->link_next;
+    after->link_next = frame;
+  }else{
+    frame->link_next = link->first[q];
+    link->first[q] = frame;
+  }
+  if (frame->link_next)
+    frame->link_next->link_prev = frame;
+  else
+    link->last[q] = frame;
+  link->length++;
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
+  overlay_link_remove(queue - overlay_tx, frame);
   struct overlay_frame *prev = frame->prev;
   struct overlay_frame *next = frame->next;
   if (prev)
@@ -979,23 +1717,145 @@ overlay_queue_dump(overlay_txqueue *q)
 }
 #endif // 0
 
+/* Top up the interface's token bucket for the time since we last looked */
+static void overlay_interface_refill(overlay_interface *interface, time_ms_t now){
+  if (!interface->tokens_updated){
+    interface->tokens = interface->mtu;
+    interface->tokens_updated = now;
+    return;
+  }
+  long long add = (now - interface->tokens_updated) * interface->bits_per_second / 8000;
+  // on slow links, wait until at least one whole byte has accumulated
+  if (add<=0)
+    return;
+  interface->tokens += add;
+  interface->tokens_updated = now;
+  if (interface->tokens > interface->mtu)
+    interface->tokens = interface->mtu;
+}
+
+static long long overlay_interface_token_floor(overlay_interface *interface, int priority){
+  return priority ? -interface->mtu : 0;
+}
+
+static int overlay_interface_can_send(overlay_interface *interface, int priority, time_ms_t now){
+  // an interface without a speed isn't paced
+  if (interface->bits_per_second<1)
+    return 1;
+  overlay_interface_refill(interface, now);
+  return interface->tokens >= overlay_interface_token_floor(interface, priority);
+}
+
+/* Work out the achieved transmit rate once a second */
+static void overlay_interface_update_rate(overlay_interface *interface, time_ms_t now){
+  if (!interface->rate_window_start){
+    interface->rate_window_start = now;
+    return;
+  }
+  time_ms_t elapsed = now - interface->rate_window_start;
+  if (elapsed < 1000)
+    return;
+  interface->achieved_bits_per_second = interface->rate_window_bytes * 8000 / elapsed;
+  interface->rate_window_bytes = 0;
+  interface->rate_window_start = now;
+}
+
+static void overlay_interface_spend(overlay_interface *interface, int bytes, time_ms_t now){
+  interface->rate_window_bytes += bytes;
+  if (interface->bits_per_second>=1){
+    overlay_interface_refill(interface, now);
+    interface->tokens -= bytes;
+    // interface ticks aren't paced, so don't let a rate that is too slow for them build up an endless debt
+    if (interface->tokens < -2*interface->mtu)
+      interface->tokens = -2*interface->mtu;
+  }
+  overlay_interface_update_rate(interface, now);
+}
+
+/* Hold a frame back until the interface has enough tokens,
+   and make sure we wake up again when it does */
+static void overlay_interface_defer(overlay_interface *interface, struct overlay_frame *frame, 
+				    int priority, time_ms_t now){
+  if (!frame->deferred){
+    frame->deferred=1;
+    interface->deferred_frames++;
+    interface->deferred_bytes+=frame->payload->position;
+  }
+  long long needed = overlay_interface_token_floor(interface, priority) - interface->tokens;
+  time_ms_t ready = now + 1;
+  if (needed>0)
+    ready = now + (needed * 8000 + interface->bits_per_second - 1) / interface->bits_per_second;
+  if (!pacing_alarm || ready < pacing_alarm)
+    pacing_alarm = ready;
+}
+
+/* Remember whether a peer we heard on this interface understands the version 2 envelope */
+void overlay_interface_saw_peer(overlay_interface *interface, int envelope_version, time_ms_t now){
+  if (envelope_version>=OVERLAY_ENVELOPE_VERSION)
+    interface->envelope_peer_heard=now;
+  else
+    interface->legacy_peer_heard=now;
+}
+
+/* Only send the new envelope once another node on this link has told us it understands it,
+   and hold off while any old node has been heard recently, so that old nodes can still read our packets */
+static int overlay_interface_envelope_version(overlay_interface *interface, time_ms_t now){
+  if (!interface->envelope_peer_heard)
+    return OVERLAY_ENVELOPE_LEGACY;
+  time_ms_t timeout = interface->tick_ms * 10;
+  if (timeout < 5000)
+    timeout = 5000;
+  if (interface->legacy_peer_heard && now - interface->legacy_peer_heard < timeout)
+    return OVERLAY_ENVELOPE_LEGACY;
+  return OVERLAY_ENVELOPE_VERSION;
+}
+
+/* Start a packet to the interface's broadcast address, or to one neighbour if unicast is set */
 static void
-overlay_init_packet(struct outgoing_packet *packet, overlay_interface *interface, int tick){
+overlay_init_packet(struct outgoing_packet *packet, overlay_interface *interface, struct sockaddr_in *unicast, int tick){
   packet->interface = interface;
   packet->i = (interface - overlay_interfaces);
-  packet->dest=interface->broadcast_address;
+  if (unicast){
+    packet->dest=*unicast;
+    packet->unicast=1;
+  }else
+    packet->dest=interface->broadcast_address;
   packet->buffer=ob_new();
   ob_limitsize(packet->buffer, packet->interface->mtu);
-  ob_append_bytes(packet->buffer,magic_header,4);
+  if (++packet_serial==0)
+    packet_serial=1;
+  packet->serial=packet_serial;
+  
+  int version = overlay_interface_envelope_version(interface, gettime_ms());
+  ob_append_bytes(packet->buffer,magic_header,2);
+  ob_append_byte(packet->buffer, OVERLAY_ENVELOPE_VERSION);
+  ob_append_byte(packet->buffer, version);
   
   overlay_address_clear();
+  packet->sequence=-1;
+  
+  if (version>=OVERLAY_ENVELOPE_VERSION){
+    /* Envelope header, who sent this packet and in what order.
+       Every frame address from us can then be abbreviated to OA_CODE_SELF.
+       Only broadcast packets are numbered, as only they are heard by every neighbour */
+    ob_append_byte(packet->buffer, packet->unicast?OVERLAY_ENVELOPE_FLAG_UNICAST:0);
+    overlay_address_append_self(interface, packet->buffer);
+    overlay_address_set_sender(my_subscriber);
+    if (!packet->unicast){
+      interface->sequence_number = (interface->sequence_number + 1) & 0xFFFF;
+      ob_append_ui16(packet->buffer, interface->sequence_number);
+      packet->sequence=interface->sequence_number;
+      overlay_retransmit_begin(interface, packet->sequence);
+    }
+    overlay_address_set_link(interface, packet->sequence);
+  }
   
   if (tick){
     /* 1. Send announcement about ourselves, including one SID that we host if we host more than one SID
      (the first SID we host becomes our own identity, saving a little bit of data here).
      */
     overlay_add_selfannouncement(packet->i, packet->buffer);
-  }else{
+  }else if (version<OVERLAY_ENVELOPE_VERSION){
     // add a badly formatted dummy self announce payload to tell people we sent this.
     ob_append_byte(packet->buffer, OF_TYPE_SELFANNOUNCE);
     ob_append_byte(packet->buffer, 1);
@@ -1045,166 +1905,553 @@ overlay_calc_queue_time(overlay_txqueue *queue, struct overlay_frame *frame){
   return ret;
 }
 
-static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now){
-  struct overlay_frame *frame = queue->first;
+/* Work out where a frame should go next, and make sure it is on that link's list.
+   Returns the link, and the next hop for frames that aren't being broadcast. */
+static struct overlay_link *
+overlay_frame_resolve(int q, struct overlay_frame *frame, struct subscriber **next_hop_ret){
+  struct subscriber *next_hop = frame->destination;
+  struct overlay_link *link = NULL;
   
-  // TODO stop when the packet is nearly full?
+  if (next_hop){
+    switch(subscriber_is_reachable(next_hop)){
+      case REACHABLE_NONE:
+	link=&unroutable_link;
+	break;
+	
+      case REACHABLE_INDIRECT:
+	next_hop=next_hop->next_hop;
+	frame->sendBroadcast=0;
+	break;
+	
+      case REACHABLE_DEFAULT_ROUTE:
+	next_hop=directory_service;
+	frame->sendBroadcast=0;
+	break;
+	
+      case REACHABLE_DIRECT:
+      case REACHABLE_UNICAST:
+	frame->sendBroadcast=0;
+	break;
+	
+      case REACHABLE_BROADCAST:
+	/* Note, once we queue a broadcast packet we are committed to sending it out every interface, 
+	 even if we hear it from somewhere else in the mean time
+	 */
+	if (!frame->sendBroadcast){
+	  if (frame->ttl>2)
+	    frame->ttl=2;
+	  frame->sendBroadcast=1;
+	  if (is_all_matching(frame->broadcast_id.id, BROADCAST_LEN, 0)){
+	    overlay_broadcast_generate_address(&frame->broadcast_id);
+	    // mark it as already seen so we don't immediately retransmit it
+	    overlay_broadcast_drop_check(&frame->broadcast_id);
+	  }
+	  if (op_broadcast_init(frame)==0)
+	    bzero(frame->broadcast_sent_via, overlay_max_interfaces);
+	}
+	break;
+    }
+  }
   
+  if (!link){
+    if (frame->sendBroadcast){
+      link=op_broadcast_init(frame)?&unroutable_link:&broadcast_link;
+      next_hop=NULL;
+    }else if (frame->interface){
+      link=overlay_link_find(frame->interface, 0, next_hop->address.sin_addr, 1);
+      if (!link || frame->interface->state!=INTERFACE_STATE_UP)
+	link=&unroutable_link;
+    }else{
+      link=overlay_link_find(next_hop->interface, next_hop->reachable==REACHABLE_UNICAST, 
+			     next_hop->address.sin_addr, 1);
+      if (!link)
+	link=&unroutable_link;
+    }
+  }
+  
+  if (frame->link!=link){
+    overlay_link_remove(q, frame);
+    overlay_link_insert(link, q, frame);
+  }
+  if (next_hop_ret)
+    *next_hop_ret=next_hop;
+  return link;
+}
+
+/* Put a newly queued frame on the list for the link it will be sent over */
+void overlay_queue_link_frame(int q, struct overlay_frame *frame){
+  overlay_frame_resolve(q, frame, NULL);
+}
+
+// frames are queued in time order, so any that have been waiting too long are all at the front
+static void
+overlay_queue_expire(overlay_txqueue *queue, time_ms_t now){
+  while(queue->first && queue->first->enqueued_at + queue->latencyTarget < now){
+    struct overlay_frame *frame = queue->first;
+    DEBUGF("Dropping frame type %x for %s due to expiry timeout", 
+	   frame->type, frame->destination?alloca_tohex_sid(frame->destination->sid):"All");
+    queue->expired++;
+    overlay_queue_remove(queue, frame);
+  }
+}
+
+static void overlay_queue_expire_alarm(struct sched_ent *alarm);
+
+/* Wake up when the oldest frame in any queue outlives its latency target,
+   so late frames are dropped even while nothing is being sent */
+static void
+overlay_queue_schedule_expiry(){
+  time_ms_t next=0;
+  int i;
+  for (i=0;i<OQ_MAX;i++){
+    overlay_txqueue *queue=&overlay_tx[i];
+    if (!queue->first)
+      continue;
+    time_ms_t expires = queue->first->enqueued_at + queue->latencyTarget + 1;
+    if (!next || expires < next)
+      next = expires;
+  }
+  if (!next){
+    unschedule(&expire_alarm);
+    expire_alarm.alarm=0;
+    return;
+  }
+  if (next == expire_alarm.alarm)
+    return;
+  if (!expire_alarm.function){
+    expire_alarm.function=overlay_queue_expire_alarm;
+    expire_stats.name="overlay_queue_expire_alarm";
+    expire_alarm.stats=&expire_stats;
+  }
+  expire_alarm.alarm=next;
+  expire_alarm.deadline=next+100;
+  schedule(&expire_alarm);
+}
+
+static void
+overlay_queue_expire_alarm(struct sched_ent *alarm){
+  time_ms_t now = gettime_ms();
+  int i;
+  for (i=0;i<OQ_MAX;i++)
+    overlay_queue_expire(&overlay_tx[i], now);
+  alarm->alarm=0;
+  overlay_queue_schedule_expiry();
+}
+
+/* Work out the throughput of a class once a second */
+static void
+overlay_queue_update_rate(overlay_txqueue *queue, int bytes, time_ms_t now){
+  queue->rate_window_bytes += bytes;
+  if (!queue->rate_window_start){
+    queue->rate_window_start = now;
+    return;
+  }
+  time_ms_t elapsed = now - queue->rate_window_start;
+  if (elapsed < 1000)
+    return;
+  queue->achieved_bits_per_second = queue->rate_window_bytes * 8000 / elapsed;
+  queue->rate_window_bytes = 0;
+  queue->rate_window_start = now;
+}
+
+// see if we have found a route for any frames that we couldn't send before
+static void
+overlay_queue_reroute(int q){
+  struct overlay_frame *frame = unroutable_link.first[q];
   while(frame){
-    if (frame->enqueued_at + queue->latencyTarget < now){
-      DEBUGF("Dropping frame type %x for %s due to expiry timeout", 
-	     frame->type, frame->destination?alloca_tohex_sid(frame->destination->sid):"All");
-      frame = overlay_queue_remove(queue, frame);
+    struct overlay_frame *next = frame->link_next;
+    overlay_frame_resolve(q, frame, NULL);
+    frame = next;
+  }
+}
+
+/* Start a new packet on whichever link has the oldest frame that can be sent now.
+   Only the frame at the head of each link's list needs to be considered. */
+static void
+overlay_open_packet(struct outgoing_packet *packet, int q, int priority, time_ms_t now){
+  struct overlay_link *link;
+  struct overlay_frame *best=NULL;
+  struct subscriber *best_hop=NULL;
+  int best_interface=-1;
+  
+  for (link=links; link; link=link->next){
+    struct overlay_frame *frame = link->first[q];
+    struct subscriber *next_hop=NULL;
+    
+    // the route may have changed since the frame was queued
+    while(frame && overlay_frame_resolve(q, frame, &next_hop)!=link)
+      frame = link->first[q];
+    
+    if (!frame || (best && best->enqueued_at <= frame->enqueued_at))
       continue;
-    }
-    /* Note, once we queue a broadcast packet we are committed to sending it out every interface, 
-     even if we hear it from somewhere else in the mean time
-     */
     
-    struct subscriber *next_hop = frame->destination;
+    if (!overlay_interface_can_send(link->interface, priority, now)){
+      overlay_interface_defer(link->interface, frame, priority, now);
+      continue;
+    }
+    best=frame;
+    best_hop=next_hop;
+  }
+  
+  struct overlay_frame *frame = broadcast_link.first[q];
+  while(frame && !(best && best->enqueued_at <= frame->enqueued_at)){
+    struct overlay_frame *next = frame->link_next;
     
-    if (next_hop){
-      switch(subscriber_is_reachable(next_hop)){
-	case REACHABLE_NONE:
-	  goto skip;
-	  
-	case REACHABLE_INDIRECT:
-	  next_hop=next_hop->next_hop;
-	  frame->sendBroadcast=0;
-	  break;
-	  
-	case REACHABLE_DEFAULT_ROUTE:
-	  next_hop=directory_service;
-	  frame->sendBroadcast=0;
-	  break;
-	  
-	case REACHABLE_DIRECT:
-	case REACHABLE_UNICAST:
-	  frame->sendBroadcast=0;
-	  break;
-	  
-	case REACHABLE_BROADCAST:
-	  if (!frame->sendBroadcast){
-	    if (frame->ttl>2)
-	      frame->ttl=2;
-	    frame->sendBroadcast=1;
-	    if (is_all_matching(frame->broadcast_id.id, BROADCAST_LEN, 0)){
-	      overlay_broadcast_generate_address(&frame->broadcast_id);
-	      // mark it as already seen so we don't immediately retransmit it
-	      overlay_broadcast_drop_check(&frame->broadcast_id);
-	    }
-	    int i;
-	    for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	      frame->broadcast_sent_via[i]=0;
-	  }
-	  break;
-      }
+    if (overlay_frame_resolve(q, frame, NULL)!=&broadcast_link){
+      frame = next;
+      continue;
     }
     
-    if (!packet->buffer){
-      // use the interface of the first payload we find
-      if (frame->sendBroadcast){
-	// find an interface that we haven't broadcast on yet
-	int i;
-	for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	{
-	  if (overlay_interfaces[i].state==INTERFACE_STATE_UP
-	      && !frame->broadcast_sent_via[i]){
-	    overlay_init_packet(packet, &overlay_interfaces[i], 0);
-	    break;
-	  }
-	}
-	
-	if (!packet->buffer){
-	  // oh dear, why is this broadcast still in the queue?
-	  frame = overlay_queue_remove(queue, frame);
+    // find an interface that we haven't broadcast on yet
+    int i;
+    int waiting=0;
+    for(i=0;i<overlay_interface_count;i++)
+    {
+      if (overlay_interfaces[i].state==INTERFACE_STATE_UP
+	  && !frame->broadcast_sent_via[i]){
+	if (!overlay_interface_can_send(&overlay_interfaces[i], priority, now)){
+	  overlay_interface_defer(&overlay_interfaces[i], frame, priority, now);
+	  waiting=1;
 	  continue;
 	}
-      }else{
-	overlay_init_packet(packet, next_hop->interface, 0);
-	if (next_hop->reachable==REACHABLE_UNICAST){
-	  packet->dest = next_hop->address;
-	  packet->unicast=1;
-	}
-      }
-      
-    }else{
-      // make sure this payload can be sent via this interface
-      if (frame->sendBroadcast){
-	if (frame->broadcast_sent_via[packet->i]){
-	  goto skip;
-	}
-      }else{
-	if(packet->interface != next_hop->interface)
-	  goto skip;
-	if (next_hop->reachable==REACHABLE_DIRECT && packet->unicast)
-	  goto skip;
-	if (next_hop->reachable==REACHABLE_UNICAST && 
-	    ((!packet->unicast) ||
-	    packet->dest.sin_addr.s_addr != next_hop->address.sin_addr.s_addr))
-	  goto skip;
+	break;
       }
     }
     
-    if (debug&DEBUG_OVERLAYFRAMES){
-      DEBUGF("Sending payload type %x len %d for %s via %s", frame->type, frame->payload->position,
-	     frame->destination?alloca_tohex_sid(frame->destination->sid):"All",
-	     frame->sendBroadcast?alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN):alloca_tohex_sid(next_hop->sid));
+    if (i<overlay_interface_count){
+      best=frame;
+      best_hop=NULL;
+      best_interface=i;
+      break;
     }
     
-    if (overlay_frame_append_payload(packet->interface, frame, next_hop, packet->buffer))
-      // payload was not queued
-      goto skip;
+    if (!waiting)
+      // oh dear, why is this broadcast still in the queue?
+      overlay_queue_remove(&overlay_tx[q], frame);
+    frame = next;
+  }
+  
+  if (!best)
+    return;
+  
+  if (!best_hop)
+    overlay_init_packet(packet, &overlay_interfaces[best_interface], NULL, 0);
+  else if (best_hop->reachable==REACHABLE_UNICAST)
+    overlay_init_packet(packet, best_hop->interface, &best_hop->address, 0);
+  else
+    overlay_init_packet(packet, best_hop->interface, NULL, 0);
+}
+
+/* A lower bound on the bytes this frame will take in a packet,
+   assuming every address except a broadcast id is abbreviated to one byte */
+static int
+overlay_frame_min_length(struct overlay_frame *frame){
+  int len = 1;
+  switch(frame->type&OF_TYPE_FLAG_BITS){
+    case OF_TYPE_FLAG_E12: len=2; break;
+    case OF_TYPE_FLAG_E20: len=3; break;
+  }
+  int body = (frame->sendBroadcast?1+BROADCAST_LEN:1) + 2 + frame->payload->position;
+  // ttl, length and body
+  return len + 1 + rfs_length(body) + body;
+}
+
+// room left in the packet, less the slack overlay_frame_append_payload() asks for
+static int
+overlay_packet_room(struct outgoing_packet *packet){
+  return packet->buffer->sizeLimit - packet->buffer->position - 2;
+}
+
+// bytes of frames this class may still add to the packet
+static int
+overlay_queue_budget(struct outgoing_packet *packet, int q){
+  if (q==OQ_ISOCHRONOUS_VOICE || packet->leftover)
+    return INT_MAX;
+  return overlay_tx[q].deficit;
+}
+
+/* Try to add one frame to the packet.
+   Returns 0 if it was added, 1 if it doesn't belong in this packet, 2 if its class is out of credit,
+   or -1 if it didn't fit */
+static int
+overlay_stuff_frame(struct outgoing_packet *packet, struct overlay_link *link, int q, struct overlay_frame *frame,
+		    time_ms_t now){
+  overlay_txqueue *queue = &overlay_tx[q];
+  
+  struct subscriber *next_hop=NULL;
+  struct overlay_link *frame_link = overlay_frame_resolve(q, frame, &next_hop);
+  if (frame_link==&broadcast_link ? frame->broadcast_sent_via[packet->i] : (!link || frame_link!=link)){
+    // it can't go in this packet at all, so don't look at it again while packing
+    frame->packed_in = packet->serial;
+    return 1;
+  }
+  
+  int len = overlay_frame_min_length(frame);
+  if (len > overlay_queue_budget(packet, q))
+    return 2;
+  frame->packed_in = packet->serial;
+  
+  if (len > overlay_packet_room(packet)){
+    packet->interface->tx_frames_skipped++;
+    return -1;
+  }
+  
+  if (debug&DEBUG_OVERLAYFRAMES){
+    DEBUGF("Sending payload type %x len %d for %s via %s", frame->type, frame->payload->position,
+	   frame->destination?alloca_tohex_sid(frame->destination->sid):"All",
+	   frame->sendBroadcast?alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN):alloca_tohex_sid(next_hop->sid));
+  }
+  
+  int start = packet->buffer->position;
+  if (overlay_frame_append_payload(packet->interface, frame, next_hop, packet->buffer)){
+    // payload was not queued
+    packet->interface->tx_frames_skipped++;
+    return -1;
+  }
+  int bytes = packet->buffer->position - start;
+  if (q!=OQ_ISOCHRONOUS_VOICE && !packet->leftover)
+    queue->deficit -= bytes;
+  packet->payloads++;
+  packet->interface->tx_frames_packed++;
+  
+  queue->sent_frames++;
+  queue->sent_bytes += bytes;
+  overlay_queue_update_rate(queue, bytes, now);
+  if (!frame->times_sent){
+    unsigned int delay = now - frame->enqueued_at;
+    queue->delay_total_ms += delay;
+    if (delay > queue->delay_max_ms)
+      queue->delay_max_ms = delay;
+  }
+  if (packet->sequence>=0)
+    overlay_retransmit_record(packet->interface, packet->sequence, q, frame, next_hop);
+  
+  // mark the payload as sent
+  int keep_payload = 0;
+  
+  if (frame->sendBroadcast){
+    int i;
+    frame->broadcast_sent_via[packet->i]=1;
     
-    // mark the payload as sent
-    int keep_payload = 0;
+    // check if there is still a broadcast to be sent      
+    for(i=0;i<overlay_interface_count;i++)
+    {
+      if (overlay_interfaces[i].state==INTERFACE_STATE_UP)
+	if (!frame->broadcast_sent_via[i]){
+	  keep_payload=1;
+	  break;
+	}
+    }
+  }else if (packet->sequence>=0){
+    // the neighbour will NACK this packet if it doesn't arrive, so one copy is enough
+    frame->send_copies=0;
+  }else{
+    // nobody can NACK an unnumbered packet, so keep sending copies
+    if (frame->times_sent)
+      packet->interface->copies_sent++;
+    frame->send_copies --;
+    if (frame->send_copies>0)
+      keep_payload=1;
+  }
+  if (frame->times_sent<255)
+    frame->times_sent++;
+  
+  if (!keep_payload)
+    overlay_queue_remove(queue, frame);
+  return 0;
+}
+
+/* Once a frame has failed to fit, fill the rest of the packet best fit first;
+   take the largest frame of this class that will still fit, until none will */
+static void
+overlay_pack_link(struct outgoing_packet *packet, struct overlay_link *link, int q, time_ms_t now){
+  while(overlay_packet_room(packet) >= OVERLAY_FRAME_MIN_LEN){
+    int room = overlay_packet_room(packet);
+    int budget = overlay_queue_budget(packet, q);
+    struct overlay_frame *best=NULL;
+    int best_len=0;
+    int l;
     
-    if (frame->sendBroadcast){
-      int i;
-      frame->broadcast_sent_via[packet->i]=1;
-      
-      // check if there is still a broadcast to be sent      
-      for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-      {
-	if (overlay_interfaces[i].state==INTERFACE_STATE_UP)
-	  if (!frame->broadcast_sent_via[i]){
-	    keep_payload=1;
-	    break;
-	  }
+    for (l=0;l<2;l++){
+      struct overlay_frame *frame = l?broadcast_link.first[q]:(link?link->first[q]:NULL);
+      for (;frame;frame=frame->link_next){
+	if (frame->packed_in==packet->serial)
+	  continue;
+	int len = overlay_frame_min_length(frame);
+	if (len <= best_len)
+	  continue;
+	if (len > budget){
+	  packet->short_of_credit=1;
+	  continue;
+	}
+	if (len > room){
+	  packet->overflowed=1;
+	  continue;
+	}
+	best=frame;
+	best_len=len;
       }
+    }
+    if (!best)
+      return;
+    overlay_stuff_frame(packet, link, q, best, now);
+  }
+}
+
+/* Add every frame from this class that can go over the packet's link,
+   taking broadcasts and frames for this link in the order they were queued, while the class has credit.
+   When a frame doesn't fit, switch to packing the remaining space by size. */
+static void
+overlay_stuff_link(struct outgoing_packet *packet, int q, time_ms_t now){
+  struct overlay_link *link = overlay_link_find(packet->interface, packet->unicast, packet->dest.sin_addr, 0);
+  struct overlay_frame *unicast = link?link->first[q]:NULL;
+  struct overlay_frame *broadcast = broadcast_link.first[q];
+  
+  while(!packet->packing && (unicast || broadcast)){
+    if (overlay_packet_room(packet) < OVERLAY_FRAME_MIN_LEN)
+      return;
+    
+    struct overlay_frame *frame;
+    if (unicast && (!broadcast || unicast->enqueued_at <= broadcast->enqueued_at)){
+      frame = unicast;
+      unicast = unicast->link_next;
     }else{
-      frame->send_copies --;
-      if (frame->send_copies>0)
-	keep_payload=1;
+      frame = broadcast;
+      broadcast = broadcast->link_next;
     }
     
-    if (!keep_payload){
-      frame = overlay_queue_remove(queue, frame);
+    int r = overlay_stuff_frame(packet, link, q, frame, now);
+    if (r<0)
+      packet->packing=packet->overflowed=1;
+    // the frames behind this one wait for the class's next turn
+    if (r==2){
+      packet->short_of_credit=1;
+      return;
+    }
+  }
+  
+  if (packet->packing)
+    overlay_pack_link(packet, link, q, now);
+}
+
+/* Work out when we should next try to send frames that are still waiting,
+   looking at the oldest frame for each link. Links with nothing left to send are released. */
+static void
+overlay_queue_schedule_links(overlay_txqueue *queue, int q, int priority, time_ms_t now){
+  struct overlay_link **prev = &links;
+  struct overlay_link *link;
+  
+  while((link=*prev)){
+    if (!link->length){
+      *prev = link->next;
+      pool_free(&link_pool, link);
       continue;
     }
+    if (link->first[q]){
+      if (overlay_interface_can_send(link->interface, priority, now))
+	overlay_calc_queue_time(queue, link->first[q]);
+      else
+	overlay_interface_defer(link->interface, link->first[q], priority, now);
+    }
+    prev = &link->next;
+  }
+  if (broadcast_link.first[q])
+    overlay_calc_queue_time(queue, broadcast_link.first[q]);
+}
+
+/* Give a class its turn's worth of credit, but no more than it could spend in one packet,
+   so a class that has been waiting on a slow link can't hog the next one */
+static void
+overlay_queue_credit(overlay_txqueue *queue, struct outgoing_packet *packet){
+  if (!queue->length){
+    queue->deficit=0;
+    return;
+  }
+  int quantum = queue->weight * OVERLAY_DRR_QUANTUM;
+  int limit = quantum + packet->interface->mtu;
+  queue->deficit += quantum;
+  if (queue->deficit > limit)
+    queue->deficit = limit;
+}
+
+static void
+overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, int new_turn, time_ms_t now){
+  int q = queue - overlay_tx;
+  // voice may borrow tokens from the future, everything else waits its turn
+  int priority = (q == OQ_ISOCHRONOUS_VOICE);
+  
+  if (!packet->leftover){
+    // use the link of the oldest frame we can send
+    if (!packet->buffer)
+      overlay_open_packet(packet, q, priority, now);
     
-  skip:
-    // if we can't send the payload now, check when we should try
-    overlay_calc_queue_time(queue, frame);
-    frame = frame->next;
+    if (new_turn)
+      overlay_queue_credit(queue, packet);
   }
+  
+  if (packet->buffer)
+    overlay_stuff_link(packet, q, now);
+  
+  // if we can't send the rest of the queue now, check when we should try
+  if (packet->leftover)
+    overlay_queue_schedule_links(queue, q, priority, now);
 }
 
 // fill a packet from our outgoing queues and send it
 static int
 overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
-  int i;
+  int i, idle;
   IN();
   // while we're looking at queues, work out when to schedule another packet
   unschedule(&next_packet);
   next_packet.alarm=0;
   next_packet.deadline=0;
+  pacing_alarm=0;
   
+  // drop anything that is too late, and find routes for anything we couldn't send before
   for (i=0;i<OQ_MAX;i++){
-    overlay_txqueue *queue=&overlay_tx[i];
-    
-    overlay_stuff_packet(packet, queue, now);
+    overlay_queue_expire(&overlay_tx[i], now);
+    overlay_queue_reroute(i);
+  }
+  
+  // voice always goes first
+  overlay_stuff_packet(packet, &overlay_tx[OQ_ISOCHRONOUS_VOICE], 0, now);
+  
+  // if voice didn't start a packet, start one for whichever class has the turn, or the next one that can send now
+  for (i=0;i<OQ_MAX-1 && !packet->buffer;i++)
+    overlay_open_packet(packet, 1 + (drr_next + i) % (OQ_MAX-1), 0, now);
+  
+  /* Then the other classes take turns, each sending up to the credit it gets for its turn,
+     until a whole round goes by without any of them wanting more.
+     A class whose turn is cut short by a full packet carries on at the start of the next one */
+  for (i=0, idle=0; packet->buffer && i<OVERLAY_DRR_ROUNDS*(OQ_MAX-1) && idle<OQ_MAX-1; i++){
+    packet->short_of_credit=0;
+    packet->overflowed=0;
+    overlay_stuff_packet(packet, &overlay_tx[1 + drr_next], !drr_credited, now);
+    drr_credited=1;
+    if (packet->overflowed && !packet->short_of_credit)
+      break;
+    idle = packet->short_of_credit ? 0 : idle+1;
+    drr_next = (drr_next + 1) % (OQ_MAX-1);
+    drr_credited=0;
+  }
+  
+  // any room they didn't have credit for is free for whoever can use it, in priority order
+  packet->leftover=1;
+  for (i=0;i<OQ_MAX;i++)
+    overlay_stuff_packet(packet, &overlay_tx[i], 0, now);
+  overlay_queue_schedule_expiry();
+  
+  // if nothing could be sent because every due frame is waiting for tokens, sleep until they arrive
+  if (pacing_alarm && (!next_packet.alarm || (next_packet.alarm <= now && !packet->buffer))){
+    if (!next_packet.function){
+      next_packet.function=overlay_send_packet;
+      send_packet.name="overlay_send_packet";
+      next_packet.stats=&send_packet;
+    }
+    next_packet.alarm=pacing_alarm;
+    if (next_packet.deadline < pacing_alarm)
+      next_packet.deadline=pacing_alarm;
   }
   
   if (next_packet.alarm)
@@ -1221,21 +2468,34 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
       if (debug&DEBUG_PACKETCONSTRUCTION)
 	dump("assembled packet",&packet->buffer->bytes[0],packet->buffer->position);
       
-      overlay_broadcast_ensemble(packet->i, &packet->dest, packet->buffer->bytes, packet->buffer->position);
+      packet->interface->tx_fill_bytes+=packet->buffer->position;
+      packet->interface->tx_fill_capacity+=packet->buffer->sizeLimit;
+      
+      overlay_tx_enqueue(packet);
+    }else{
+      ob_free(packet->buffer);
+      packet->buffer=NULL;
     }
-    ob_free(packet->buffer);
     overlay_address_clear();
     RETURN(1);
   }
   RETURN(0);
 }
 
-// when the queue timer elapses, send a packet
+// when the queue timer elapses, send packets until nothing else is due
 void overlay_send_packet(struct sched_ent *alarm){
   struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
+  time_ms_t now = gettime_ms();
+  int i;
   
-  overlay_fill_send_packet(&packet, gettime_ms());
+  for (i=0;i<OVERLAY_TX_BATCH;i++){
+    bzero(&packet, sizeof(struct outgoing_packet));
+    if (!overlay_fill_send_packet(&packet, now) || !packet.payloads)
+      break;
+    if (!next_packet.alarm || next_packet.alarm > now)
+      break;
+  }
+  overlay_tx_flush();
 }
 
 // update time for next alarm and reschedule
@@ -1244,6 +2504,8 @@ void overlay_update_queue_schedule(overlay_txqueue *queue, struct overlay_frame
     unschedule(&next_packet);
     schedule(&next_packet);
   }
+  if (!expire_alarm.alarm)
+    overlay_queue_schedule_expiry();
 }
 
 static int
@@ -1259,15 +2521,21 @@ overlay_tick_interface(int i, time_ms_t now) {
 
   if (debug&DEBUG_OVERLAYINTERFACES) DEBUGF("Ticking interface #%d",i);
   
+  overlay_interface_update_rate(&overlay_interfaces[i], now);
+  
   // initialise the packet buffer
   bzero(&packet, sizeof(struct outgoing_packet));
-  overlay_init_packet(&packet, &overlay_interfaces[i], 1);
+  overlay_init_packet(&packet, &overlay_interfaces[i], NULL, 1);
   
   /* Add advertisements for ROUTES */
   overlay_route_add_advertisements(packet.interface, packet.buffer);
   
   /* Stuff more payloads from queues and send it */
   overlay_fill_send_packet(&packet, now);
+  overlay_tx_flush();
+  
+  if (overlay_interfaces[i].up_to_announce_ms<0)
+    overlay_interfaces[i].up_to_announce_ms = gettime_ms() - overlay_interfaces[i].up_at;
   RETURN(0);
 }
 
@@ -134,6 +134,17 @@ struct mdp_binding{
 struct mdp_binding mdp_bindings[MDP_MAX_BINDINGS];
 int mdp_bindings_initialised=0;
 
+// keep the subscribers that local clients are bound to
+void overlay_mdp_mark_subscribers()
+{
+  int i;
+  if (!mdp_bindings_initialised)
+    return;
+  for (i=0;i<MDP_MAX_BINDINGS;i++)
+    if (mdp_bindings[i].port)
+      subscriber_mark(mdp_bindings[i].subscriber);
+}
+
 int overlay_mdp_reply_error(int sock,
 			    struct sockaddr_un *recvaddr,int recvaddrlen,
 			    int error_number,char *message)
@@ -165,6 +176,8 @@ int overlay_mdp_reply(int sock,struct sockaddr_un *recvaddr,int recvaddrlen,
   replylen=overlay_mdp_relevant_bytes(mdpreply);
   if (replylen<0) return WHY("Invalid MDP frame (could not compute length)");
 
+  /* sock is non-blocking, so a reply to a client that isn't reading is lost, rather than stalling
+     every other handle. Replies are sent while handling the client's own request. */
   errno=0;
   int r=sendto(sock,(char *)mdpreply,replylen,0,
 	       (struct sockaddr *)recvaddr,recvaddrlen);
@@ -458,6 +471,10 @@ int overlay_saw_mdp_frame(overlay_mdp_frame *mdp, time_ms_t now)
       if (r==overlay_mdp_relevant_bytes(mdp)) {	
 	RETURN(0);
       }
+      /* Like every watched handle, our socket is non-blocking, even when we get here from another
+	 handle's callback. So a client that isn't reading loses frames instead of stalling us. */
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
+	RETURN(WHY("MDP client is not reading its socket, dropped frame"));
       WHY("didn't send mdp packet");
       if (errno==ENOENT) {
 	/* far-end of socket has died, so drop binding */
@@ -656,7 +673,7 @@ int overlay_mdp_dispatch(overlay_mdp_frame *mdp,int userGeneratedFrameP,
   IN();
 
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = calloc(1,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     FATAL("Couldn't allocate frame buffer");
   
@@ -969,6 +986,53 @@ static int search_subscribers(struct subscriber *subscriber, void *context){
   return 0;
 }
 
+/* Reply to a stats request with as many whole lines as fit, starting from the line asked for */
+static int overlay_mdp_reply_stats(int sock, struct sockaddr_un *recvaddr, int recvaddrlen,
+				   overlay_mdp_frame *mdp)
+{
+  struct mallocbuf mb = STRUCT_MALLOCBUF_NULL;
+  server_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  if (mb.buffer == NULL)
+    return WHY("server_stats_keyvalues() output buffer missing");
+  
+  overlay_mdp_frame mdpreply;
+  mdpreply.packetTypeAndFlags = MDP_STATS;
+  mdpreply.stats.first_line = mdp->stats.first_line;
+  mdpreply.stats.line_count = 0;
+  mdpreply.stats.text_length = 0;
+  
+  unsigned int line = 0;
+  int full = 0;
+  const char *p = mb.buffer;
+  while (*p) {
+    const char *eol = strchr(p, '\n');
+    size_t len = eol ? eol - p + 1 : strlen(p);
+    if (line >= mdp->stats.first_line && !full) {
+      size_t space = sizeof(mdpreply.stats.text) - mdpreply.stats.text_length;
+      if (len > space) {
+	full = 1;
+	// always make progress, even if one line is too long to fit
+	if (mdpreply.stats.line_count == 0) {
+	  memcpy(&mdpreply.stats.text[0], p, space);
+	  mdpreply.stats.text[space - 1] = '\n';
+	  mdpreply.stats.text_length = space;
+	  mdpreply.stats.line_count++;
+	}
+      } else {
+	memcpy(&mdpreply.stats.text[mdpreply.stats.text_length], p, len);
+	mdpreply.stats.text_length += len;
+	mdpreply.stats.line_count++;
+      }
+    }
+    line++;
+    p += len;
+  }
+  mdpreply.stats.total_lines = line;
+  free(mb.buffer);
+  
+  return overlay_mdp_reply(sock, recvaddr, recvaddrlen, &mdpreply);
+}
+
 void overlay_mdp_poll(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
@@ -999,6 +1063,23 @@ void overlay_mdp_poll(struct sched_ent *alarm)
 	if (debug & DEBUG_MDPREQUESTS) DEBUG("MDP_NODEINFO");
 	overlay_route_node_info(mdp,recvaddr_un,recvaddrlen);
 	return;
+      case MDP_STATS:
+	if (debug & DEBUG_MDPREQUESTS) DEBUGF("MDP_STATS first_line=%u", mdp->stats.first_line);
+	overlay_mdp_reply_stats(alarm->poll.fd,recvaddr_un,recvaddrlen,mdp);
+	return;
+      case MDP_CAPTURE:
+	if (debug & DEBUG_MDPREQUESTS) DEBUG("MDP_CAPTURE");
+	{
+	  int count=overlay_capture_write_pcap();
+	  if (count<0)
+	    overlay_mdp_reply_error(alarm->poll.fd,recvaddr_un,recvaddrlen,2,"Could not write packet capture");
+	  else{
+	    char message[32];
+	    snprintf(message, sizeof message, "%d", count);
+	    overlay_mdp_reply_ok(alarm->poll.fd,recvaddr_un,recvaddrlen,message);
+	  }
+	}
+	return;
       case MDP_GETADDRS:
 	if (debug & DEBUG_MDPREQUESTS)
 	  DEBUGF("MDP_GETADDRS first_sid=%u last_sid=%u frame_sid_count=%u mode=%d",
@@ -0,0 +1,222 @@
+/*
+ Serval Daemon
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "serval.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
+
+/* Retransmission of lost frames.
+
+ Every version 2 broadcast packet carries a per-interface sequence number. When a neighbour sees a gap,
+ it sends us an OF_TYPE_NACK frame naming the missing sequence numbers;
+
+   ui16 first missing sequence
+   byte count of missing packets
+
+ Sequence numbers are counted per interface, so the NACK goes back out the interface where we saw
+ the gap, whichever way the neighbour is routed.
+
+ Each interface keeps a copy of the frames it sent in its last OVERLAY_RETRANSMIT_PACKETS packets.
+ On receipt of a NACK we queue those frames again, but only if they were meant for that neighbour
+ and they would not have expired from their queue by now.
+ */
+
+struct retransmit_frame {
+  struct overlay_frame *frame;
+  // NULL for broadcast frames
+  struct subscriber *next_hop;
+  int queue;
+  time_ms_t enqueued_at;
+};
+
+struct retransmit_packet {
+  int sequence;
+  int frame_count;
+  struct retransmit_frame frames[OVERLAY_RETRANSMIT_FRAMES];
+};
+
+struct overlay_retransmit {
+  struct retransmit_packet packets[OVERLAY_RETRANSMIT_PACKETS];
+};
+
+static void retransmit_clear(struct retransmit_packet *p)
+{
+  int i;
+  for (i=0;i<p->frame_count;i++)
+    op_free(p->frames[i].frame);
+  p->frame_count=0;
+  p->sequence=-1;
+}
+
+static struct retransmit_packet *retransmit_find(overlay_interface *interface, int sequence)
+{
+  if (!interface->retransmit)
+    return NULL;
+  struct retransmit_packet *p=&interface->retransmit->packets[sequence % OVERLAY_RETRANSMIT_PACKETS];
+  if (p->sequence!=sequence)
+    return NULL;
+  return p;
+}
+
+/* Start remembering the frames of a new packet, replacing the oldest one */
+int overlay_retransmit_begin(overlay_interface *interface, int sequence)
+{
+  if (!interface->retransmit){
+    interface->retransmit=malloc(sizeof(struct overlay_retransmit));
+    if (!interface->retransmit)
+      return WHY("malloc() failed allocating retransmit buffer");
+    int i;
+    for (i=0;i<OVERLAY_RETRANSMIT_PACKETS;i++){
+      interface->retransmit->packets[i].frame_count=0;
+      interface->retransmit->packets[i].sequence=-1;
+    }
+  }
+  struct retransmit_packet *p=&interface->retransmit->packets[sequence % OVERLAY_RETRANSMIT_PACKETS];
+  retransmit_clear(p);
+  p->sequence=sequence;
+  return 0;
+}
+
+/* Remember a frame that was just added to packet #sequence */
+int overlay_retransmit_record(overlay_interface *interface, int sequence, int q,
+			      struct overlay_frame *frame, struct subscriber *next_hop)
+{
+  // a lost NACK will be noticed by the next gap
+  if (frame->type==OF_TYPE_NACK)
+    return 0;
+  struct retransmit_packet *p=retransmit_find(interface, sequence);
+  if (!p || p->frame_count>=OVERLAY_RETRANSMIT_FRAMES)
+    return 0;
+  struct overlay_frame *copy=op_dup(frame);
+  if (!copy)
+    return -1;
+  struct retransmit_frame *r=&p->frames[p->frame_count++];
+  r->frame=copy;
+  r->next_hop=frame->sendBroadcast?NULL:next_hop;
+  r->queue=q;
+  r->enqueued_at=frame->enqueued_at;
+  return 0;
+}
+
+/* Ask a neighbour to resend the frames it sent in packets first_sequence .. first_sequence + count -1 */
+int overlay_nack_send(overlay_interface *interface, struct subscriber *neighbour, int first_sequence, int count)
+{
+  if (count<1 || count>OVERLAY_RETRANSMIT_PACKETS)
+    return 0;
+  // we can't reply until we have a route back
+  int r=subscriber_is_reachable(neighbour);
+  if (r==REACHABLE_NONE || r==REACHABLE_SELF)
+    return 0;
+
+  struct overlay_frame *frame=op_new();
+  if (!frame)
+    return WHY("op_new() failed to allocate an overlay frame");
+  frame->type=OF_TYPE_NACK;
+  frame->ttl=1;
+  frame->source=my_subscriber;
+  frame->destination=neighbour;
+  // the sequence numbers only mean something on this interface
+  frame->interface=interface;
+  frame->payload=ob_new();
+  if (!frame->payload){
+    op_free(frame);
+    return WHY("ob_new() failed");
+  }
+  ob_append_ui16(frame->payload, first_sequence & 0xFFFF);
+  ob_append_byte(frame->payload, count);
+
+  if (overlay_payload_enqueue(OQ_MESH_MANAGEMENT, frame)){
+    op_free(frame);
+    return -1;
+  }
+  interface->nacks_sent++;
+  if (debug&DEBUG_OVERLAYFRAMES)
+    DEBUGF("Sent NACK to %s for %d packets from #%d", alloca_tohex_sid(neighbour->sid), count, first_sequence);
+  return 0;
+}
+
+static int retransmit_frame(overlay_interface *interface, struct retransmit_frame *r)
+{
+  struct overlay_frame *frame=op_dup(r->frame);
+  if (!frame)
+    return -1;
+  // this link can NACK again if the frame is lost again, so one copy is enough
+  frame->send_copies=1;
+  // it has been sent before, and must still go before it would have expired
+  frame->times_sent=1;
+  frame->deferred=0;
+  if (overlay_payload_enqueue_at(r->queue, frame, r->enqueued_at)){
+    op_free(frame);
+    return -1;
+  }
+  if (frame->sendBroadcast){
+    // only the neighbour that asked needs it again
+    int i;
+    for (i=0;i<overlay_interface_count;i++)
+      frame->broadcast_sent_via[i]=(&overlay_interfaces[i]!=interface);
+  }
+  interface->retransmitted_frames++;
+  return 0;
+}
+
+// keep the neighbours we might resend frames to
+void overlay_nack_mark_subscribers()
+{
+  int i, p, f;
+  for (i=0;i<overlay_interface_count;i++){
+    struct overlay_retransmit *retransmit=overlay_interfaces[i].retransmit;
+    if (!retransmit)
+      continue;
+    for (p=0;p<OVERLAY_RETRANSMIT_PACKETS;p++)
+      for (f=0;f<retransmit->packets[p].frame_count;f++)
+	subscriber_mark(retransmit->packets[p].frames[f].next_hop);
+  }
+}
+
+int overlay_nack_process(overlay_interface *interface, struct overlay_frame *f, time_ms_t now)
+{
+  if (!f->source)
+    return WHY("NACK has no source");
+  int first_sequence=ob_get_ui16(f->payload);
+  int count=ob_get(f->payload);
+  if (count<0 || f->payload->position > f->payload->sizeLimit)
+    return WHY("NACK is truncated");
+
+  interface->nacks_received++;
+
+  int i, j, sent=0;
+  for (i=0;i<count && i<OVERLAY_RETRANSMIT_PACKETS;i++){
+    struct retransmit_packet *p=retransmit_find(interface, (first_sequence + i) & 0xFFFF);
+    if (!p)
+      continue;
+    for (j=0;j<p->frame_count;j++){
+      struct retransmit_frame *r=&p->frames[j];
+      if (r->next_hop && r->next_hop!=f->source)
+	continue;
+      if (r->enqueued_at + overlay_tx[r->queue].latencyTarget < now)
+	continue;
+      if (retransmit_frame(interface, r)==0)
+	sent++;
+    }
+  }
+  if (debug&DEBUG_OVERLAYFRAMES)
+    DEBUGF("NACK from %s for %d packets from #%d, retransmitting %d frames",
+	   alloca_tohex_sid(f->source->sid), count, first_sequence, sent);
+  return 0;
+}
@@ -0,0 +1,313 @@
+/*
+ Serval Daemon
+ Copyright (C) 2012 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "serval.h"
+
+/* Interface discovery driven by the kernel.
+
+ overlay_interface_discover() lists every interface again on a timer, so a new wifi link can wait
+ seconds before we notice it. On Linux we also listen to the routing socket, which tells us as soon
+ as an IPv4 address is added or removed, or a link goes up or down. New addresses are registered
+ straight away, and interfaces that have lost their address or link are closed.
+
+ When a link comes up, or the kernel had to drop messages because we were too slow to read them,
+ we ask for a dump of every address, which arrives as RTM_NEWADDR messages like any other.
+ The kernel sends RTM_NEWLINK for many other reasons, so we remember which links were up, and only
+ ask again when one of them changes. Anything not sent by the kernel itself is ignored.
+ The periodic scan still runs, less often, in case anything is missed.
+ */
+
+static unsigned int netlink_messages=0;
+static unsigned int netlink_addresses_added=0;
+static unsigned int netlink_addresses_removed=0;
+static unsigned int netlink_links_down=0;
+static unsigned int netlink_dumps=0;
+static unsigned int netlink_overruns=0;
+static unsigned int netlink_ignored=0;
+
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_RTNETLINK_H)
+
+static struct sched_ent netlink_alarm;
+static struct profile_total netlink_stats;
+static int netlink_open=0;
+static int netlink_sequence=0;
+// only one dump can run at a time, so remember if we need another once it's done
+static int dump_running=0;
+static int dump_again=0;
+
+/* The links we have heard about, and whether each was up and running */
+#define NETLINK_MAX_LINKS 32
+static struct netlink_link{
+  int index;
+  int up;
+} netlink_links[NETLINK_MAX_LINKS];
+static int netlink_link_count=0;
+
+/* Remember the state of a link. Returns the state it was in before, or -1 if we didn't know */
+static int overlay_netlink_link_state(int index, int up)
+{
+  int i;
+  for (i=0;i<netlink_link_count;i++){
+    if (netlink_links[i].index==index){
+      int was = netlink_links[i].up;
+      netlink_links[i].up = up;
+      return was;
+    }
+  }
+  // if the table is full, we will just treat this link as new every time we hear about it
+  if (netlink_link_count<NETLINK_MAX_LINKS){
+    netlink_links[netlink_link_count].index=index;
+    netlink_links[netlink_link_count].up=up;
+    netlink_link_count++;
+  }
+  return -1;
+}
+
+static int overlay_netlink_request_dump()
+{
+  struct {
+    struct nlmsghdr header;
+    struct ifaddrmsg msg;
+  } request;
+
+  if (dump_running){
+    dump_again=1;
+    return 0;
+  }
+
+  bzero(&request, sizeof request);
+  request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+  request.header.nlmsg_type = RTM_GETADDR;
+  request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ROOT;
+  request.header.nlmsg_seq = ++netlink_sequence;
+  request.msg.ifa_family = AF_INET;
+
+  if (send(netlink_alarm.poll.fd, &request, request.header.nlmsg_len, 0)==-1)
+    return WHY_perror("send(netlink)");
+  dump_running=1;
+  dump_again=0;
+  netlink_dumps++;
+  return 0;
+}
+
+static void overlay_netlink_address(struct nlmsghdr *header)
+{
+  struct ifaddrmsg *msg = (struct ifaddrmsg *)NLMSG_DATA(header);
+  if (msg->ifa_family != AF_INET)
+    return;
+
+  struct rtattr *rta = IFA_RTA(msg);
+  int len = IFA_PAYLOAD(header);
+  struct in_addr *local=NULL, *address=NULL;
+  int broadcast=0;
+  char name[IFNAMSIZ]="";
+
+  for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)){
+    switch(rta->rta_type){
+      case IFA_LOCAL: local=(struct in_addr *)RTA_DATA(rta); break;
+      case IFA_ADDRESS: address=(struct in_addr *)RTA_DATA(rta); break;
+      case IFA_BROADCAST: broadcast=1; break;
+      case IFA_LABEL:
+	strncpy(name, (char *)RTA_DATA(rta), sizeof name);
+	name[sizeof name -1]=0;
+	break;
+    }
+  }
+  // on point to point links, IFA_ADDRESS is the other end
+  if (!local)
+    local=address;
+  if (!local || !name[0])
+    return;
+
+  struct in_addr mask;
+  mask.s_addr = msg->ifa_prefixlen ? htonl(0xFFFFFFFFu << (32 - msg->ifa_prefixlen)) : 0;
+
+  if (header->nlmsg_type==RTM_NEWADDR){
+    /* Not broadcast? Not interested.. */
+    if (!broadcast){
+      if (debug & DEBUG_OVERLAYINTERFACES) DEBUGF("Skipping non-broadcast address on %s", name);
+      return;
+    }
+    netlink_addresses_added++;
+    overlay_interface_register(name, *local, mask);
+  }else{
+    netlink_addresses_removed++;
+    overlay_interface_unregister(name, local, &mask);
+  }
+}
+
+static void overlay_netlink_link(struct nlmsghdr *header)
+{
+  struct ifinfomsg *msg = (struct ifinfomsg *)NLMSG_DATA(header);
+  struct rtattr *rta = IFLA_RTA(msg);
+  int len = IFLA_PAYLOAD(header);
+  char name[IFNAMSIZ]="";
+
+  for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)){
+    if (rta->rta_type == IFLA_IFNAME){
+      strncpy(name, (char *)RTA_DATA(rta), sizeof name);
+      name[sizeof name -1]=0;
+    }
+  }
+  if (!name[0])
+    return;
+
+  int up = header->nlmsg_type==RTM_NEWLINK
+    && (msg->ifi_flags & IFF_UP) && (msg->ifi_flags & IFF_RUNNING);
+  int was = overlay_netlink_link_state(msg->ifi_index, up);
+  if (up==was)
+    return;
+
+  if (!up){
+    if (debug & DEBUG_OVERLAYINTERFACES) DEBUGF("Link %s is down", name);
+    netlink_links_down++;
+    overlay_interface_unregister(name, NULL, NULL);
+  }else{
+    // the link may have kept its address while it was down, so look for it again
+    overlay_netlink_request_dump();
+  }
+}
+
+/* Handle one datagram from the routing socket. Only the kernel may tell us about interfaces,
+   so anything another process sent us is dropped */
+void overlay_netlink_receive(unsigned char *buff, int len, uint32_t pid)
+{
+  if (pid!=0){
+    if (debug & DEBUG_OVERLAYINTERFACES) DEBUGF("Ignoring netlink message from pid %u", pid);
+    netlink_ignored++;
+    return;
+  }
+
+  struct nlmsghdr *header;
+  for (header = (struct nlmsghdr *)buff; NLMSG_OK(header, (size_t)len); header = NLMSG_NEXT(header, len)){
+    netlink_messages++;
+    switch(header->nlmsg_type){
+      case NLMSG_DONE:
+      case NLMSG_ERROR:
+	dump_running=0;
+	if (dump_again)
+	  overlay_netlink_request_dump();
+	break;
+      case RTM_NEWADDR:
+      case RTM_DELADDR:
+	overlay_netlink_address(header);
+	break;
+      case RTM_NEWLINK:
+      case RTM_DELLINK:
+	overlay_netlink_link(header);
+	break;
+    }
+  }
+}
+
+static void overlay_netlink_poll(struct sched_ent *alarm)
+{
+  unsigned char buff[16384];
+  int i;
+
+  // read a few datagrams at a time, so a burst of changes can't starve everything else
+  for (i=0;i<8;i++){
+    struct sockaddr_nl src;
+    socklen_t srclen = sizeof src;
+    bzero(&src, sizeof src);
+    ssize_t len = recvfrom(alarm->poll.fd, buff, sizeof buff, 0, (struct sockaddr *)&src, &srclen);
+    if (len==-1){
+      if (errno==EAGAIN || errno==EWOULDBLOCK)
+	break;
+      if (errno==ENOBUFS){
+	// the kernel dropped messages we didn't read in time, so check every address
+	netlink_overruns++;
+	dump_running=0;
+	overlay_netlink_request_dump();
+	continue;
+      }
+      WHY_perror("recvfrom(netlink)");
+      break;
+    }
+    overlay_netlink_receive(buff, len, src.nl_pid);
+  }
+}
+
+/* Subscribe to address and link changes. Safe to call again once we are listening */
+int overlay_netlink_init()
+{
+  if (netlink_open)
+    return 0;
+
+  int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd==-1)
+    return WHY_perror("socket(AF_NETLINK)");
+
+  struct sockaddr_nl addr;
+  bzero(&addr, sizeof addr);
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr)==-1){
+    WHY_perror("bind(netlink)");
+    close(fd);
+    return -1;
+  }
+  overlay_netlink_attach(fd);
+  INFO("Listening for interface changes from the kernel");
+  return 0;
+}
+
+/* Read routing messages from this socket, and send it our requests for address dumps */
+void overlay_netlink_attach(int fd)
+{
+  bzero(&netlink_alarm, sizeof netlink_alarm);
+  netlink_alarm.poll.fd = fd;
+  netlink_alarm.poll.events = POLLIN;
+  netlink_alarm.function = overlay_netlink_poll;
+  netlink_stats.name = "overlay_netlink_poll";
+  netlink_alarm.stats = &netlink_stats;
+  watch(&netlink_alarm);
+  netlink_open=1;
+}
+
+int overlay_netlink_active()
+{
+  return netlink_open;
+}
+
+#else
+
+int overlay_netlink_init()
+{
+  return -1;
+}
+
+int overlay_netlink_active()
+{
+  return 0;
+}
+
+#endif
+
+void overlay_netlink_stats_keyvalues(XPRINTF xpf)
+{
+  xprintf(xpf, "netlink.active=%d\n", overlay_netlink_active());
+  xprintf(xpf, "netlink.messages=%u\n", netlink_messages);
+  xprintf(xpf, "netlink.addresses_added=%u\n", netlink_addresses_added);
+  xprintf(xpf, "netlink.addresses_removed=%u\n", netlink_addresses_removed);
+  xprintf(xpf, "netlink.links_down=%u\n", netlink_links_down);
+  xprintf(xpf, "netlink.dumps=%u\n", netlink_dumps);
+  xprintf(xpf, "netlink.overruns=%u\n", netlink_overruns);
+  xprintf(xpf, "netlink.ignored=%u\n", netlink_ignored);
+}
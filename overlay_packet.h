@@ -31,14 +31,17 @@ struct overlay_frame {
   unsigned int modifiers;
   
   unsigned char ttl;
-  // temporary hack to improve reliability before implementing per-packet nack's
+  /* Send this many copies of a unicast frame in unnumbered packets, which can't be NACKed.
+     A frame that goes in a numbered broadcast packet is sent once, and retransmitted on NACK */
   int send_copies;
+  unsigned char times_sent;
   
   /* Mark which interfaces the frame has been sent on,
    so that we can ensure that broadcast frames get sent
-   exactly once on each interface */
+   exactly once on each interface.
+   One byte per interface, allocated by op_broadcast_init() */
   int sendBroadcast;
-  unsigned char broadcast_sent_via[OVERLAY_MAX_INTERFACES];
+  unsigned char *broadcast_sent_via;
   struct broadcast broadcast_id;
   
   // null if destination is broadcast
@@ -46,6 +49,10 @@ struct overlay_frame {
   
   struct subscriber *source;
   
+  /* If set, the frame may only go out this interface, in a packet broadcast on it.
+     Used for NACKs, which only make sense to the neighbour on the interface where we saw the gap */
+  struct overlay_interface *interface;
+  
   /* IPv4 node frame was received from (if applicable) */
   struct sockaddr *recvaddr;
   
@@ -54,10 +61,30 @@ struct overlay_frame {
   
   time_ms_t enqueued_at;
   
+  /* Set once the frame has been held back by interface pacing, so it is only counted once */
+  unsigned char deferred;
+  
+  /* The serial number of the last packet we tried to fit this frame into */
+  unsigned int packed_in;
+  
+  /* The link this frame is waiting to be sent over, see overlay_interface.c */
+  struct overlay_link *link;
+  struct overlay_frame *link_prev;
+  struct overlay_frame *link_next;
+  
+  /* Every frame that hasn't been freed, wherever it is, so we can tell which subscribers are in use */
+  struct overlay_frame *live_prev;
+  struct overlay_frame *live_next;
 };
 
 
+struct overlay_frame *op_new(void);
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
+int op_pool_init(int interfaces);
+int op_broadcast_init(struct overlay_frame *p);
+void overlay_queue_link_frame(int q, struct overlay_frame *frame);
+void op_pool_stats_keyvalues(XPRINTF xpf);
+void op_mark_subscribers();
 
 #endif
@@ -28,6 +28,9 @@ struct sockaddr_in loopback = {
   .sin_addr.s_addr=0x0100007f
 };
 
+/* Cleared by "bench overlay-replay" to measure decoding alone, without the MDP and Rhizome handlers */
+int overlay_process_data_frames=1;
+
 // a frame destined for one of our local addresses, or broadcast, has arrived. Process it.
 int process_incoming_frame(time_ms_t now, struct overlay_interface *interface, struct overlay_frame *f){
   int id = (interface - overlay_interfaces);
@@ -54,19 +57,26 @@ int process_incoming_frame(time_ms_t now, struct overlay_interface *interface, s
     case OF_TYPE_RHIZOME_ADVERT:
       if (debug&DEBUG_OVERLAYFRAMES)
 	DEBUG("Processing OF_TYPE_RHIZOME_ADVERT");
-      overlay_rhizome_saw_advertisements(id,f,now);
+      if (overlay_process_data_frames)
+	overlay_rhizome_saw_advertisements(id,f,now);
       break;
     case OF_TYPE_DATA:
     case OF_TYPE_DATA_VOICE:
       if (debug&DEBUG_OVERLAYFRAMES)
 	DEBUG("Processing OF_TYPE_DATA");
-      overlay_saw_mdp_containing_frame(f,now);
+      if (overlay_process_data_frames)
+	overlay_saw_mdp_containing_frame(f,now);
       break;
     case OF_TYPE_PLEASEEXPLAIN:
       if (debug&DEBUG_OVERLAYFRAMES)
 	DEBUG("Processing OF_TYPE_PLEASEEXPLAIN");
       process_explain(f);
       break;
+    case OF_TYPE_NACK:
+      if (debug&DEBUG_OVERLAYFRAMES)
+	DEBUG("Processing OF_TYPE_NACK");
+      overlay_nack_process(interface, f, now);
+      break;
     default:
       return WHYF("Support for f->type=0x%x not yet implemented",f->type);
       break;
@@ -127,7 +137,13 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
    
      The current structure of an overlay packet is as follows;
      Fixed header [0x4F, 0x10]
-     Version [0x00, 0x01]
+     Version [highest envelope version the sender understands, envelope version of this packet]
+       (older nodes send [0x00, 0x01] and ignore these bytes when receiving)
+     
+     Version 2 packets then have an envelope header:
+     Flags (8bits, OVERLAY_ENVELOPE_FLAG_UNICAST if sent to a single neighbour)
+     Sender (variable length due to address abbreviation)
+     Sequence number (16bits, per sending interface, broadcast packets only)
      
      Each frame within the packet has the following fields:
      Frame type (8-24bits)
@@ -167,17 +183,28 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
      the source having received the frame from elsewhere.
   */
 
+  IN();
   struct overlay_frame f;
   struct subscriber *sender=NULL;
   struct decode_context context={
+    .interface=interface,
     .please_explain=NULL,
   };
   
   time_ms_t now = gettime_ms();
-  struct overlay_buffer *b = ob_static(packet, len);
+  /* The packet and each payload are parsed through buffers on the stack, pointing into the
+     received bytes.  Payloads are only copied to the heap if they are queued (see op_dup()). */
+  struct overlay_buffer packet_buffer;
+  struct overlay_buffer payload_buffer;
+  struct overlay_buffer *b = &packet_buffer;
+  ob_init_static(b, packet, len);
   ob_limitsize(b, len);
-  // skip magic bytes and version as they have already been parsed
-  b->position=4;
+  // skip magic bytes as they have already been parsed
+  b->position=2;
+  int peer_version = ob_get(b);
+  int version = ob_get(b);
+  if (version!=OVERLAY_ENVELOPE_LEGACY && version!=OVERLAY_ENVELOPE_VERSION)
+    RETURN(WHYF("Unsupported overlay envelope version %d", version));
   
   bzero(&f,sizeof(struct overlay_frame));
   
@@ -197,12 +224,38 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
 
   overlay_address_clear();
 
-  // TODO put sender of packet and sequence number in envelope header
-  // Then we can quickly drop reflected broadcast packets
-  // currently we see annoying errors as we attempt to parse each payload
-  // plus with a sequence number we can detect dropped packets and nack them for retransmission
+  if (version>=OVERLAY_ENVELOPE_VERSION){
+    // the envelope tells us who sent the packet, so we can drop our own reflected broadcasts
+    // without parsing any payloads, and count gaps in the sequence as lost packets.
+    struct subscriber *envelope_sender=NULL;
+    int envelope_flags = ob_get(b);
+    if (overlay_address_parse(&context, b, NULL, &envelope_sender))
+      RETURN(WHY("Unable to parse envelope sender"));
+    int sequence = -1;
+    if (!(envelope_flags & OVERLAY_ENVELOPE_FLAG_UNICAST))
+      sequence = ob_get_ui16(b);
+    if (envelope_flags<0 || b->position > b->sizeLimit)
+      RETURN(WHY("Envelope header is truncated"));
+    
+    if (envelope_sender && !context.invalid_addresses){
+      if (envelope_sender->reachable==REACHABLE_SELF){
+	interface->rx_own_packets++;
+	RETURN(0);
+      }
+      sender = envelope_sender;
+      overlay_address_set_sender(sender);
+      overlay_interface_saw_peer(interface, peer_version, now);
+      if (sequence>=0){
+	int lost = overlay_route_saw_sequence(sender, interface, sequence);
+	if (lost>0)
+	  overlay_nack_send(interface, sender, (sequence - lost) & 0xFFFF, lost);
+	else if (lost<0)
+	  // any indexes it gave us before may now mean someone else
+	  overlay_address_index_reset(sender, interface);
+      }
+    }
+  }
   
-  /* Skip magic bytes and version */
   while(b->position < b->sizeLimit){
     context.invalid_addresses=0;
     
@@ -236,6 +289,7 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
       /* assume we fell off the end of the packet */
       break;
     }
+    interface->rx_frames++;
 
     int next_payload = b->position + payload_len;
     
@@ -275,10 +329,14 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
     if (f.type==OF_TYPE_SELFANNOUNCE){
       sender = f.source;
       // skip the entire packet if it came from me
-      if (sender->reachable==REACHABLE_SELF)
+      if (sender->reachable==REACHABLE_SELF){
+	interface->rx_own_packets++;
 	break;
+      }
       
       overlay_address_set_sender(f.source);
+      if (version<OVERLAY_ENVELOPE_VERSION)
+	overlay_interface_saw_peer(interface, peer_version, now);
       
       // if this is a dummy announcement for a node that isn't in our routing table
       if (f.destination && 
@@ -313,11 +371,11 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
       goto next;
     }
     
-    f.payload = ob_slice(b, b->position, next_payload - b->position);
-    if (!f.payload){
+    if (ob_init_slice(&payload_buffer, b, b->position, next_payload - b->position)){
       WHY("Payload length is longer than remaining packet size");
       break;
     }
+    f.payload = &payload_buffer;
     // mark the entire payload as having valid data
     ob_limitsize(f.payload, next_payload - b->position);
     
@@ -333,17 +391,12 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
     }
     
   next:
-    if (f.payload){
-      ob_free(f.payload);
-      f.payload=NULL;
-    }
+    f.payload=NULL;
     b->position=next_payload;
   }
   
-  ob_free(b);
-  
   send_please_explain(&context, my_subscriber, sender);
-  return 0;
+  RETURN(0);
 }
 
 int overlay_add_selfannouncement(int interface,struct overlay_buffer *b)
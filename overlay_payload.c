@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
+#include "mem_pool.h"
 
 static int op_append_type(struct overlay_buffer *headers, struct overlay_frame *p)
 {
@@ -67,6 +68,7 @@ int overlay_frame_append_payload(overlay_interface *interface, struct overlay_fr
   if (!headers) return WHY("could not allocate overlay buffer for headers");
 
   ob_checkpoint(b);
+  overlay_address_checkpoint();
   
   if (debug&DEBUG_PACKETCONSTRUCTION)
     dump_payload(p,"append_payload stuffing into packet");
@@ -138,11 +140,13 @@ int overlay_frame_append_payload(overlay_interface *interface, struct overlay_fr
   }
 
   ob_free(headers);
+  overlay_address_commit();
   return 0;
   
 cleanup:
   ob_free(headers);
   ob_rewind(b);
+  overlay_address_rewind();
   return -1;
 }
   
@@ -179,10 +183,16 @@ int dump_payload(struct overlay_frame *p, char *message)
 
 int overlay_payload_enqueue(int q, struct overlay_frame *p)
 {
-  /* Add payload p to queue q.
+  return overlay_payload_enqueue_at(q, p, gettime_ms());
+}
+
+int overlay_payload_enqueue_at(int q, struct overlay_frame *p, time_ms_t enqueued_at)
+{
+  /* Add payload p to queue q, as if it had been queued at enqueued_at.
 
-     Queues get scanned from first to last, so we should append new entries
-     on the end of the queue.
+     Queues get scanned from first to last, and expire from the front, so keep them in the
+     order frames were queued. New frames go on the end, frames being sent again
+     keep their place from when they were first queued.
 
      Complain if there are too many frames in the queue.
   */
@@ -210,8 +220,10 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
     p->payload->sizeLimit=p->payload->position;
   }
   
-  if (overlay_tx[q].length>=overlay_tx[q].maxLength) 
+  if (overlay_tx[q].length>=overlay_tx[q].maxLength){
+    overlay_tx[q].dropped++;
     return WHYF("Queue #%d congested (size = %d)",q,overlay_tx[q].maxLength);
+  }
 
   if (p->send_copies<=0)
     p->send_copies=1;
@@ -225,8 +237,11 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
     // hook to allow for flooding via olsr
     olsr_send(p);
     
+    if (op_broadcast_init(p))
+      return -1;
+    
     // make sure there is an interface up that allows broadcasts
-    for(i=0;i<OVERLAY_MAX_INTERFACES;i++){
+    for(i=0;i<overlay_max_interfaces;i++){
       if (overlay_interfaces[i].state==INTERFACE_STATE_UP
 	  && overlay_interfaces[i].send_broadcasts){
 	p->broadcast_sent_via[i]=0;
@@ -242,15 +257,18 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
     p->sendBroadcast=1;
   }
   
+  p->enqueued_at=enqueued_at;
   struct overlay_frame *l=overlay_tx[q].last;
-  if (l) l->next=p;
+  while(l && l->enqueued_at > enqueued_at)
+    l=l->prev;
   p->prev=l;
-  p->next=NULL;
-  p->enqueued_at=gettime_ms();
-
-  overlay_tx[q].last=p;
-  if (!overlay_tx[q].first) overlay_tx[q].first=p;
+  p->next=l?l->next:overlay_tx[q].first;
+  if (l) l->next=p;
+  else overlay_tx[q].first=p;
+  if (p->next) p->next->prev=p;
+  else overlay_tx[q].last=p;
   overlay_tx[q].length++;
+  overlay_queue_link_frame(q, p);
 
   overlay_update_queue_schedule(&overlay_tx[q], p);
   
@@ -259,6 +277,49 @@ int overlay_payload_enqueue(int q, struct overlay_frame *p)
   return 0;
 }
 
+/* Frames are queued and freed thousands of times a second, so they come from a slab pool
+   rather than the general heap. */
+static struct mem_pool frame_pool = MEM_POOL("overlay_frame", sizeof(struct overlay_frame), 64);
+
+/* One byte per interface, for broadcast frames to remember where they have been sent.
+   The size isn't known until the interface table is allocated, see op_pool_init() */
+static struct mem_pool sent_via_pool = MEM_POOL("broadcast_sent_via", 0, 64);
+
+static struct overlay_frame *live_frames=NULL;
+
+static void op_live_insert(struct overlay_frame *p)
+{
+  p->live_prev=NULL;
+  p->live_next=live_frames;
+  if (live_frames)
+    live_frames->live_prev=p;
+  live_frames=p;
+}
+
+struct overlay_frame *op_new(void)
+{
+  struct overlay_frame *p=pool_calloc(&frame_pool);
+  if (p)
+    op_live_insert(p);
+  return p;
+}
+
+// frames may be waiting in a queue, a retransmit buffer or a please explain, so keep their addresses
+void op_mark_subscribers()
+{
+  struct overlay_frame *p;
+  for (p=live_frames;p;p=p->live_next){
+    subscriber_mark(p->source);
+    subscriber_mark(p->destination);
+  }
+}
+
+void op_pool_stats_keyvalues(XPRINTF xpf)
+{
+  pool_stats_keyvalues(&frame_pool, xpf);
+  pool_stats_keyvalues(&sent_via_pool, xpf);
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -268,7 +329,34 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  if (p->broadcast_sent_via) pool_free(&sent_via_pool, p->broadcast_sent_via);
+  p->broadcast_sent_via=NULL;
+  if (p->live_prev)
+    p->live_prev->live_next=p->live_next;
+  else
+    live_frames=p->live_next;
+  if (p->live_next)
+    p->live_next->live_prev=p->live_prev;
+  pool_free(&frame_pool, p);
+  return 0;
+}
+
+// called once the size of the interface table is known, before any frame can be queued
+int op_pool_init(int interfaces)
+{
+  return pool_set_object_size(&sent_via_pool, interfaces);
+}
+
+// make sure the frame has somewhere to mark the interfaces it has been broadcast on
+int op_broadcast_init(struct overlay_frame *p)
+{
+  if (p->broadcast_sent_via)
+    return 0;
+  if (!sent_via_pool.object_size)
+    return WHY("The interface table has not been allocated");
+  p->broadcast_sent_via = pool_calloc(&sent_via_pool);
+  if (!p->broadcast_sent_via)
+    return WHY("pool_calloc() failed");
   return 0;
 }
 
@@ -277,13 +365,34 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out=malloc(sizeof(struct overlay_frame));
-  if (!out) return WHYNULL("malloc() failed");
+  struct overlay_frame *out=pool_alloc(&frame_pool);
+  if (!out) return WHYNULL("pool_alloc() failed");
 
   /* copy main data structure */
   bcopy(in,out,sizeof(struct overlay_frame));
+  // the copy isn't in any queue
+  out->prev=NULL;
+  out->next=NULL;
+  out->link=NULL;
+  out->link_prev=NULL;
+  out->link_next=NULL;
+  out->payload=NULL;
+  out->broadcast_sent_via=NULL;
   
-  if (in->payload)
+  if (in->broadcast_sent_via){
+    if (op_broadcast_init(out)){
+      pool_free(&frame_pool, out);
+      return NULL;
+    }
+    bcopy(in->broadcast_sent_via, out->broadcast_sent_via, overlay_max_interfaces);
+  }
+  op_live_insert(out);
+  if (in->payload){
     out->payload=ob_dup(in->payload);
+    if (!out->payload){
+      op_free(out);
+      return WHYNULL("ob_dup() failed");
+    }
+  }
   return out;
 }
@@ -139,6 +139,23 @@ struct overlay_neighbour_observation {
   unsigned char valid;
 };
 
+/* What we know of a neighbour on one of our interfaces */
+struct overlay_neighbour_interface {
+  /* Score of visibility from this interface.
+   This is so that the sender knows which interface to use to reach us.
+   */
+  unsigned char score;
+  
+  /* Envelope sequence numbers heard from this neighbour on this interface.
+   Gaps are counted as lost packets, and the loss rate scales the link score.
+   Both counts are halved from time to time so that old history fades out.
+   */
+  unsigned char sequence_heard;
+  int last_sequence;
+  unsigned int packets_received;
+  unsigned int packets_lost;
+};
+
 struct overlay_neighbour {
   time_ms_t last_observation_time_ms;
   time_ms_t last_metric_update;
@@ -146,10 +163,8 @@ struct overlay_neighbour {
   struct overlay_neighbour_observation observations[OVERLAY_MAX_OBSERVATIONS];
   overlay_node *node;
   
-  /* Scores of visibility from each of the neighbours interfaces.
-   This is so that the sender knows which interface to use to reach us.
-   */
-  unsigned char scores[OVERLAY_MAX_INTERFACES];
+  /* One entry for each of our interfaces, overlay_max_interfaces of them */
+  struct overlay_neighbour_interface *interfaces;
 };
 
 /* We need to keep track of which nodes are our direct neighbours.
@@ -167,6 +182,16 @@ int overlay_neighbour_count=0;
 struct overlay_neighbour overlay_neighbours[overlay_max_neighbours];
 
 int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now);
+
+// neighbours point to their node, so they must be kept
+void overlay_route_mark_subscribers()
+{
+  int n;
+  for (n=1;n<overlay_neighbour_count;n++)
+    if (overlay_neighbours[n].node)
+      subscriber_mark(overlay_neighbours[n].node->subscriber);
+}
+
 int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_t now);
 struct overlay_neighbour *overlay_route_get_neighbour_structure(overlay_node *node, int createP);
 
@@ -231,8 +256,8 @@ int overlay_route_ack_selfannounce(struct overlay_frame *f,
 
   /* XXX Allocate overlay_frame structure and populate it */
   struct overlay_frame *out=NULL;
-  out=calloc(sizeof(struct overlay_frame),1);
-  if (!out) return WHY("calloc() failed to allocate an overlay frame");
+  out=op_new();
+  if (!out) return WHY("op_new() failed to allocate an overlay frame");
 
   out->type=OF_TYPE_SELFANNOUNCE_ACK;
   out->modifiers=0;
@@ -288,11 +313,11 @@ int overlay_route_ack_selfannounce(struct overlay_frame *f,
   */
 #ifdef NOTDEFINED
   int i;
-  for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
+  for(i=0;i<overlay_interface_count;i++)
     {
       /* Only include interfaces with score >0 */
-      if (n->scores[i]) {
-	ob_append_byte(out->payload,n->scores[i]);
+      if (n->interfaces[i].score) {
+	ob_append_byte(out->payload,n->interfaces[i].score);
 	ob_append_byte(out->payload,i);
       }
     }
@@ -334,8 +359,19 @@ int overlay_route_make_neighbour(overlay_node *n)
     if (overlay_neighbours[nid].node) overlay_neighbours[nid].node->neighbour_id=0;
     n->neighbour_id=nid;
   }
-  bzero(&overlay_neighbours[n->neighbour_id],sizeof(struct overlay_neighbour));
-  overlay_neighbours[n->neighbour_id].node=n;
+  struct overlay_neighbour *neighbour=&overlay_neighbours[n->neighbour_id];
+  struct overlay_neighbour_interface *interfaces=neighbour->interfaces;
+  if (!interfaces){
+    interfaces=malloc(sizeof(struct overlay_neighbour_interface)*overlay_max_interfaces);
+    if (!interfaces){
+      n->neighbour_id=0;
+      return WHY("malloc() failed");
+    }
+  }
+  bzero(neighbour,sizeof(struct overlay_neighbour));
+  bzero(interfaces,sizeof(struct overlay_neighbour_interface)*overlay_max_interfaces);
+  neighbour->interfaces=interfaces;
+  neighbour->node=n;
   
   return 0;
 }
@@ -358,6 +394,46 @@ struct overlay_neighbour *overlay_route_get_neighbour_structure(overlay_node *no
   return &overlay_neighbours[node->neighbour_id];
 }
 
+/* Note the envelope sequence number of a packet from a neighbour, counting any gap since the last one as loss.
+   Returns the number of packets newly found to be missing, just before this one,
+   or -1 if this is the first packet we have heard since the neighbour appeared or restarted */
+int overlay_route_saw_sequence(struct subscriber *subscriber, overlay_interface *interface, int sequence)
+{
+  // self-announcements are responsible for making nodes into neighbours
+  struct overlay_neighbour *n=overlay_route_get_neighbour_structure(get_node(subscriber, 0), 0);
+  if (!n)
+    return 0;
+  
+  int i = interface - overlay_interfaces;
+  int lost=-1;
+  if (n->interfaces[i].sequence_heard){
+    int gap = (sequence - n->interfaces[i].last_sequence) & 0xFFFF;
+    if (gap==0)
+      return 0;
+    if (gap >= 0x10000 - OVERLAY_MAX_SEQUENCE_GAP){
+      // a late packet that we have already counted as lost
+      if (n->interfaces[i].packets_lost)
+	n->interfaces[i].packets_lost--;
+      n->interfaces[i].packets_received++;
+      return 0;
+    }
+    if (gap <= OVERLAY_MAX_SEQUENCE_GAP){
+      lost=gap -1;
+      n->interfaces[i].packets_lost+=lost;
+    }
+    // otherwise the neighbour has restarted, or we have been out of touch for a while
+  }
+  n->interfaces[i].sequence_heard=1;
+  n->interfaces[i].last_sequence=sequence;
+  n->interfaces[i].packets_received++;
+  
+  if (n->interfaces[i].packets_received + n->interfaces[i].packets_lost > 256){
+    n->interfaces[i].packets_received>>=1;
+    n->interfaces[i].packets_lost>>=1;
+  }
+  return lost;
+}
+
 int overlay_route_node_can_hear_me(struct subscriber *subscriber, int sender_interface,
 				   unsigned int s1,unsigned int s2,
 				   time_ms_t now)
@@ -470,9 +546,9 @@ int overlay_route_recalc_node_metrics(overlay_node *n, time_ms_t now)
     for(i=0;i<overlay_interface_count;i++)
     {
       if (overlay_interfaces[i].state==INTERFACE_STATE_UP && 
-	  neighbour->scores[i]>best_score)
+	  neighbour->interfaces[i].score>best_score)
       {
-	best_score=neighbour->scores[i];
+	best_score=neighbour->interfaces[i].score;
 	best_observation=-1;
 	reachable=REACHABLE_DIRECT;
 	interface = &overlay_interfaces[i];
@@ -587,9 +663,9 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
   n->last_metric_update = now;
 
   /* Somewhere to remember how many milliseconds we have seen */
-  int ms_observed_5sec[OVERLAY_MAX_INTERFACES];
-  int ms_observed_200sec[OVERLAY_MAX_INTERFACES];
-  for(i=0;i<OVERLAY_MAX_INTERFACES;i++) {
+  int ms_observed_5sec[OVERLAY_INTERFACE_LIMIT];
+  int ms_observed_200sec[OVERLAY_INTERFACE_LIMIT];
+  for(i=0;i<overlay_interface_count;i++) {
     ms_observed_5sec[i]=0;
     ms_observed_200sec[i]=0;
   }
@@ -600,7 +676,7 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
      the announcements on. */
   for(i=0;i<OVERLAY_MAX_OBSERVATIONS;i++) {
     if (!n->observations[i].valid ||
-	n->observations[i].sender_interface>=OVERLAY_MAX_INTERFACES ||
+	n->observations[i].sender_interface>=overlay_interface_count ||
 	overlay_interfaces[n->observations[i].sender_interface].state!=INTERFACE_STATE_UP)
       continue;
       
@@ -645,7 +721,7 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
   
   int scoreChanged=0;
   
-  for(i=0;i<OVERLAY_MAX_INTERFACES;i++) {
+  for(i=0;i<overlay_interface_count;i++) {
     int score;
     if (ms_observed_200sec[i]>200000) ms_observed_200sec[i]=200000;
     if (ms_observed_5sec[i]>5000) ms_observed_5sec[i]=5000;
@@ -661,14 +737,20 @@ int overlay_route_recalc_neighbour_metrics(struct overlay_neighbour *n, time_ms_
       else
 	score=contrib_5+contrib_200;      
 
+      /* Scale by the fraction of envelope packets we actually heard,
+         once we have heard enough of them to say */
+      unsigned int packets = n->interfaces[i].packets_received + n->interfaces[i].packets_lost;
+      if (packets>=16)
+	score = score * n->interfaces[i].packets_received / packets;
+
       /* Deal with invalid sequence number ranges */
       if (score<1) score=1;
       if (score>255) score=255;
     }
 
-    if (n->scores[i]!=score){
+    if (n->interfaces[i].score!=score){
       scoreChanged=1;
-      n->scores[i]=score;
+      n->interfaces[i].score=score;
     }
     if ((debug&DEBUG_OVERLAYROUTING)&&score)
       DEBUGF("Neighbour score on interface #%d = %d (observations for %dms)",i,score,ms_observed_200sec[i]);
@@ -733,7 +815,7 @@ int overlay_route_record_link(time_ms_t now, unsigned char *to,
 	score, gateways_en_route
       );
  
-  if (sender_interface>OVERLAY_MAX_INTERFACES || score == 0) {
+  if (sender_interface>=OVERLAY_INTERFACE_LIMIT || score == 0) {
     if (debug & DEBUG_OVERLAYROUTING)
       DEBUG("invalid report");
     RETURN(0);
@@ -831,6 +913,27 @@ int node_dump(struct subscriber *subscriber, void *context){
   return 0;
 }
 
+/* Report the recent packet loss measured from each neighbour's envelope sequence numbers */
+void overlay_route_stats_keyvalues(XPRINTF xpf)
+{
+  int n,i;
+  for(n=0;n<overlay_neighbour_count;n++){
+    struct overlay_neighbour *neighbour=&overlay_neighbours[n];
+    if (!neighbour->node)
+      continue;
+    for(i=0;i<overlay_interface_count;i++){
+      if (!neighbour->interfaces[i].sequence_heard)
+	continue;
+      const char *sid = alloca_tohex(neighbour->node->subscriber->sid, 7);
+      unsigned int packets = neighbour->interfaces[i].packets_received + neighbour->interfaces[i].packets_lost;
+      xprintf(xpf, "neighbour.%s.%d.received=%u\n", sid, i, neighbour->interfaces[i].packets_received);
+      xprintf(xpf, "neighbour.%s.%d.lost=%u\n", sid, i, neighbour->interfaces[i].packets_lost);
+      xprintf(xpf, "neighbour.%s.%d.loss_percent=%u\n", sid, i, 
+	      packets?neighbour->interfaces[i].packets_lost*100/packets:0);
+    }
+  }
+}
+
 int overlay_route_dump()
 {
   int n,i;
@@ -839,7 +942,8 @@ int overlay_route_dump()
 
   strbuf_sprintf(b,"Overlay Local Identities\n------------------------\n");
   int cn,in,kp;
-  for(cn=0;cn<keyring->context_count;cn++)
+  // the simulator and replay benchmark run without a keyring
+  for(cn=0;keyring && cn<keyring->context_count;cn++)
     for(in=0;in<keyring->contexts[cn]->identity_count;in++)
       for(kp=0;kp<keyring->contexts[cn]->identities[in]->keypair_count;kp++)
 	if (keyring->contexts[cn]->identities[in]->keypairs[kp]->type
@@ -860,10 +964,10 @@ int overlay_route_dump()
 	strbuf_sprintf(b,"  %s* : %lldms ago :",
 		alloca_tohex(overlay_neighbours[n].node->subscriber->sid, 7),
 		(long long)(now - overlay_neighbours[n].last_observation_time_ms));
-	for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	  if (overlay_neighbours[n].scores[i]) 
+	for(i=0;i<overlay_interface_count;i++)
+	  if (overlay_neighbours[n].interfaces[i].score) 
 	    strbuf_sprintf(b," %d(via #%d)",
-		    overlay_neighbours[n].scores[i],i);
+		    overlay_neighbours[n].interfaces[i].score,i);
 	strbuf_sprintf(b,"\n");
       }
   DEBUG(strbuf_str(b));
@@ -989,7 +1093,8 @@ int overlay_route_node_info(overlay_mdp_frame *mdp,
 	      }
 	  }
 
-  struct subscriber *subscriber = find_subscriber(mdp->nodeinfo.sid, mdp->nodeinfo.sid_prefix_length/2, 0);
+  int matches;
+  struct subscriber *subscriber = find_subscriber_prefix(mdp->nodeinfo.sid, mdp->nodeinfo.sid_prefix_length, &matches);
   if (subscriber && subscriber->node){
     overlay_node *node = subscriber->node;
     
@@ -1007,10 +1112,10 @@ int overlay_route_node_info(overlay_mdp_frame *mdp,
       mdp->nodeinfo.time_since_last_observation = now - overlay_neighbours[n].last_observation_time_ms;
       
       int i;
-      for(i=0;i<OVERLAY_MAX_INTERFACES;i++)
-	if (overlay_neighbours[n].scores[i]>mdp->nodeinfo.score)
+      for(i=0;i<overlay_interface_count;i++)
+	if (overlay_neighbours[n].interfaces[i].score>mdp->nodeinfo.score)
 	{
-	  mdp->nodeinfo.score=overlay_neighbours[n].scores[i];
+	  mdp->nodeinfo.score=overlay_neighbours[n].interfaces[i].score;
 	  mdp->nodeinfo.interface_number=i;
 	}
       
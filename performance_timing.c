@@ -17,6 +17,7 @@
  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 
+#include <ctype.h>
 #include "serval.h"
 
 struct profile_total *stats_head=NULL;
@@ -27,6 +28,14 @@ void fd_clearstat(struct profile_total *s){
   s->total_time = 0;
   s->child_time = 0;
   s->calls = 0;
+  s->max_latency = 0;
+  bzero(s->latency, sizeof(s->latency));
+  s->alarm_calls = 0;
+  s->max_lateness = 0;
+  s->total_lateness = 0;
+  s->packet_batches = 0;
+  s->packets = 0;
+  s->max_packets = 0;
 }
 
 int fd_tallystats(struct profile_total *total,struct profile_total *a)
@@ -34,19 +43,89 @@ int fd_tallystats(struct profile_total *total,struct profile_total *a)
   total->total_time+=a->total_time;
   total->calls+=a->calls;
   if (a->max_time>total->max_time) total->max_time=a->max_time;
+  if (a->max_latency>total->max_latency) total->max_latency=a->max_latency;
+  int i;
+  for (i=0;i<PROFILE_BUCKETS;i++)
+    total->latency[i]+=a->latency[i];
+  total->alarm_calls+=a->alarm_calls;
+  total->total_lateness+=a->total_lateness;
+  if (a->max_lateness>total->max_lateness) total->max_lateness=a->max_lateness;
+  total->packet_batches+=a->packet_batches;
+  total->packets+=a->packets;
+  if (a->max_packets>total->max_packets) total->max_packets=a->max_packets;
   return 0;
 }
 
+// which latency bucket a call of this many nanoseconds is counted in
+static int latency_bucket(time_ns_t ns)
+{
+  if (ns < PROFILE_BUCKETS_PER_OCTAVE)
+    return ns<0?0:ns;
+  // the highest set bit picks the octave, the next two bits the bucket within it
+  int msb = 63 - __builtin_clzll(ns);
+  int bucket = (msb - 1) * PROFILE_BUCKETS_PER_OCTAVE + ((ns >> (msb - 2)) & 3);
+  return bucket<PROFILE_BUCKETS?bucket:PROFILE_BUCKETS-1;
+}
+
+// the largest latency that would be counted in this bucket
+static time_ns_t latency_bucket_limit(int bucket)
+{
+  if (bucket < PROFILE_BUCKETS_PER_OCTAVE)
+    return bucket;
+  int shift = bucket / PROFILE_BUCKETS_PER_OCTAVE - 1;
+  int sub = bucket % PROFILE_BUCKETS_PER_OCTAVE;
+  return ((time_ns_t)(PROFILE_BUCKETS_PER_OCTAVE + sub + 1) << shift) - 1;
+}
+
+/* Estimate the latency that this percentage of calls completed within, from the
+   upper bound of the bucket it falls in */
+time_ns_t fd_latency_percentile(struct profile_total *s, int percent)
+{
+  long long count=0, target;
+  int i;
+  for (i=0;i<PROFILE_BUCKETS;i++)
+    count+=s->latency[i];
+  if (!count)
+    return 0;
+  target = (count * percent + 99) / 100;
+  count = 0;
+  for (i=0;i<PROFILE_BUCKETS;i++){
+    count+=s->latency[i];
+    if (count>=target)
+      break;
+  }
+  time_ns_t limit = latency_bucket_limit(i);
+  return limit<s->max_latency?limit:s->max_latency;
+}
+
 int fd_showstat(struct profile_total *total, struct profile_total *a)
 {
-  INFOF("%lldms (%2.1f%%) in %d calls (max %lldms, avg %.1fms, +child avg %.1fms) : %s",
-       (long long) a->total_time,
+  INFOF("%.3fms (%2.1f%%) in %d calls (max %.3fms, avg %.3fms, +child avg %.3fms) : %s",
+       a->total_time/1e6,
        a->total_time*100.0/total->total_time,
        a->calls,
-       (long long) a->max_time,
-       a->total_time*1.00/a->calls,
-       (a->total_time+a->child_time)*1.00/a->calls,
+       a->max_time/1e6,
+       a->total_time/1e6/a->calls,
+       (a->total_time+a->child_time)/1e6/a->calls,
        a->name);
+  INFOF("  latency p50 %.3fms, p99 %.3fms, max %.3fms : %s",
+       fd_latency_percentile(a, 50)/1e6,
+       fd_latency_percentile(a, 99)/1e6,
+       a->max_latency/1e6,
+       a->name);
+  if (a->alarm_calls)
+    INFOF("  %d alarms called late by avg %.1fms, max %lldms : %s",
+	 a->alarm_calls,
+	 a->total_lateness*1.00/a->alarm_calls,
+	 (long long) a->max_lateness,
+	 a->name);
+  if (a->packet_batches)
+    INFOF("  %d packets in %d batches, avg %.1f per batch, max %d : %s",
+	 a->packets,
+	 a->packet_batches,
+	 a->packets*1.00/a->packet_batches,
+	 a->max_packets,
+	 a->name);
   return 0;
 }
 
@@ -132,6 +211,7 @@ int fd_clearstats()
     fd_clearstat(stats);
     stats = stats->_next;
   }
+  bzero(&syscall_counters, sizeof syscall_counters);
   return 0;
 }
 
@@ -162,9 +242,96 @@ int fd_showstats()
   return 0;
 }
 
+/* Write the stats as tab separated columns, one line per function, for scripts to read.
+   Times are in nanoseconds, except for lateness which is measured against wall clock alarms.
+ */
+void fd_dumpstats(XPRINTF xpf)
+{
+  struct profile_total *stats;
+  
+  xprintf(xpf, "name\tcalls\ttotal_ns\tchild_ns\tmax_ns\tp50_ns\tp99_ns\tmax_latency_ns\tlate_calls\tmax_late_ms\tpacket_batches\tpackets\n");
+  for (stats = stats_head; stats; stats = stats->_next){
+    if (!stats->calls)
+      continue;
+    xprintf(xpf, "%s\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%d\t%lld\t%d\t%d\n",
+	    stats->name,
+	    stats->calls,
+	    (long long) stats->total_time,
+	    (long long) stats->child_time,
+	    (long long) stats->max_time,
+	    (long long) fd_latency_percentile(stats, 50),
+	    (long long) fd_latency_percentile(stats, 99),
+	    (long long) stats->max_latency,
+	    stats->alarm_calls,
+	    (long long) stats->max_lateness,
+	    stats->packet_batches,
+	    stats->packets);
+  }
+}
+
+// write a function name as a stats key, replacing anything but letters, digits and '_'
+static void key_name(XPRINTF xpf, const char *name)
+{
+  if (!name)
+    name = "unnamed";
+  for (; *name; name++)
+    xputc(isalnum(*name) ? *name : '_', xpf);
+}
+
+/* Write the stats as "function.<name>.<counter>=<value>" lines, for the stats command */
+void fd_stats_keyvalues(XPRINTF xpf)
+{
+  struct profile_total *stats;
+  
+  xprintf(xpf, "syscalls.polls=%u\n", syscall_counters.polls);
+  xprintf(xpf, "syscalls.receives=%u\n", syscall_counters.receives);
+  xprintf(xpf, "syscalls.sends=%u\n", syscall_counters.sends);
+  xprintf(xpf, "syscalls.fcntls=%u\n", syscall_counters.fcntls);
+  for (stats = stats_head; stats; stats = stats->_next){
+    if (!stats->calls)
+      continue;
+#define KEY(X) xputs("function.", xpf); key_name(xpf, stats->name); xputs("." X "=", xpf)
+    KEY("calls"); xprintf(xpf, "%d\n", stats->calls);
+    KEY("total_ns"); xprintf(xpf, "%lld\n", (long long) stats->total_time);
+    KEY("child_ns"); xprintf(xpf, "%lld\n", (long long) stats->child_time);
+    KEY("max_ns"); xprintf(xpf, "%lld\n", (long long) stats->max_time);
+    KEY("p50_ns"); xprintf(xpf, "%lld\n", (long long) fd_latency_percentile(stats, 50));
+    KEY("p99_ns"); xprintf(xpf, "%lld\n", (long long) fd_latency_percentile(stats, 99));
+    KEY("max_latency_ns"); xprintf(xpf, "%lld\n", (long long) stats->max_latency);
+    if (stats->alarm_calls){
+      KEY("late_calls"); xprintf(xpf, "%d\n", stats->alarm_calls);
+      KEY("max_late_ms"); xprintf(xpf, "%lld\n", (long long) stats->max_lateness);
+    }
+    if (stats->packet_batches){
+      KEY("packet_batches"); xprintf(xpf, "%d\n", stats->packet_batches);
+      KEY("packets"); xprintf(xpf, "%d\n", stats->packets);
+    }
+#undef KEY
+  }
+}
+
+/* Replace the instance's timing.stats file with the current stats */
+static int fd_writestats()
+{
+  char path[1024], temp[1024];
+  if (!FORM_SERVAL_INSTANCE_PATH(path, "timing.stats")
+    || !FORM_SERVAL_INSTANCE_PATH(temp, "timing.stats.temp"))
+    return -1;
+  FILE *f = fopen(temp, "w");
+  if (!f)
+    return WHYF_perror("fopen(%s)", temp);
+  fd_dumpstats(XPRINTF_STDIO(f));
+  if (fclose(f) == EOF)
+    return WHYF_perror("fclose(%s)", temp);
+  if (rename(temp, path) == -1)
+    return WHYF_perror("rename(%s, %s)", temp, path);
+  return 0;
+}
+
 void fd_periodicstats(struct sched_ent *alarm)
 {
   fd_showstats();
+  fd_writestats();
   fd_clearstats();  
   alarm->alarm = gettime_ms()+3000;
   alarm->deadline = alarm->alarm+1000;
@@ -182,28 +349,43 @@ void dump_stack(){
 
 int fd_func_enter(struct call_stats *this_call)
 {
-  this_call->enter_time=gettime_ms();
+  this_call->enter_time=gettime_ns();
   this_call->child_time=0;
   this_call->prev = current_call;
   current_call = this_call;
   return 0;
 }
 
+static void fd_stat_register(struct profile_total *s)
+{
+  if (!s->_initialised){
+    s->_initialised=1;
+    s->_next = stats_head;
+    fd_clearstat(s);
+    stats_head = s;
+  }
+}
+
+// record how many packets were read or sent in one go by a function that batches them
+void fd_count_packets(struct profile_total *s, int count)
+{
+  fd_stat_register(s);
+  s->packet_batches++;
+  s->packets+=count;
+  if (count>s->max_packets) s->max_packets=count;
+}
+
 int fd_func_exit(struct call_stats *this_call)
 {
   if (current_call != this_call)
     WHYF("stack mismatch, exited through %s()",this_call->totals->name);
   
-  time_ms_t now = gettime_ms();
-  time_ms_t elapsed = now - this_call->enter_time;
+  time_ns_t now = gettime_ns();
+  time_ns_t elapsed = now - this_call->enter_time;
   current_call = this_call->prev;
   
-  if (this_call->totals && !this_call->totals->_initialised){
-    this_call->totals->_initialised=1;
-    this_call->totals->_next = stats_head;
-    fd_clearstat(this_call->totals);
-    stats_head = this_call->totals;
-  }
+  if (this_call->totals)
+    fd_stat_register(this_call->totals);
   
   if (current_call)
     current_call->child_time+=elapsed;
@@ -216,6 +398,10 @@ int fd_func_exit(struct call_stats *this_call)
     this_call->totals->calls++;
     
     if (elapsed>this_call->totals->max_time) this_call->totals->max_time=elapsed;
+    
+    time_ns_t latency = elapsed + this_call->child_time;
+    this_call->totals->latency[latency_bucket(latency)]++;
+    if (latency>this_call->totals->max_latency) this_call->totals->max_latency=latency;
   }
   
   return 0;
@@ -184,6 +184,18 @@ typedef struct sqlite_retry_state {
 
 sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int otherLimit, int otherSleep);
 
+/* Number of times any SQL query has been retried because the database was busy */
+extern unsigned int sqlite_busy_retries;
+
+/* Counters for file fetches, reported by the stats command */
+struct rhizome_fetch_counters {
+  unsigned int started;
+  unsigned int completed;
+  unsigned int failed;
+  unsigned long long bytes;
+};
+extern struct rhizome_fetch_counters rhizome_fetch_counters;
+
 #define SQLITE_RETRY_STATE_DEFAULT sqlite_retry_state_init(-1,-1,-1,-1)
 
 int rhizome_write_manifest_file(rhizome_manifest *m, const char *filename);
@@ -221,10 +221,13 @@ sqlite_retry_state sqlite_retry_state_init(int serverLimit, int serverSleep, int
     };
 }
 
+unsigned int sqlite_busy_retries = 0;
+
 int _sqlite_retry(struct __sourceloc where, sqlite_retry_state *retry, const char *action)
 {
   time_ms_t now = gettime_ms();
   ++retry->busytries;
+  ++sqlite_busy_retries;
   if (retry->start == -1)
     retry->start = now;
   else
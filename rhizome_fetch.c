@@ -53,6 +53,7 @@ struct profile_total fetch_stats;
 /* List of queued transfers */
 #define MAX_QUEUED_FILES 4
 int rhizome_file_fetch_queue_count=0;
+struct rhizome_fetch_counters rhizome_fetch_counters;
 rhizome_file_fetch_record file_fetch_queue[MAX_QUEUED_FILES];
 /* 
    Queue a manifest for importing.
@@ -711,6 +712,7 @@ int rhizome_queue_manifest_import(rhizome_manifest *m, struct sockaddr_in *peeri
 	schedule(&q->alarm);
 
 	rhizome_file_fetch_queue_count++;
+	rhizome_fetch_counters.started++;
 	if (debug & DEBUG_RHIZOME_RX)
 	  DEBUGF("Queued file for fetching into %s (%d in queue)",
 	      q->manifest->dataFileName, rhizome_file_fetch_queue_count);
@@ -742,8 +744,11 @@ int rhizome_fetch_close(rhizome_file_fetch_record *q){
   /* Free ephemeral data */
   if (q->file) fclose(q->file);
   q->file=NULL;
-  if (q->manifest) 
+  if (q->manifest){
+    // the manifest is only released early once the whole file has been received
+    rhizome_fetch_counters.failed++;
     rhizome_manifest_free(q->manifest);
+  }
   q->manifest=NULL;
   
   /* close socket and stop watching it */
@@ -796,9 +801,11 @@ void rhizome_write_content(rhizome_file_fetch_record *q, char *buffer, int bytes
     return;
   }
   q->file_ofs+=bytes;
+  rhizome_fetch_counters.bytes+=bytes;
   
   if (q->file_ofs>=q->file_len)
   {
+    rhizome_fetch_counters.completed++;
     /* got all of file */
     if (debug & DEBUG_RHIZOME_RX)
       DEBUGF("Received all of file via rhizome -- now to import it");
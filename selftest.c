@@ -0,0 +1,456 @@
+/*
+Serval Distributed Numbering Architecture (DNA)
+Copyright (C) 2012 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Self tests of servald's internals, run by tests/server through "servald test self <name>".
+
+  These cover what running instances can't be made to do on demand; give a subscriber's index
+  to someone else behind a neighbour's back, queue an exact burst of frames, keep two traffic
+  classes busy on a slow link, or receive netlink messages the kernel didn't send. Each one
+  prints what happened as key:value pairs.
+ */
+
+#include "serval.h"
+#include "overlay_address.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
+#include "cli.h"
+
+// starting time of the virtual clock
+#define SELFTEST_EPOCH 1000000000000LL
+// the most alarms we run without the clock moving
+#define SELFTEST_MAX_CALLS 1000
+
+static time_ms_t selftest_clock;
+
+/*
+  Subscriber indexes.
+ */
+
+/* Write a subscriber's address in a packet of its own on one link, and if it is delivered, read it
+   back as the neighbour would. Returns the subscriber the neighbour resolved, if any.
+ */
+static struct subscriber *sid_index_send(overlay_interface *interface, struct subscriber *neighbour,
+					 struct subscriber *subscriber, int sequence, int deliver,
+					 int *index, int *bare, struct decode_context *context)
+{
+  unsigned char bytes[64];
+  struct overlay_buffer b;
+  ob_init_static(&b, bytes, sizeof bytes);
+  overlay_address_clear();
+  overlay_address_set_link(interface, sequence);
+  if (overlay_address_append(&b, subscriber))
+    return NULL;
+  int len=b.position;
+  *bare = bytes[0]==OA_CODE_INDEX;
+  *index = bytes[1];
+  if (!deliver)
+    return NULL;
+  
+  struct subscriber *found=NULL;
+  ob_init_static(&b, bytes, len);
+  ob_limitsize(&b, len);
+  overlay_address_clear();
+  overlay_address_set_sender(neighbour);
+  bzero(context, sizeof(struct decode_context));
+  context->interface=interface;
+  if (overlay_address_parse(context, &b, NULL, &found) || context->invalid_addresses)
+    found=NULL;
+  return found;
+}
+
+/* Tag a subscriber with an index on a link, give the index to someone else without the receiver
+   hearing about it, and make sure the receiver doesn't take the reused index to mean the old
+   subscriber. Also make sure an index isn't used on its own after being tagged in unicast packets,
+   or in frames that didn't fit in their packet.
+ */
+static int selftest_sid_index()
+{
+  if (overlay_interface_table_init())
+    return -1;
+  overlay_interface *interface = &overlay_interfaces[0];
+  bzero(interface, sizeof(overlay_interface));
+  strncpy(interface->name, ">index", sizeof(interface->name));
+  interface->state = INTERFACE_STATE_UP;
+  overlay_interface_count = 1;
+  
+  srandom(1);
+  // every subscriber but the neighbour and the unicast one is probed for in the same slots
+  struct subscriber *subscribers[11];
+  unsigned char sid[SID_SIZE];
+  int i, j;
+  for (i=0;i<11;i++){
+    for (j=0;j<SID_SIZE;j++)
+      sid[j]=random();
+    sid[SID_SIZE -1] = i==0 ? 0x00 : i==1 ? 0x80 : 0x40;
+    if (!(subscribers[i] = find_subscriber(sid, SID_SIZE, 1)))
+      return WHY("Could not add subscriber");
+    subscribers[i]->send_full=0;
+  }
+  struct subscriber *neighbour=subscribers[0], *unicast=subscribers[1], *old=subscribers[2], *reuser=subscribers[10];
+  struct decode_context decode;
+  int sequence=1, index, old_index, bare, unicast_bare=0;
+  struct subscriber *found;
+  
+  // a frame that doesn't fit in the packet is taken out again, and its addresses weren't sent
+  struct overlay_frame frame;
+  bzero(&frame, sizeof frame);
+  frame.type=OF_TYPE_DATA;
+  frame.ttl=1;
+  frame.destination=old;
+  frame.source=neighbour;
+  if (!(frame.payload=ob_new()) || !ob_append_space(frame.payload, 64))
+    return WHY("Could not build frame");
+  unsigned char bytes[48];
+  struct overlay_buffer packet;
+  int rewound=0;
+  for (i=0;i<=OVERLAY_SID_INDEX_ANNOUNCE;i++){
+    ob_init_static(&packet, bytes, sizeof bytes);
+    ob_limitsize(&packet, sizeof bytes);
+    overlay_address_clear();
+    overlay_address_set_link(interface, sequence++);
+    if (overlay_frame_append_payload(interface, &frame, neighbour, &packet) && packet.position==0)
+      rewound++;
+  }
+  ob_free(frame.payload);
+  cli_printf("rewound:%d\n", rewound);
+  cli_printf("rewound_bytes_saved:%lld\n", interface->address_bytes_saved);
+  sid_index_send(interface, neighbour, old, sequence++, 1, &index, &bare, &decode);
+  cli_printf("tagged_after_rewind:%d\n", !bare);
+  
+  for (i=0;i<OVERLAY_SID_INDEX_ANNOUNCE;i++)
+    sid_index_send(interface, neighbour, old, sequence++, 1, &old_index, &bare, &decode);
+  found = sid_index_send(interface, neighbour, old, sequence++, 1, &index, &bare, &decode);
+  cli_printf("indexed:%d\n", bare && found==old);
+  
+  for (i=0;i<=OVERLAY_SID_INDEX_ANNOUNCE;i++){
+    sid_index_send(interface, neighbour, unicast, -1, 1, &index, &bare, &decode);
+    unicast_bare+=bare;
+  }
+  cli_printf("indexed_after_unicast:%d\n", unicast_bare);
+  
+  // fill the other slots, then the least recently used one goes to a subscriber the receiver never hears about
+  for (i=3;i<10;i++)
+    sid_index_send(interface, neighbour, subscribers[i], sequence++, 1, &index, &bare, &decode);
+  for (i=0;i<OVERLAY_SID_INDEX_ANNOUNCE;i++)
+    sid_index_send(interface, neighbour, reuser, sequence++, 0, &index, &bare, &decode);
+  cli_printf("reused:%d\n", index==old_index);
+  found = sid_index_send(interface, neighbour, reuser, sequence++, 1, &index, &bare, &decode);
+  cli_printf("stale_resolved:%d\n", bare && found==old);
+  cli_printf("stale_explained:%d\n", bare && !found && decode.please_explain);
+  
+  // answer the please explain, so the sender tags the index again
+  if (decode.please_explain){
+    struct overlay_buffer *payload=decode.please_explain->payload;
+    int len=payload->position;
+    payload->position=0;
+    ob_limitsize(payload, len);
+    process_explain(decode.please_explain);
+    op_free(decode.please_explain);
+  }
+  found = sid_index_send(interface, neighbour, reuser, sequence++, 1, &index, &bare, &decode);
+  cli_printf("resolved_after_explain:%d\n", !bare && found==reuser);
+  return 0;
+}
+
+/*
+  Packing.
+
+  Runs our own queues and packet assembly against a virtual clock, with simulated interfaces
+  that count what they send instead of carrying it anywhere.
+ */
+
+// how many frames we queue, and the range of their payload sizes
+#define PACK_FRAMES 100
+#define PACK_MIN_PAYLOAD 20
+#define PACK_MAX_PAYLOAD 500
+
+static int pack_transmit(overlay_interface *interface, unsigned char *bytes, int len)
+{
+  return 0;
+}
+
+static int pack_enqueue(int q, int len)
+{
+  struct overlay_frame *frame=op_new();
+  if (!frame)
+    return WHY("Could not allocate frame");
+  frame->type=OF_TYPE_DATA;
+  frame->ttl=1;
+  frame->source=my_subscriber;
+  frame->payload=ob_new();
+  while (frame->payload && frame->payload->position<len)
+    ob_append_byte(frame->payload, random());
+  if (!frame->payload || overlay_payload_enqueue(q, frame)){
+    op_free(frame);
+    return WHY("Could not queue frame");
+  }
+  return 0;
+}
+
+static int pack_queued()
+{
+  int q, count=0;
+  for (q=0;q<OQ_MAX;q++)
+    count+=overlay_tx[q].length;
+  return count;
+}
+
+/* Start our own queues, an identity and some simulated interfaces that don't tick,
+   so only the frames we queue go in their packets */
+static int pack_init(int interface_count, int bits_per_second, unsigned int seed)
+{
+  selftest_clock=SELFTEST_EPOCH;
+  simulated_clock=&selftest_clock;
+  overlay_simulated_transmit=pack_transmit;
+  srandom(seed);
+  if (overlay_interface_table_init())
+    return -1;
+  overlay_queue_init();
+
+  unsigned char sid[SID_SIZE];
+  int i;
+  for (i=0;i<SID_SIZE;i++)
+    sid[i]=random();
+  while (sid[0]<0x10)
+    sid[0]=random();
+  my_subscriber = find_subscriber(sid, SID_SIZE, 1);
+  if (!my_subscriber)
+    return WHY("Could not create subscriber");
+  set_reachable(my_subscriber, REACHABLE_SELF);
+
+  for (i=0;i<interface_count;i++){
+    char name[16];
+    snprintf(name, sizeof name, "pack%d", i);
+    if (overlay_interface_init_simulated(name, bits_per_second))
+      return WHYF("Could not start simulated interface %s", name);
+    unschedule(&overlay_interfaces[i].alarm);
+  }
+  return 0;
+}
+
+/* Queue a burst of ordinary frames to broadcast over some number of interfaces,
+   send them all, and report how full the packets were */
+static int selftest_packing(int interface_count, unsigned int seed)
+{
+  if (interface_count<1)
+    return WHY("At least one interface is required");
+  // fast enough that nothing waits for tokens
+  if (pack_init(interface_count, 1000000000, seed))
+    return -1;
+
+  int i;
+  for (i=0;i<PACK_FRAMES;i++)
+    if (pack_enqueue(OQ_ORDINARY, PACK_MIN_PAYLOAD + random()%(PACK_MAX_PAYLOAD - PACK_MIN_PAYLOAD + 1)))
+      return -1;
+
+  while (pack_queued() && selftest_clock < SELFTEST_EPOCH + 10000){
+    selftest_clock++;
+    fd_run_alarms(SELFTEST_MAX_CALLS);
+  }
+
+  cli_printf("frames:%d\n", PACK_FRAMES);
+  cli_printf("unsent:%d\n", pack_queued());
+  for (i=0;i<interface_count;i++){
+    overlay_interface *interface=&overlay_interfaces[i];
+    // the fewest packets those bytes could have gone in
+    int fewest = (interface->tx_bytes + interface->mtu - 1) / interface->mtu;
+    cli_printf("interface.%d.frames_packed:%u\n", i, interface->tx_frames_packed);
+    cli_printf("interface.%d.packets:%d\n", i, (int)interface->tx_packets);
+    cli_printf("interface.%d.extra_packets:%d\n", i, (int)interface->tx_packets - fewest);
+    cli_printf("interface.%d.fill_ratio:%.3f\n", i,
+	       interface->tx_fill_capacity?(double)interface->tx_fill_bytes / interface->tx_fill_capacity:0.0);
+  }
+  return 0;
+}
+
+/* Keep the ordinary and opportunistic queues full of frames the same size, on an interface
+   too slow to send them all, and report the share of the bytes each class managed to send */
+static int selftest_fairness(int seconds, unsigned int seed)
+{
+  // about 20 full packets a second
+  if (pack_init(1, 200000, seed))
+    return -1;
+
+  int classes[]={OQ_ORDINARY, OQ_OPPORTUNISTIC};
+  int i;
+  time_ms_t end = SELFTEST_EPOCH + seconds * 1000LL;
+  while (selftest_clock < end){
+    for (i=0;i<2;i++)
+      while (overlay_tx[classes[i]].length < overlay_tx[classes[i]].maxLength / 2)
+	if (pack_enqueue(classes[i], 100))
+	  return -1;
+    selftest_clock++;
+    fd_run_alarms(SELFTEST_MAX_CALLS);
+  }
+
+  for (i=0;i<2;i++){
+    overlay_txqueue *queue=&overlay_tx[classes[i]];
+    cli_printf("%s.weight:%d\n", overlay_queue_names[classes[i]], queue->weight);
+    cli_printf("%s.sent_bytes:%llu\n", overlay_queue_names[classes[i]], queue->sent_bytes);
+  }
+  unsigned long long opportunistic = overlay_tx[OQ_OPPORTUNISTIC].sent_bytes;
+  cli_printf("share:%.2f\n", opportunistic?(double)overlay_tx[OQ_ORDINARY].sent_bytes / opportunistic:0.0);
+  cli_printf("fill_ratio:%.3f\n", overlay_interfaces[0].tx_fill_capacity?
+	     (double)overlay_interfaces[0].tx_fill_bytes / overlay_interfaces[0].tx_fill_capacity:0.0);
+  return 0;
+}
+
+/*
+  Netlink.
+ */
+
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_RTNETLINK_H)
+/* Build a link message like the kernel would send */
+static int netlink_test_link(unsigned char *buff, int type, int index, const char *name, unsigned flags)
+{
+  struct nlmsghdr *header = (struct nlmsghdr *)buff;
+  bzero(buff, NLMSG_SPACE(sizeof(struct ifinfomsg)) + RTA_SPACE(IFNAMSIZ));
+  struct ifinfomsg *msg = (struct ifinfomsg *)NLMSG_DATA(header);
+  msg->ifi_family = AF_UNSPEC;
+  msg->ifi_index = index;
+  msg->ifi_flags = flags;
+  struct rtattr *rta = IFLA_RTA(msg);
+  rta->rta_type = IFLA_IFNAME;
+  rta->rta_len = RTA_LENGTH(strlen(name)+1);
+  strcpy((char *)RTA_DATA(rta), name);
+  header->nlmsg_type = type;
+  header->nlmsg_len = NLMSG_SPACE(sizeof(struct ifinfomsg)) + RTA_ALIGN(rta->rta_len);
+  return header->nlmsg_len;
+}
+
+/* Build a message adding a broadcast address to a link */
+static int netlink_test_address(unsigned char *buff, const char *name, in_addr_t local, int prefixlen)
+{
+  struct nlmsghdr *header = (struct nlmsghdr *)buff;
+  bzero(buff, NLMSG_SPACE(sizeof(struct ifaddrmsg)) + 2*RTA_SPACE(sizeof(struct in_addr)) + RTA_SPACE(IFNAMSIZ));
+  struct ifaddrmsg *msg = (struct ifaddrmsg *)NLMSG_DATA(header);
+  msg->ifa_family = AF_INET;
+  msg->ifa_prefixlen = prefixlen;
+  int len = NLMSG_SPACE(sizeof(struct ifaddrmsg));
+  struct rtattr *rta = IFA_RTA(msg);
+  rta->rta_type = IFA_LOCAL;
+  rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+  memcpy(RTA_DATA(rta), &local, sizeof local);
+  len += RTA_ALIGN(rta->rta_len);
+  rta = (struct rtattr *)(buff + len);
+  rta->rta_type = IFA_BROADCAST;
+  rta->rta_len = RTA_LENGTH(sizeof(struct in_addr));
+  local |= htonl(0xFFFFFFFFu >> prefixlen);
+  memcpy(RTA_DATA(rta), &local, sizeof local);
+  len += RTA_ALIGN(rta->rta_len);
+  rta = (struct rtattr *)(buff + len);
+  rta->rta_type = IFA_LABEL;
+  rta->rta_len = RTA_LENGTH(strlen(name)+1);
+  strcpy((char *)RTA_DATA(rta), name);
+  len += RTA_ALIGN(rta->rta_len);
+  header->nlmsg_type = RTM_NEWADDR;
+  header->nlmsg_len = len;
+  return len;
+}
+
+/* Did the listener ask for a dump of every address? */
+static int netlink_test_dumped(int fd)
+{
+  unsigned char buff[1024];
+  int dumped=0;
+  ssize_t len;
+  while ((len = recv(fd, buff, sizeof buff, MSG_DONTWAIT)) > 0)
+    if (((struct nlmsghdr *)buff)->nlmsg_type == RTM_GETADDR)
+      dumped=1;
+  return dumped;
+}
+#endif
+
+/* Feed the netlink listener messages about a link coming and going, some of them from
+   another process, and check it only asks for addresses when the link comes up */
+static int selftest_netlink()
+{
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_RTNETLINK_H)
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds)==-1)
+    return WHY_perror("socketpair");
+  overlay_netlink_attach(fds[0]);
+  
+  unsigned char buff[1024];
+  struct nlmsghdr done;
+  bzero(&done, sizeof done);
+  done.nlmsg_type = NLMSG_DONE;
+  done.nlmsg_len = NLMSG_LENGTH(0);
+  unsigned up = IFF_UP | IFF_RUNNING;
+  int len;
+  
+  len = netlink_test_link(buff, RTM_NEWLINK, 9, "test0", up);
+  overlay_netlink_receive(buff, len, 0);
+  cli_printf("dump_on_link_up:%d\n", netlink_test_dumped(fds[1]));
+  overlay_netlink_receive((unsigned char *)&done, done.nlmsg_len, 0);
+  
+  // the kernel tells us about links for all sorts of reasons, like their statistics changing
+  overlay_netlink_receive(buff, len, 0);
+  cli_printf("dump_on_unchanged_link:%d\n", netlink_test_dumped(fds[1]));
+  
+  // anyone can send us netlink messages, but only the kernel should be believed
+  len = netlink_test_link(buff, RTM_DELLINK, 9, "test0", 0);
+  overlay_netlink_receive(buff, len, 4242);
+  len = netlink_test_address(buff, "test0", inet_addr("10.9.0.1"), 24);
+  overlay_netlink_receive(buff, len, 4242);
+  overlay_netlink_receive(buff, len, 0);
+  
+  len = netlink_test_link(buff, RTM_NEWLINK, 9, "test0", IFF_UP);
+  overlay_netlink_receive(buff, len, 0);
+  len = netlink_test_link(buff, RTM_NEWLINK, 9, "test0", up);
+  overlay_netlink_receive(buff, len, 0);
+  cli_printf("dump_on_link_return:%d\n", netlink_test_dumped(fds[1]));
+  
+  struct mallocbuf mb = STRUCT_MALLOCBUF_NULL;
+  overlay_netlink_stats_keyvalues(XPRINTF_MALLOCBUF(&mb));
+  if (mb.buffer){
+    cli_keyvalues(mb.buffer);
+    free(mb.buffer);
+  }
+  close(fds[1]);
+  return 0;
+#else
+  return WHY("Netlink is not supported on this platform");
+#endif
+}
+
+int app_selftest(int argc, const char *const *argv, struct command_line_option *o, void *context)
+{
+  if (debug & DEBUG_VERBOSE) DEBUG_argv("command", argc, argv);
+  const char *name, *arg, *seed;
+  if (cli_arg(argc, argv, o, "name", &name, NULL, "") == -1
+    || cli_arg(argc, argv, o, "arg", &arg, NULL, "") == -1
+    || cli_arg(argc, argv, o, "seed", &seed, NULL, "1") == -1)
+    return -1;
+  unsigned int iseed=strtoul(seed, NULL, 10);
+  if (strcasecmp(name, "sid-index")==0)
+    return selftest_sid_index();
+  if (strcasecmp(name, "packing")==0)
+    return selftest_packing(*arg?atoi(arg):1, iseed);
+  if (strcasecmp(name, "fairness")==0){
+    int seconds=*arg?atoi(arg):20;
+    if (seconds<1)
+      return WHY("Seconds must be at least 1");
+    return selftest_fairness(seconds, iseed);
+  }
+  if (strcasecmp(name, "netlink")==0)
+    return selftest_netlink();
+  return WHYF("Unknown self test %s, expected sid-index, packing, fairness or netlink", name);
+}
@@ -135,6 +135,14 @@ struct in_addr {
  */
 typedef long long time_ms_t;
 
+/* Durations measured for profiling are in nanoseconds from a monotonic clock,
+ * so they are unaffected when the wall clock is stepped.  The gettime_ns()
+ * function returns this value, which is only meaningful relative to other
+ * values it has returned.  The time_ns_t typedef should be used wherever
+ * it is handled or stored.
+ */
+typedef long long time_ns_t;
+
 /* bzero(3) is deprecated in favour of memset(3). */
 #define bzero(addr,len) memset((addr), 0, (len))
 
@@ -287,30 +295,49 @@ void keyring_identity_extract(const keyring_identity *id, const unsigned char **
 
 extern int sock;
 
+/* Call latencies are counted in log scale buckets, PROFILE_BUCKETS_PER_OCTAVE for
+   each power of two nanoseconds, up to about 18 minutes */
+#define PROFILE_BUCKETS_PER_OCTAVE 4
+#define PROFILE_BUCKETS (40*PROFILE_BUCKETS_PER_OCTAVE)
+
 struct profile_total {
   struct profile_total *_next;
   int _initialised;
   const char *name;
-  time_ms_t max_time;
-  time_ms_t total_time;
-  time_ms_t child_time;
+  // time spent in this function, not counting other profiled functions it called
+  time_ns_t max_time;
+  time_ns_t total_time;
+  time_ns_t child_time;
   int calls;
+  // time from entry to exit of each call, including children
+  time_ns_t max_latency;
+  unsigned int latency[PROFILE_BUCKETS];
+  // how long after their .alarm time scheduled alarms were called
+  int alarm_calls;
+  time_ms_t max_lateness;
+  time_ms_t total_lateness;
+  // how many packets were handled per batch, for functions that read or send in batches
+  int packet_batches;
+  int packets;
+  int max_packets;
 };
 
 struct call_stats{
-  time_ms_t enter_time;
-  time_ms_t child_time;
+  time_ns_t enter_time;
+  time_ns_t child_time;
   struct profile_total *totals;
   struct call_stats *prev;
 };
 
 struct sched_ent;
+struct sched_heap;
 
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next;
-  struct sched_ent *_prev;
+  // the priority queue this alarm is waiting in (if any), and its position within that queue
+  struct sched_heap *_heap;
+  int _heap_index;
   
   ALARM_FUNCP function;
   void *context;
@@ -325,7 +352,7 @@ struct sched_ent{
 
 struct overlay_buffer;
 
-#define STRUCT_SCHED_ENT_UNUSED ((struct sched_ent){NULL, NULL, NULL, NULL, {-1, 0, 0}, 0LL, 0LL, NULL, -1})
+#define STRUCT_SCHED_ENT_UNUSED ((struct sched_ent){NULL, -1, NULL, NULL, {-1, 0, 0}, 0LL, 0LL, NULL, -1})
 
 extern int overlayMode;
 
@@ -339,6 +366,12 @@ typedef struct overlay_interface {
   char name[80];
   int recv_offset;
   int fileP;
+  /* A dummy interface file may hold a ring of records mapped into memory, see overlay_dummy_ring_open().
+   Then alarm.poll.fd is watching for changes to ring_fd, or is -1 if we have to poll the ring */
+  struct dummy_ring_header *ring;
+  size_t ring_size;
+  int ring_fd;
+  unsigned long long ring_next;
   int bits_per_second;
   int port;
   int type;
@@ -361,10 +394,17 @@ typedef struct overlay_interface {
   int ticks_since_sent_full_address;
   
   /* sequence number of last packet sent on this interface.
-   Used to allow NACKs that can request retransmission of recent packets.
+   Sent in the version 2 envelope header of broadcast packets so that receivers can detect lost packets,
+   and NACK them to request retransmission of the frames they carried.
    */
   int sequence_number;
-  /* XXX need recent packet buffers to support the above */
+  /* When we last heard a peer on this interface that does, or doesn't, understand the version 2 envelope */
+  time_ms_t envelope_peer_heard;
+  time_ms_t legacy_peer_heard;
+  /* frames sent in recent packets, see overlay_nack.c */
+  struct overlay_retransmit *retransmit;
+  /* subscribers we have given a one byte index on this interface, see overlay_address.c */
+  struct overlay_sid_index *sid_index;
   
   /* We need to make sure that interface name and broadcast address is unique for all interfaces that are UP.
    We bind a separate socket per interface / broadcast address Broadcast address and netmask, if known
@@ -384,12 +424,64 @@ typedef struct overlay_interface {
      But if it comes back up again, we should try to reuse this structure, even if the broadcast address has changed.
    */
   int state;  
+  /* Chains of the hash indexes used to find UP interfaces by subnet and by name, see overlay_interface_find() */
+  struct overlay_interface *next_by_subnet;
+  struct overlay_interface *next_by_name;
+  int prefix_len;
+  /* When the interface last came up, and how long it then took to send our first self announcement,
+   or -1 until we have */
+  time_ms_t up_at;
+  int up_to_announce_ms;
+  
+  /* Traffic counters, reported by the stats command */
+  unsigned int rx_packets;
+  unsigned int tx_packets;
+  unsigned long long rx_bytes;
+  unsigned long long tx_bytes;
+  /* frames decoded from the packets we received */
+  unsigned int rx_frames;
+  /* our own packets, reflected back to us and dropped after reading the envelope */
+  unsigned int rx_own_packets;
+  
+  /* Token bucket pacing our transmissions to bits_per_second, measured in bytes.
+   The bucket holds at most one MTU. Voice traffic may borrow up to one MTU ahead of the rate,
+   so tokens can go negative. */
+  long long tokens;
+  time_ms_t tokens_updated;
+  /* frames that had to wait for tokens, and their payload bytes */
+  unsigned int deferred_frames;
+  unsigned long long deferred_bytes;
+  /* transmit rate measured over roughly the last second */
+  time_ms_t rate_window_start;
+  unsigned long long rate_window_bytes;
+  unsigned int achieved_bits_per_second;
+  
+  /* Reliability counters; extra copies of unicast frames sent blindly over links that can't NACK,
+   NACKs sent and received, and frames queued again in reply to a NACK */
+  unsigned int copies_sent;
+  unsigned int nacks_sent;
+  unsigned int nacks_received;
+  unsigned int retransmitted_frames;
+  
+  /* Address bytes saved by using indexes instead of abbreviated SIDs, less the bytes spent tagging them,
+   and the number of times a neighbour asked us to tag an index again */
+  long long address_bytes_saved;
+  unsigned int index_resyncs;
+  
+  /* Frames packed into our packets, and the times a frame didn't fit in the packet being assembled.
+   Bytes assembled into packets, against the MTU of each packet, give the average fill ratio */
+  unsigned int tx_frames_packed;
+  unsigned int tx_frames_skipped;
+  unsigned long long tx_fill_bytes;
+  unsigned long long tx_fill_capacity;
 } overlay_interface;
 
-/* Maximum interface count is rather arbitrary.
+/* The interface table is allocated when the server starts, with room for "interface.max" interfaces.
  Memory consumption is O(n) with respect to this parameter, so let's not make it too big for now.
  */
-extern overlay_interface overlay_interfaces[OVERLAY_MAX_INTERFACES];
+extern overlay_interface *overlay_interfaces;
+extern int overlay_max_interfaces;
+int overlay_interface_table_init();
 extern int overlay_last_interface_number; // used to remember where a packet came from
 extern unsigned int overlay_sequence_number;
 
@@ -434,6 +526,25 @@ typedef struct overlay_txqueue {
    Frames older than the latency target will get dropped. */
   int latencyTarget;
   
+  /* Frames refused because the queue was full, and frames dropped after waiting longer than latencyTarget */
+  unsigned int dropped;
+  unsigned int expired;
+  
+  /* Classes other than voice share the link by deficit round robin. Each turn a class gets weight
+   times OVERLAY_DRR_QUANTUM bytes of credit, and may only add frames to a packet while it has credit */
+  int weight;
+  int deficit;
+  
+  /* Frames sent from this queue, their bytes, and how long they waited before they were first sent */
+  unsigned int sent_frames;
+  unsigned long long sent_bytes;
+  unsigned long long delay_total_ms;
+  unsigned int delay_max_ms;
+  /* bytes sent from this queue over roughly the last second */
+  time_ms_t rate_window_start;
+  unsigned long long rate_window_bytes;
+  unsigned int achieved_bits_per_second;
+  
   /* XXX Need to initialise these:
    Real-time queue for voice (<200ms ?)
    Real-time queue for video (<200ms ?) (lower priority than voice)
@@ -446,9 +557,23 @@ typedef struct overlay_txqueue {
 
 
 extern overlay_txqueue overlay_tx[OQ_MAX];
+extern const char *overlay_queue_names[OQ_MAX];
 
 ssize_t recvwithttl(int sock, unsigned char *buffer, size_t bufferlen, int *ttl, struct sockaddr *recvaddr, socklen_t *recvaddrlen);
 
+#define RECV_BATCH_MAX 32
+struct received_packet {
+  // supplied by the caller
+  unsigned char *buffer;
+  size_t bufferlen;
+  // filled in by recvwithttl_batch()
+  ssize_t len;
+  int ttl;
+  struct sockaddr recvaddr;
+  socklen_t recvaddrlen;
+};
+int recvwithttl_batch(int sock, struct received_packet *packets, int count);
+
 int is_xsubstring(const char *text, int len);
 int is_xstring(const char *text, int len);
 char *tohex(char *dstHex, const unsigned char *srcBinary, size_t bytes);
@@ -474,6 +599,8 @@ int respondSimple(keyring_identity *id,
 		  unsigned char *transaction_id,int recvttl,
 		  struct sockaddr *recvaddr,int cryptoFlags);
 time_ms_t gettime_ms();
+extern time_ms_t *simulated_clock;
+time_ns_t gettime_ns();
 time_ms_t sleep_ms(time_ms_t milliseconds);
 int server_pid();
 void server_save_argv(int argc, const char *const *argv);
@@ -553,6 +680,7 @@ int extractRequest(unsigned char *packet,int *packet_ofs,int packet_len,
 		   int *itemId,int *instance,unsigned char *value,
 		   int *start_offset,int *max_offset,int *flags);
 int dropPacketP(size_t packet_len);
+int simulate_mesh(int node_count, time_ms_t duration_ms, const char *topology, unsigned int seed);
 int additionalPeer(char *peer);
 int readRoutingTable(struct in_addr peers[],int *peer_count,int peer_max);
 int readBatmanPeerFile(char *file_path,struct in_addr peers[],int *peer_count,int peer_max);
@@ -561,6 +689,7 @@ int asteriskObtainGateway(char *requestor_sid,char *did,char *uri_out);
 int packetOkDNA(unsigned char *packet,int len,unsigned char *transaction_id,
 		int recvttl,struct sockaddr *recvaddr, size_t recvaddrlen,int parseP);
 int overlay_forward_payload(struct overlay_frame *f);
+extern int overlay_process_data_frames;
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    unsigned char *transaction_id,int recvttl,
 		    struct sockaddr *recvaddr, size_t recvaddrlen,int parseP);
@@ -586,6 +715,8 @@ int overlay_add_selfannouncement();
 int overlay_frame_append_payload(overlay_interface *interface, struct overlay_frame *p, struct subscriber *next_hop, struct overlay_buffer *b);
 int overlay_interface_args(const char *arg);
 int overlay_sendto(struct sockaddr_in *recipientaddr,unsigned char *bytes,int len);
+extern int (*overlay_simulated_transmit)(overlay_interface *interface, unsigned char *bytes, int len);
+int overlay_interface_init_simulated(char *name, int speed_in_bits);
 int overlay_rhizome_add_advertisements(int interface_number,struct overlay_buffer *e);
 int overlay_add_local_identity(unsigned char *s);
 void overlay_update_queue_schedule(overlay_txqueue *queue, struct overlay_frame *frame);
@@ -619,21 +750,45 @@ typedef struct overlay_node {
   int best_observation;
   unsigned int last_first_hand_observation_time_millisec;
   time_ms_t last_observation_time_ms;
-  /* When did we last advertise this node on each interface, and what score
-     did we advertise? */
-  time_ms_t most_recent_advertisment_ms[OVERLAY_MAX_INTERFACES];
-  unsigned char most_recent_advertised_score[OVERLAY_MAX_INTERFACES];
   overlay_node_observation observations[OVERLAY_MAX_OBSERVATIONS];
 } overlay_node;
 
 int overlay_route_saw_selfannounce_ack(struct overlay_frame *f, time_ms_t now);
 int overlay_route_saw_selfannounce(struct overlay_frame *f, time_ms_t now);
+int overlay_route_saw_sequence(struct subscriber *subscriber, overlay_interface *interface, int sequence);
+void overlay_route_stats_keyvalues(XPRINTF xpf);
+void overlay_interface_saw_peer(overlay_interface *interface, int envelope_version, time_ms_t now);
+int overlay_retransmit_begin(overlay_interface *interface, int sequence);
+int overlay_retransmit_record(overlay_interface *interface, int sequence, int q,
+			      struct overlay_frame *frame, struct subscriber *next_hop);
+int overlay_nack_send(overlay_interface *interface, struct subscriber *neighbour, int first_sequence, int count);
+int overlay_nack_process(overlay_interface *interface, struct overlay_frame *f, time_ms_t now);
+void overlay_nack_mark_subscribers();
+
+#define CAPTURE_RX 0
+#define CAPTURE_TX 1
+extern int overlay_capture_dump_requested;
+int overlay_capture_init();
+void overlay_capture_packet(overlay_interface *interface, int direction, const struct sockaddr *peer,
+			    const unsigned char *bytes, size_t len);
+int overlay_capture_write_pcap();
+void overlay_capture_dump_check();
+void overlay_capture_stats_keyvalues(XPRINTF xpf);
+int overlay_netlink_init();
+int overlay_netlink_active();
+#if defined(HAVE_LINUX_NETLINK_H) && defined(HAVE_LINUX_RTNETLINK_H)
+void overlay_netlink_attach(int fd);
+void overlay_netlink_receive(unsigned char *buff, int len, uint32_t pid);
+#endif
+void overlay_netlink_stats_keyvalues(XPRINTF xpf);
 overlay_node *overlay_route_find_node(const unsigned char *sid,int prefixLen,int createP);
 unsigned int overlay_route_hash_sid(const unsigned char *sid);
 
 int packetEncipher(unsigned char *packet,int maxlen,int *len,int cryptoflags);
 int overlayServerMode();
+void overlay_queue_init();
 int overlay_payload_enqueue(int q, struct overlay_frame *p);
+int overlay_payload_enqueue_at(int q, struct overlay_frame *p, time_ms_t enqueued_at);
 int overlay_route_record_link( time_ms_t now,unsigned char *to,
 			      unsigned char *via,int sender_interface,
 			      unsigned int s1,unsigned int s2,int score,int gateways_en_route);
@@ -644,6 +799,8 @@ int ovleray_route_please_advertise(overlay_node *n);
 int overlay_route_saw_advertisements(int i, struct overlay_frame *f, time_ms_t now);
 int overlay_rhizome_saw_advertisements(int i, struct overlay_frame *f,  time_ms_t now);
 int overlay_route_please_advertise(overlay_node *n);
+void overlay_advertise_mark_subscribers();
+void overlay_route_mark_subscribers();
 int rhizome_server_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 int rhizome_saw_voice_traffic();
 int overlay_saw_mdp_containing_frame(struct overlay_frame *f, time_ms_t now);
@@ -697,6 +854,7 @@ int form_serval_instance_path(char * buf, size_t bufsiz, const char *path);
 int create_serval_instance_dir();
 
 int overlay_mdp_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
+void overlay_mdp_mark_subscribers();
 int overlay_mdp_reply_error(int sock,
 			    struct sockaddr_un *recvaddr,int recvaddrlen,
 			    int error_number,char *message);
@@ -747,6 +905,17 @@ typedef struct overlay_mdp_nodeinfo {
   time_ms_t time_since_last_observation;
 } overlay_mdp_nodeinfo;
 
+/* Server stats as "key=value" lines of text.  As many whole lines as fit are returned
+   in each reply, so clients ask again from first_line+line_count until they have total_lines.
+ */
+typedef struct overlay_mdp_stats {
+  unsigned int first_line;
+  unsigned int line_count;
+  unsigned int total_lines;
+  unsigned int text_length;
+  char text[MDP_MTU-100];
+} overlay_mdp_stats;
+
 typedef struct overlay_mdp_frame {
   uint16_t packetTypeAndFlags;
   union {
@@ -755,6 +924,7 @@ typedef struct overlay_mdp_frame {
     sockaddr_mdp bind;
     overlay_mdp_addrlist addrlist;
     overlay_mdp_nodeinfo nodeinfo;
+    overlay_mdp_stats stats;
     overlay_mdp_error error;
     /* 2048 is too large (causes EMSGSIZE errors on OSX, but probably fine on
        Linux) */
@@ -810,6 +980,7 @@ int cli_putchar(char c);
 int cli_puts(const char *str);
 int cli_printf(const char *fmt, ...);
 int cli_delim(const char *opt);
+void cli_keyvalues(char *text);
 
 int is_configvarname(const char *arg);
 
@@ -817,6 +988,7 @@ int overlay_mdp_getmyaddr(int index,unsigned char *sid);
 int overlay_mdp_bind(unsigned char *localaddr,int port); 
 int overlay_route_node_info(overlay_mdp_frame *mdp,
 			    struct sockaddr_un *addr,int addrlen);
+void overlay_interface_unregister(char *name, struct in_addr *addr, struct in_addr *mask);
 int overlay_interface_register(char *name,
 			       struct in_addr addr,
 			       struct in_addr mask);
@@ -832,6 +1004,7 @@ int app_pa_phone(int argc, const char *const *argv, struct command_line_option *
 #endif
 int app_monitor_cli(int argc, const char *const *argv, struct command_line_option *o, void *context);
 int app_vomp_console(int argc, const char *const *argv, struct command_line_option *o, void *context);
+int app_selftest(int argc, const char *const *argv, struct command_line_option *o, void *context);
 
 int monitor_get_fds(struct pollfd *fds,int *fdcount,int fdmax);
 
@@ -901,10 +1074,14 @@ int unschedule(struct sched_ent *alarm);
 int watch(struct sched_ent *alarm);
 int unwatch(struct sched_ent *alarm);
 int fd_poll();
+int fd_poll_backend(const char *name);
+time_ms_t fd_next_alarm();
+int fd_run_alarms(int max_calls);
 
 void overlay_interface_discover(struct sched_ent *alarm);
 void overlay_dummy_poll(struct sched_ent *alarm);
 void overlay_route_tick(struct sched_ent *alarm);
+void overlay_address_sweep(struct sched_ent *alarm);
 void rhizome_enqueue_suggestions(struct sched_ent *alarm);
 void server_shutdown_check(struct sched_ent *alarm);
 void overlay_mdp_poll(struct sched_ent *alarm);
@@ -918,11 +1095,24 @@ void rhizome_fetch_poll(struct sched_ent *alarm);
 void rhizome_server_poll(struct sched_ent *alarm);
 
 /* function timing routines */
+struct syscall_counters {
+  unsigned int polls;
+  unsigned int receives;
+  unsigned int sends;
+  unsigned int fcntls;
+};
+extern struct syscall_counters syscall_counters;
+
 int fd_clearstats();
 int fd_showstats();
+void fd_dumpstats(XPRINTF xpf);
+void fd_stats_keyvalues(XPRINTF xpf);
+void server_stats_keyvalues(XPRINTF xpf);
+time_ns_t fd_latency_percentile(struct profile_total *s, int percent);
 int fd_checkalarms();
 int fd_func_exit(struct call_stats *this_call);
 int fd_func_enter(struct call_stats *this_call);
+void fd_count_packets(struct profile_total *s, int count);
 void dump_stack();
 
 #define IN() static struct profile_total _aggregate_stats={NULL,0,__FUNCTION__,0,0,0}; \
@@ -124,6 +124,7 @@ int server(char *backing_file)
   sigaction(SIGHUP, &sig, NULL);
   sigaction(SIGINT, &sig, NULL);
   sigaction(SIGQUIT, &sig, NULL);
+  sigaction(SIGUSR1, &sig, NULL);
 
   if (!overlayMode)
     {
@@ -157,6 +158,7 @@ int server(char *backing_file)
  */
 void server_shutdown_check(struct sched_ent *alarm)
 {
+  overlay_capture_dump_check();
   if (servalShutdown) {
     INFO("Shutdown flag set -- terminating with cleanup");
     serverCleanUp();
@@ -365,6 +367,10 @@ void signal_handler(int signal)
       WHY("Asking Serval process to shutdown cleanly");
       servalShutdown = 1;
       return;
+    case SIGUSR1:
+      /* Write the packet capture from the main-line code, see server_shutdown_check() */
+      overlay_capture_dump_requested = 1;
+      return;
   }
   serverCleanUp();
   exit(0);
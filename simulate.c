@@ -1,6 +1,6 @@
-/* 
+/*
 Serval Distributed Numbering Architecture (DNA)
-Copyright (C) 2010 Paul Gardner-Stephen 
+Copyright (C) 2010 Paul Gardner-Stephen
 
 This program is free software; you can redistribute it and/or
 modify it under the terms of the GNU General Public License
@@ -17,7 +17,12 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <stddef.h>
+#include <sys/wait.h>
 #include "serval.h"
+#include "overlay_address.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
 
 double simulatedBER=0;
 
@@ -33,10 +38,848 @@ int dropPacketP(size_t packet_len)
   long berThreshold=0x7fffffff*simulatedBER;
 
   if (!simulatedBER) return 0;
-  
+
   for(i=0;i<packet_len;i++)
     for(b=0;b<8;b++)
       if (random()<=berThreshold) return 1;
 
   return 0;
 }
+
+/*
+  Mesh simulation.
+
+  Every simulated node runs in a child process of its own, forked before the node starts, so
+  each has its own copy of our global state; subscriber tree, routing tables, interfaces,
+  queues and scheduled alarms. The parent owns the virtual clock and the links between nodes,
+  and talks to each node over a socket pair.
+
+  Time only moves when the parent says so, one window at a time. Nothing a node sends can
+  arrive sooner than the link latency plus the millisecond it takes to send, so within a window
+  that long the nodes can't affect each other, and all of them can run at once. At the start of
+  each window the parent hands every node that has something to do the packets arriving during
+  it, and then waits on all of them together. Each node calls its alarms and receives its packets
+  in order of the virtual clock, until the end of the window. Then it replies with the packets it
+  sent and when it sent them, the time of its next alarm and how many other nodes it can reach.
+  Packets are delivered to each neighbour after the time it takes to send them over the link,
+  plus its latency.
+
+  All randomness comes from random(), seeded by the caller, and the parent reads each window's
+  replies in the same order, so the same seed will always produce the same run.
+ */
+
+// starting time of the virtual clock
+#define SIM_EPOCH 1000000000000LL
+// the most alarms a node can run without the clock moving
+#define SIM_MAX_CALLS 1000
+// larger than any packet a simulated interface will send
+#define SIM_MAX_PACKET 4096
+// room for the packets in one message, larger than any one of them
+#define SIM_MAX_BATCH 65536
+// how often a node counts the other nodes it can reach while its routes are changing,
+// it has to look at every one of them
+#define SIM_COUNT_MS 100
+
+/* Messages between the parent and a node */
+// parent: some of the packets arriving in this window, more will follow
+// node: some of the packets we sent, more will follow
+#define SIM_PACKETS 1
+// parent: the rest of the packets arriving, then run until time and reply with SIM_DONE
+#define SIM_RUN 2
+// parent: count how many other nodes you can reach now, and reply with SIM_DONE
+#define SIM_COUNT 3
+// node: the rest of the packets we sent, the time of our next alarm,
+// and how many other nodes we could reach when we last counted them
+#define SIM_DONE 4
+// parent: exit
+#define SIM_QUIT 5
+
+struct sim_message{
+  int type;
+  int reachable;
+  int len;
+  time_ms_t time;
+  // when the node last counted the nodes it can reach
+  time_ms_t counted_at;
+  // a sim_record for each packet
+  unsigned char bytes[SIM_MAX_BATCH];
+};
+
+#define SIM_HEADER_LEN (offsetof(struct sim_message, bytes))
+
+/* A packet in a message, and when it was sent or will arrive */
+struct sim_record{
+  time_ms_t time;
+  int len;
+  unsigned char bytes[];
+};
+
+// keeps every record in a message aligned
+#define SIM_RECORD_LEN(len) ((offsetof(struct sim_record, bytes) + (len) + 7) & ~7)
+
+struct sim_packet{
+  int refs;
+  int len;
+  unsigned char bytes[];
+};
+
+struct sim_delivery{
+  time_ms_t at;
+  // keeps deliveries at the same time in the order they were sent
+  unsigned long long order;
+  int node;
+  struct sim_packet *packet;
+};
+
+struct sim_node{
+  pid_t pid;
+  // our end of the node's socket pair
+  int fd;
+  // the time of this node's next alarm, or -1
+  time_ms_t wake_at;
+  // when our last packet will have finished being sent
+  time_ms_t tx_busy_until;
+  // when this node could first reach every other node
+  time_ms_t converged_at;
+  // how many other nodes we could reach when we last ran
+  int reachable;
+  // is this node running in the current window
+  int running;
+  int *links;
+  int link_count;
+  int link_size;
+};
+
+struct simulation{
+  time_ms_t now;
+  int node_count;
+  struct sim_node *nodes;
+
+  struct sim_delivery *queue;
+  int queue_count;
+  int queue_size;
+  unsigned long long order;
+
+  // the deliveries in the current window, sorted by node
+  struct sim_delivery *window;
+  int window_size;
+
+  int latency_ms;
+  int loss_percent;
+  int64_t bits_per_second;
+
+  // the last time any node gained or lost a route
+  time_ms_t settled_at;
+
+  int64_t packets_sent;
+  int64_t bytes_sent;
+  int64_t delivered;
+  int64_t dropped;
+  int64_t activations;
+  int64_t windows;
+};
+
+// log what nodes are doing, not just their warnings and errors
+static int sim_log_nodes=0;
+static struct sim_message sim_msg;
+
+/* The state of a node, within its own process */
+static time_ms_t sim_clock;
+// the last time we called our alarms
+static time_ms_t sim_ran_at;
+// how many other nodes we could reach, and when we counted them
+static int sim_reachable=0;
+static time_ms_t sim_counted_at=-1;
+static unsigned int sim_counted_changes=0;
+static int sim_fd=-1;
+// packets sent while running, passed to the parent once we are done
+static struct sim_message sim_sent;
+// packets arriving in this window
+static unsigned char *sim_inbox=NULL;
+static int sim_inbox_len=0, sim_inbox_size=0;
+
+static int sim_link(struct sim_node *node, int neighbour)
+{
+  int i;
+  for (i=0;i<node->link_count;i++)
+    if (node->links[i]==neighbour)
+      return 0;
+  if (node->link_count>=node->link_size){
+    int size = node->link_size ? node->link_size*2 : 4;
+    int *links = realloc(node->links, size * sizeof(int));
+    if (!links)
+      return WHY("realloc() failed");
+    node->links=links;
+    node->link_size=size;
+  }
+  node->links[node->link_count++]=neighbour;
+  return 0;
+}
+
+static int sim_connect(struct simulation *sim, int a, int b)
+{
+  if (a==b)
+    return 0;
+  if (sim_link(&sim->nodes[a], b) || sim_link(&sim->nodes[b], a))
+    return -1;
+  return 0;
+}
+
+/* Join the nodes together, as a line, ring, grid, or connected at random */
+static int sim_topology(struct simulation *sim, const char *topology)
+{
+  int n = sim->node_count;
+  int i;
+  if (strcasecmp(topology, "line")==0 || strcasecmp(topology, "ring")==0){
+    for (i=1;i<n;i++)
+      if (sim_connect(sim, i-1, i))
+	return -1;
+    if (strcasecmp(topology, "ring")==0 && n>2 && sim_connect(sim, n-1, 0))
+      return -1;
+  }else if (strcasecmp(topology, "grid")==0){
+    int width=1;
+    while (width*width<n)
+      width++;
+    for (i=0;i<n;i++){
+      if ((i+1)%width && i+1<n && sim_connect(sim, i, i+1))
+	return -1;
+      if (i+width<n && sim_connect(sim, i, i+width))
+	return -1;
+    }
+  }else if (strcasecmp(topology, "random")==0){
+    // a random tree, so everyone is connected, then about as many links again
+    for (i=1;i<n;i++)
+      if (sim_connect(sim, i, random()%i))
+	return -1;
+    for (i=0;i<n;i++)
+      if (sim_connect(sim, random()%n, random()%n))
+	return -1;
+  }else
+    return WHYF("Unknown topology %s, expected line, ring, grid or random", topology);
+  return 0;
+}
+
+static int sim_delivery_before(struct sim_delivery *a, struct sim_delivery *b)
+{
+  if (a->at == b->at)
+    return a->order < b->order;
+  return a->at < b->at;
+}
+
+static int sim_delivery_compare(const void *a, const void *b)
+{
+  const struct sim_delivery *da=a, *db=b;
+  if (da->node != db->node)
+    return da->node < db->node ? -1 : 1;
+  return sim_delivery_before((struct sim_delivery *)da, (struct sim_delivery *)db) ? -1 : 1;
+}
+
+static int sim_queue_push(struct simulation *sim, struct sim_delivery *d)
+{
+  if (sim->queue_count>=sim->queue_size){
+    int size = sim->queue_size ? sim->queue_size*2 : 1024;
+    struct sim_delivery *queue = realloc(sim->queue, size * sizeof(struct sim_delivery));
+    if (!queue)
+      return WHY("realloc() failed");
+    sim->queue=queue;
+    sim->queue_size=size;
+  }
+  int i = sim->queue_count++;
+  while (i>0){
+    int parent=(i-1)/2;
+    if (!sim_delivery_before(d, &sim->queue[parent]))
+      break;
+    sim->queue[i]=sim->queue[parent];
+    i=parent;
+  }
+  sim->queue[i]=*d;
+  return 0;
+}
+
+static void sim_queue_pop(struct simulation *sim, struct sim_delivery *d)
+{
+  *d = sim->queue[0];
+  struct sim_delivery last = sim->queue[--sim->queue_count];
+  int i=0;
+  while (1){
+    int child=i*2+1;
+    if (child>=sim->queue_count)
+      break;
+    if (child+1<sim->queue_count && sim_delivery_before(&sim->queue[child+1], &sim->queue[child]))
+      child++;
+    if (!sim_delivery_before(&sim->queue[child], &last))
+      break;
+    sim->queue[i]=sim->queue[child];
+    i=child;
+  }
+  if (sim->queue_count)
+    sim->queue[i]=last;
+}
+
+static struct sim_packet *sim_packet_new(unsigned char *bytes, int len)
+{
+  struct sim_packet *packet = malloc(sizeof(struct sim_packet) + len);
+  if (!packet){
+    WHY("malloc() failed");
+    return NULL;
+  }
+  packet->refs=1;
+  packet->len=len;
+  bcopy(bytes, packet->bytes, len);
+  return packet;
+}
+
+static void sim_packet_release(struct sim_packet *packet)
+{
+  if (--packet->refs<=0)
+    free(packet);
+}
+
+static int sim_send(int fd, int type, struct sim_message *msg)
+{
+  msg->type=type;
+  if (send(fd, msg, SIM_HEADER_LEN + msg->len, 0) == -1)
+    return WHY_perror("send");
+  return 0;
+}
+
+/* Send a message that carries nothing but its type */
+static int sim_send_type(int fd, int type)
+{
+  struct sim_message msg;
+  bzero(&msg, SIM_HEADER_LEN);
+  return sim_send(fd, type, &msg);
+}
+
+static int sim_recv(int fd, struct sim_message *msg)
+{
+  ssize_t r = recv(fd, msg, sizeof(struct sim_message), 0);
+  if (r == -1)
+    return WHY_perror("recv");
+  if (r < (ssize_t)SIM_HEADER_LEN || r != (ssize_t)SIM_HEADER_LEN + msg->len)
+    return WHYF("Simulated node sent a truncated message (%d bytes)", (int)r);
+  return 0;
+}
+
+/* Add a packet to a message, first passing on what the message already holds if there
+   is no room left for it */
+static int sim_batch_add(int fd, struct sim_message *msg, time_ms_t time, unsigned char *bytes, int len)
+{
+  if (len>SIM_MAX_PACKET)
+    return WHYF("Simulated packet of %d bytes is too long", len);
+  if (msg->len + SIM_RECORD_LEN(len) > SIM_MAX_BATCH){
+    if (sim_send(fd, SIM_PACKETS, msg))
+      return -1;
+    msg->len=0;
+  }
+  struct sim_record *record = (struct sim_record *)&msg->bytes[msg->len];
+  record->time=time;
+  record->len=len;
+  bcopy(bytes, record->bytes, len);
+  msg->len+=SIM_RECORD_LEN(len);
+  return 0;
+}
+
+/* Called by overlay_broadcast_ensemble() in place of writing to a file or socket.
+   The parent sends it to everyone we are linked to once we have finished running */
+static int sim_node_transmit(overlay_interface *interface, unsigned char *bytes, int len)
+{
+  return sim_batch_add(sim_fd, &sim_sent, sim_clock, bytes, len);
+}
+
+static void sim_node_receive(unsigned char *bytes, int len)
+{
+  if (!overlay_interfaces)
+    return;
+  overlay_interface *interface=&overlay_interfaces[0];
+  if (interface->state!=INTERFACE_STATE_UP)
+    return;
+
+  unsigned char transaction_id[8];
+  struct sockaddr src_addr;
+  bzero(transaction_id, sizeof transaction_id);
+  bzero(&src_addr, sizeof src_addr);
+
+  interface->rx_packets++;
+  interface->rx_bytes+=len;
+  if (packetOk(interface, bytes, len, transaction_id, -1, &src_addr, sizeof src_addr, 1) == -1)
+    WARN("Unsupported packet from simulated interface");
+}
+
+/* Keep the packets arriving in this window until we run */
+static int sim_node_keep(struct sim_message *msg)
+{
+  if (sim_inbox_len + msg->len > sim_inbox_size){
+    int size = sim_inbox_size ? sim_inbox_size : SIM_MAX_BATCH;
+    while (size < sim_inbox_len + msg->len)
+      size*=2;
+    unsigned char *inbox = realloc(sim_inbox, size);
+    if (!inbox)
+      return WHY("realloc() failed");
+    sim_inbox=inbox;
+    sim_inbox_size=size;
+  }
+  bcopy(msg->bytes, &sim_inbox[sim_inbox_len], msg->len);
+  sim_inbox_len+=msg->len;
+  return 0;
+}
+
+static int sim_count_reachable(struct subscriber *subscriber, void *context)
+{
+  int r = subscriber_is_reachable(subscriber);
+  if (r!=REACHABLE_NONE && r!=REACHABLE_SELF)
+    (*(int *)context)++;
+  return 0;
+}
+
+/* Pass on everything we sent, then tell the parent when we next need to run */
+static int sim_node_done(int count)
+{
+  time_ms_t wake_at=fd_next_alarm();
+  if (wake_at!=-1 && wake_at<=sim_ran_at)
+    wake_at=sim_ran_at+1;
+  // the parent asks for a count at the end, in case a route changed without set_reachable()
+  if (count || (sim_counted_changes!=reachable_changes && sim_ran_at >= sim_counted_at + SIM_COUNT_MS)){
+    sim_reachable=0;
+    enum_subscribers(NULL, sim_count_reachable, &sim_reachable);
+    sim_counted_at=sim_ran_at;
+    sim_counted_changes=reachable_changes;
+  }
+
+  sim_sent.time=wake_at;
+  sim_sent.counted_at=sim_counted_at;
+  sim_sent.reachable=sim_reachable;
+  int ret=sim_send(sim_fd, SIM_DONE, &sim_sent);
+  sim_sent.len=0;
+  return ret;
+}
+
+/* Receive our packets and call our alarms in order, until the end of the window */
+static int sim_node_run(time_ms_t until)
+{
+  int offset=0;
+  while (1){
+    time_ms_t next=fd_next_alarm();
+    // an alarm that keeps scheduling itself for right now has to wait for the clock
+    if (next!=-1 && next<=sim_ran_at)
+      next=sim_ran_at+1;
+    if (offset<sim_inbox_len){
+      struct sim_record *record=(struct sim_record *)&sim_inbox[offset];
+      if (next==-1 || record->time<next)
+	next=record->time;
+    }
+    if (next==-1 || next>=until)
+      break;
+    // packets that arrive before we start are heard as we start
+    if (next>sim_clock)
+      sim_clock=next;
+
+    while (offset<sim_inbox_len){
+      struct sim_record *record=(struct sim_record *)&sim_inbox[offset];
+      if (record->time>sim_clock)
+	break;
+      sim_node_receive(record->bytes, record->len);
+      offset+=SIM_RECORD_LEN(record->len);
+    }
+    fd_run_alarms(SIM_MAX_CALLS);
+    sim_ran_at=sim_clock;
+  }
+  sim_inbox_len=0;
+  return sim_node_done(0);
+}
+
+/* Set up this node with an identity, an interface and the alarms a server would have */
+static int sim_node_init(int64_t bits_per_second)
+{
+  static struct sched_ent route_tick;
+  static struct profile_total route_tick_stats;
+
+  if (overlay_interface_table_init())
+    return -1;
+  overlay_queue_init();
+
+  unsigned char sid[SID_SIZE];
+  int i;
+  for (i=0;i<SID_SIZE;i++)
+    sid[i]=random();
+  // like the keyring, avoid sids that start with an address abbreviation code
+  while (sid[0]<0x10)
+    sid[0]=random();
+  my_subscriber = find_subscriber(sid, SID_SIZE, 1);
+  if (!my_subscriber)
+    return WHY("Could not create simulated subscriber");
+  set_reachable(my_subscriber, REACHABLE_SELF);
+
+  if (overlay_interface_init_simulated("sim", bits_per_second))
+    return WHY("Could not start simulated interface");
+
+  bzero(&route_tick, sizeof route_tick);
+  bzero(&route_tick_stats, sizeof route_tick_stats);
+  route_tick_stats.name="overlay_route_tick";
+  route_tick.stats=&route_tick_stats;
+  route_tick.function=overlay_route_tick;
+  route_tick.alarm=gettime_ms()+100;
+  route_tick.deadline=route_tick.alarm+100;
+  schedule(&route_tick);
+  return 0;
+}
+
+/* The body of a node's process, which does what the parent tells it until told to quit */
+static int sim_node_main(int fd, time_ms_t start, unsigned int seed, int64_t bits_per_second)
+{
+  sim_fd=fd;
+  sim_clock=start;
+  simulated_clock=&sim_clock;
+  overlay_simulated_transmit=sim_node_transmit;
+  srandom(seed);
+  // hundreds of nodes would spend more time logging their ordinary business than being simulated
+  if (!sim_log_nodes)
+    set_log_level(LOG_LEVEL_WARN);
+
+  if (sim_node_init(bits_per_second))
+    return -1;
+  sim_ran_at=start;
+  if (sim_node_done(1))
+    return -1;
+
+  while (1){
+    if (sim_recv(sim_fd, &sim_msg))
+      return -1;
+    switch (sim_msg.type){
+      case SIM_PACKETS:
+	if (sim_node_keep(&sim_msg))
+	  return -1;
+	break;
+      case SIM_RUN:
+	if (sim_node_keep(&sim_msg) || sim_node_run(sim_msg.time))
+	  return -1;
+	break;
+      case SIM_COUNT:
+	if (sim_node_done(1))
+	  return -1;
+	break;
+      case SIM_QUIT:
+	return 0;
+      default:
+	return WHYF("Unexpected simulator message %d", sim_msg.type);
+    }
+  }
+}
+
+/* Would a packet of this length be lost? */
+static int sim_drop(struct simulation *sim, int len)
+{
+  if (sim->loss_percent && random()%100 < sim->loss_percent)
+    return 1;
+  if (simulatedBER){
+    // the chance that every bit arrives intact, as tested bit by bit by dropPacketP()
+    double intact=1, p=1-simulatedBER;
+    unsigned int bits=len*8;
+    while (bits){
+      if (bits&1)
+	intact*=p;
+      p*=p;
+      bits>>=1;
+    }
+    if (random() > intact * 0x7fffffff)
+      return 1;
+  }
+  return 0;
+}
+
+/* A node sent a packet at this time, so everyone it is linked to will hear it,
+   unless it is lost on the way */
+static int sim_transmit(struct simulation *sim, struct sim_node *node, time_ms_t sent_at, unsigned char *bytes, int len)
+{
+  // the link is busy until the whole packet has been sent
+  time_ms_t start = node->tx_busy_until > sent_at ? node->tx_busy_until : sent_at;
+  node->tx_busy_until = start + (len * 8 * 1000LL + sim->bits_per_second - 1) / sim->bits_per_second;
+  sim->packets_sent++;
+  sim->bytes_sent+=len;
+
+  struct sim_packet *packet = sim_packet_new(bytes, len);
+  if (!packet)
+    return -1;
+
+  int i, ret=0;
+  for (i=0;i<node->link_count;i++){
+    if (sim_drop(sim, len)){
+      sim->dropped++;
+      continue;
+    }
+    struct sim_delivery d;
+    d.at = node->tx_busy_until + sim->latency_ms;
+    d.order = sim->order++;
+    d.node = node->links[i];
+    d.packet = packet;
+    if (sim_queue_push(sim, &d)){
+      ret=-1;
+      break;
+    }
+    packet->refs++;
+  }
+  sim_packet_release(packet);
+  return ret;
+}
+
+/* Pass on every packet in a node's message */
+static int sim_transmit_batch(struct simulation *sim, struct sim_node *node, struct sim_message *msg)
+{
+  int offset=0;
+  while (offset<msg->len){
+    struct sim_record *record=(struct sim_record *)&msg->bytes[offset];
+    if (sim_transmit(sim, node, record->time, record->bytes, record->len))
+      return -1;
+    offset+=SIM_RECORD_LEN(record->len);
+  }
+  return 0;
+}
+
+/* Read what a node sent until it tells us it is done */
+static int sim_wait(struct simulation *sim, struct sim_node *node)
+{
+  while (1){
+    if (sim_recv(node->fd, &sim_msg))
+      return -1;
+    switch (sim_msg.type){
+      case SIM_PACKETS:
+	if (sim_transmit_batch(sim, node, &sim_msg))
+	  return -1;
+	break;
+      case SIM_DONE:
+	if (sim_transmit_batch(sim, node, &sim_msg))
+	  return -1;
+	node->wake_at=sim_msg.time;
+	if (sim_msg.reachable!=node->reachable){
+	  node->reachable=sim_msg.reachable;
+	  if (sim_msg.counted_at > sim->settled_at)
+	    sim->settled_at=sim_msg.counted_at;
+	}
+	if (node->converged_at==-1 && sim_msg.reachable>=sim->node_count-1)
+	  node->converged_at=sim_msg.counted_at;
+	return 0;
+      default:
+	return WHYF("Unexpected simulator message %d", sim_msg.type);
+    }
+  }
+}
+
+/* Fork a process for this node, and wait for it to start */
+static int sim_start(struct simulation *sim, int i, time_ms_t start)
+{
+  struct sim_node *node=&sim->nodes[i];
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1)
+    return WHY_perror("socketpair");
+  unsigned int seed=random();
+  int64_t bits_per_second=sim->bits_per_second;
+
+  node->pid=fork();
+  if (node->pid==-1){
+    close(sv[0]);
+    close(sv[1]);
+    return WHY_perror("fork");
+  }
+  if (node->pid==0){
+    int j;
+    for (j=0;j<i;j++)
+      close(sim->nodes[j].fd);
+    close(sv[0]);
+    _exit(sim_node_main(sv[1], start, seed, bits_per_second) ? 1 : 0);
+  }
+  close(sv[1]);
+  node->fd=sv[0];
+  return sim_wait(sim, node);
+}
+
+static void sim_free(struct simulation *sim)
+{
+  int i;
+  while (sim->queue_count){
+    struct sim_delivery d;
+    sim_queue_pop(sim, &d);
+    sim_packet_release(d.packet);
+  }
+  free(sim->queue);
+  free(sim->window);
+  if (sim->nodes){
+    for (i=0;i<sim->node_count;i++){
+      struct sim_node *n=&sim->nodes[i];
+      if (n->pid>0){
+	sim_send_type(n->fd, SIM_QUIT);
+	close(n->fd);
+	int status;
+	if (waitpid(n->pid, &status, 0)!=-1 && (!WIFEXITED(status) || WEXITSTATUS(status)))
+	  WARNF("Simulated node %d did not exit cleanly", i);
+      }
+      free(n->links);
+    }
+    free(sim->nodes);
+  }
+  free(sim);
+}
+
+/* Take every delivery arriving before the end of the window off the queue, sorted by node */
+static int sim_window_deliveries(struct simulation *sim, time_ms_t until)
+{
+  int count=0;
+  while (sim->queue_count && sim->queue[0].at < until){
+    if (count>=sim->window_size){
+      int size = sim->window_size ? sim->window_size*2 : 1024;
+      struct sim_delivery *window = realloc(sim->window, size * sizeof(struct sim_delivery));
+      if (!window)
+	return WHY("realloc() failed");
+      sim->window=window;
+      sim->window_size=size;
+    }
+    sim_queue_pop(sim, &sim->window[count++]);
+  }
+  qsort(sim->window, count, sizeof(struct sim_delivery), sim_delivery_compare);
+  return count;
+}
+
+static int sim_run(struct simulation *sim, time_ms_t end)
+{
+  // nothing sent in a window can arrive before it ends
+  time_ms_t lookahead = sim->latency_ms + 1;
+  while (1){
+    // what happens next?
+    int i;
+    time_ms_t next=-1;
+    for (i=0;i<sim->node_count;i++)
+      if (sim->nodes[i].wake_at!=-1 && (next==-1 || sim->nodes[i].wake_at < next))
+	next=sim->nodes[i].wake_at;
+    if (sim->queue_count && (next==-1 || sim->queue[0].at < next))
+      next=sim->queue[0].at;
+    if (next==-1 || next>end)
+      break;
+
+    time_ms_t until = next + lookahead;
+    if (until > end+1)
+      until = end+1;
+    sim->now=next;
+    sim->windows++;
+
+    int count=sim_window_deliveries(sim, until);
+    if (count==-1)
+      return -1;
+
+    // start everyone who has something to do, before waiting on any of them
+    int d=0;
+    for (i=0;i<sim->node_count;i++){
+      struct sim_node *n=&sim->nodes[i];
+      n->running = n->wake_at!=-1 && n->wake_at<until;
+      sim_msg.len=0;
+      for (;d<count && sim->window[d].node==i;d++){
+	struct sim_delivery *delivery=&sim->window[d];
+	int ret=sim_batch_add(n->fd, &sim_msg, delivery->at, delivery->packet->bytes, delivery->packet->len);
+	sim_packet_release(delivery->packet);
+	if (ret)
+	  return -1;
+	sim->delivered++;
+	n->running=1;
+      }
+      if (!n->running)
+	continue;
+      sim_msg.time=until;
+      if (sim_send(n->fd, SIM_RUN, &sim_msg))
+	return -1;
+      sim->activations++;
+    }
+
+    for (i=0;i<sim->node_count;i++)
+      if (sim->nodes[i].running && sim_wait(sim, &sim->nodes[i]))
+	return -1;
+  }
+  sim->now=end;
+  return 0;
+}
+
+static int sim_report(struct simulation *sim, time_ns_t real_ns)
+{
+  int i;
+  int64_t links=0, reachable=0;
+  time_ms_t converged=0;
+  for (i=0;i<sim->node_count;i++){
+    struct sim_node *n=&sim->nodes[i];
+    links+=n->link_count;
+    // routes can be gained or lost since they were last counted, so ask everyone where they are now
+    if (sim_send_type(n->fd, SIM_COUNT) || sim_wait(sim, n))
+      return -1;
+    reachable+=n->reachable;
+    if (converged!=-1)
+      converged = (n->converged_at==-1) ? -1 : (n->converged_at > converged ? n->converged_at : converged);
+  }
+
+  int64_t pairs = (int64_t)sim->node_count*(sim->node_count-1);
+  cli_printf("nodes:%d\n", sim->node_count);
+  cli_printf("links:%lld\n", (long long)links/2);
+  cli_printf("simulated_ms:%lld\n", (long long)(sim->now - SIM_EPOCH));
+  cli_printf("converged_ms:%lld\n", (long long)(converged==-1 ? -1 : converged - SIM_EPOCH));
+  cli_printf("settled_ms:%lld\n", (long long)(sim->settled_at - SIM_EPOCH));
+  cli_printf("reachable_percent:%.2f\n", pairs ? reachable * 100.0 / pairs : 100.0);
+  cli_printf("packets_sent:%lld\n", (long long)sim->packets_sent);
+  cli_printf("bytes_sent:%lld\n", (long long)sim->bytes_sent);
+  cli_printf("packets_delivered:%lld\n", (long long)sim->delivered);
+  cli_printf("packets_dropped:%lld\n", (long long)sim->dropped);
+  cli_printf("windows:%lld\n", (long long)sim->windows);
+  cli_printf("activations:%lld\n", (long long)sim->activations);
+  cli_printf("real_ms:%lld\n", (long long)(real_ns / 1000000));
+  cli_printf("speedup:%.2f\n", real_ns ? (sim->now - SIM_EPOCH) * 1e6 / real_ns : 0.0);
+  return 0;
+}
+
+/* Simulate a mesh of nodes joined together in the given topology, for the given number of
+   virtual milliseconds, and report how long it took for every node to find every other node */
+int simulate_mesh(int node_count, time_ms_t duration_ms, const char *topology, unsigned int seed)
+{
+  if (node_count<1)
+    return WHY("At least one node is required");
+
+  struct simulation *sim = calloc(1, sizeof(struct simulation));
+  if (!sim)
+    return WHY("calloc() failed");
+  sim->node_count=node_count;
+  sim->latency_ms = confValueGetInt64Range("simulate.latency_ms", 5LL, 0LL, 3600000LL);
+  sim->loss_percent = confValueGetInt64Range("simulate.loss_percent", 0LL, 0LL, 100LL);
+  sim->bits_per_second = confValueGetInt64Range("simulate.bits_per_second", 1000000LL, 1LL, 1000000000000LL);
+  simulatedBER = atof(confValueGet("simulate.ber", "0"));
+  sim_log_nodes = confValueGetBoolean("simulate.log_nodes", 0);
+  INFOF("Simulating %d nodes for %lldms, latency=%dms, loss=%d%%, ber=%g, bits_per_second=%lld",
+	node_count, (long long)duration_ms, sim->latency_ms, sim->loss_percent, simulatedBER,
+	(long long)sim->bits_per_second);
+
+  srandom(seed);
+  sim->nodes = calloc(node_count, sizeof(struct sim_node));
+  if (!sim->nodes || sim_topology(sim, topology)){
+    sim_free(sim);
+    return WHY("Could not set up simulated nodes");
+  }
+
+  time_ns_t real_start = gettime_ns();
+  sim->settled_at=SIM_EPOCH;
+
+  int ret=-1, i;
+  for (i=0;i<node_count;i++){
+    sim->nodes[i].fd=-1;
+    sim->nodes[i].wake_at=-1;
+    sim->nodes[i].converged_at=-1;
+  }
+
+  // start everyone at a different point in their tick
+  for (i=0;i<node_count;i++){
+    if (sim_start(sim, i, SIM_EPOCH + random()%500)){
+      WHYF("Could not start simulated node %d", i);
+      goto end;
+    }
+  }
+
+  if (sim_run(sim, SIM_EPOCH + duration_ms))
+    goto end;
+
+  ret = sim_report(sim, gettime_ns() - real_start);
+
+end:
+  sim_free(sim);
+  return ret;
+}
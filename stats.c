@@ -0,0 +1,97 @@
+/*
+ Serval Distributed Numbering Architecture (DNA)
+ Copyright (C) 2012 Serval Project Inc.
+ 
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+ 
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "serval.h"
+#include "rhizome.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
+
+/* Write a snapshot of the server's counters as "key=value" lines.
+   This is what MDP_STATS requests, and the "stats" command, return.
+ */
+void server_stats_keyvalues(XPRINTF xpf)
+{
+  int i;
+  
+  fd_stats_keyvalues(xpf);
+  op_pool_stats_keyvalues(xpf);
+  ob_pool_stats_keyvalues(xpf);
+  
+  for (i=0;i<OQ_MAX;i++){
+    overlay_txqueue *queue=&overlay_tx[i];
+    xprintf(xpf, "queue.%s.length=%d\n", overlay_queue_names[i], queue->length);
+    xprintf(xpf, "queue.%s.max_length=%d\n", overlay_queue_names[i], queue->maxLength);
+    xprintf(xpf, "queue.%s.dropped=%u\n", overlay_queue_names[i], queue->dropped);
+    xprintf(xpf, "queue.%s.expired=%u\n", overlay_queue_names[i], queue->expired);
+    xprintf(xpf, "queue.%s.weight=%d\n", overlay_queue_names[i], queue->weight);
+    xprintf(xpf, "queue.%s.deficit=%d\n", overlay_queue_names[i], queue->deficit);
+    xprintf(xpf, "queue.%s.sent_frames=%u\n", overlay_queue_names[i], queue->sent_frames);
+    xprintf(xpf, "queue.%s.sent_bytes=%llu\n", overlay_queue_names[i], queue->sent_bytes);
+    xprintf(xpf, "queue.%s.achieved_bits_per_second=%u\n", overlay_queue_names[i], queue->achieved_bits_per_second);
+    xprintf(xpf, "queue.%s.delay_ms_avg=%.1f\n", overlay_queue_names[i],
+	    queue->sent_frames?(double)queue->delay_total_ms / queue->sent_frames:0.0);
+    xprintf(xpf, "queue.%s.delay_ms_max=%u\n", overlay_queue_names[i], queue->delay_max_ms);
+  }
+  
+  for (i=0;i<overlay_interface_count;i++){
+    overlay_interface *interface=&overlay_interfaces[i];
+    if (interface->state==INTERFACE_STATE_FREE)
+      continue;
+    xprintf(xpf, "interface.%d.name=%s\n", i, interface->name);
+    xprintf(xpf, "interface.%d.state=%s\n", i, 
+	    interface->state==INTERFACE_STATE_UP?"up":
+	    interface->state==INTERFACE_STATE_DETECTING?"detecting":"down");
+    xprintf(xpf, "interface.%d.up_to_announce_ms=%d\n", i, interface->up_to_announce_ms);
+    xprintf(xpf, "interface.%d.rx_packets=%u\n", i, interface->rx_packets);
+    xprintf(xpf, "interface.%d.rx_bytes=%llu\n", i, interface->rx_bytes);
+    xprintf(xpf, "interface.%d.rx_frames=%u\n", i, interface->rx_frames);
+    xprintf(xpf, "interface.%d.tx_packets=%u\n", i, interface->tx_packets);
+    xprintf(xpf, "interface.%d.tx_bytes=%llu\n", i, interface->tx_bytes);
+    xprintf(xpf, "interface.%d.rx_own_packets=%u\n", i, interface->rx_own_packets);
+    xprintf(xpf, "interface.%d.bits_per_second=%d\n", i, interface->bits_per_second);
+    xprintf(xpf, "interface.%d.achieved_bits_per_second=%u\n", i, interface->achieved_bits_per_second);
+    xprintf(xpf, "interface.%d.tokens=%lld\n", i, interface->tokens);
+    xprintf(xpf, "interface.%d.deferred_frames=%u\n", i, interface->deferred_frames);
+    xprintf(xpf, "interface.%d.deferred_bytes=%llu\n", i, interface->deferred_bytes);
+    xprintf(xpf, "interface.%d.copies_sent=%u\n", i, interface->copies_sent);
+    xprintf(xpf, "interface.%d.nacks_sent=%u\n", i, interface->nacks_sent);
+    xprintf(xpf, "interface.%d.nacks_received=%u\n", i, interface->nacks_received);
+    xprintf(xpf, "interface.%d.retransmitted_frames=%u\n", i, interface->retransmitted_frames);
+    xprintf(xpf, "interface.%d.address_bytes_saved=%lld\n", i, interface->address_bytes_saved);
+    xprintf(xpf, "interface.%d.address_bytes_saved_per_packet=%.2f\n", i,
+	    interface->tx_packets?(double)interface->address_bytes_saved / interface->tx_packets:0.0);
+    xprintf(xpf, "interface.%d.index_resyncs=%u\n", i, interface->index_resyncs);
+    xprintf(xpf, "interface.%d.tx_frames_packed=%u\n", i, interface->tx_frames_packed);
+    xprintf(xpf, "interface.%d.tx_frames_skipped=%u\n", i, interface->tx_frames_skipped);
+    xprintf(xpf, "interface.%d.fill_ratio=%.3f\n", i,
+	    interface->tx_fill_capacity?(double)interface->tx_fill_bytes / interface->tx_fill_capacity:0.0);
+  }
+  
+  overlay_route_stats_keyvalues(xpf);
+  overlay_broadcast_stats_keyvalues(xpf);
+  overlay_subscriber_stats_keyvalues(xpf);
+  overlay_capture_stats_keyvalues(xpf);
+  overlay_netlink_stats_keyvalues(xpf);
+  
+  xprintf(xpf, "rhizome.fetch.started=%u\n", rhizome_fetch_counters.started);
+  xprintf(xpf, "rhizome.fetch.completed=%u\n", rhizome_fetch_counters.completed);
+  xprintf(xpf, "rhizome.fetch.failed=%u\n", rhizome_fetch_counters.failed);
+  xprintf(xpf, "rhizome.fetch.bytes=%llu\n", rhizome_fetch_counters.bytes);
+  xprintf(xpf, "sqlite.busy_retries=%u\n", sqlite_busy_retries);
+}
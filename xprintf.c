@@ -70,6 +70,9 @@ void _cx_vprintf_mallocbuf(void *context, const char *fmt, va_list ap)
   if (mb->current) {
     if (mb->current + 1 >= mb->buffer + mb->size)
       grow_mallocbuf(mb, 1024);
+    // the va_list cannot be used twice, so keep a copy in case the buffer needs to grow
+    va_list ap2;
+    va_copy(ap2, ap);
     int n = vsnprintf(mb->current, mb->buffer + mb->size - mb->current, fmt, ap);
     char *newcurrent = mb->current + n;
     char *end = mb->buffer + mb->size;
@@ -77,7 +80,7 @@ void _cx_vprintf_mallocbuf(void *context, const char *fmt, va_list ap)
       mb->current = newcurrent;
     else {
       grow_mallocbuf(mb, newcurrent - end + 1);
-      n = vsnprintf(mb->current, mb->buffer + mb->size - mb->current, fmt, ap);
+      n = vsnprintf(mb->current, mb->buffer + mb->size - mb->current, fmt, ap2);
       char *newcurrent = mb->current + n;
       char *end = mb->buffer + mb->size;
       if (newcurrent < end)
@@ -87,5 +90,6 @@ void _cx_vprintf_mallocbuf(void *context, const char *fmt, va_list ap)
 	*mb->current = '\0';
       }
     }
+    va_end(ap2);
   }
 }